@@ -13,22 +13,33 @@
 #include "needleman_wunsch.h"
 #include "global.h"
 #include "hashmap.h"
+#include "nj.h"
+#include "guidetree.h"
+#include "clusterdist.h"
+#include "treeutils.h"
+#include "flattree.h"
+#include "sitepatterns.h"
+#include "likekernels.h"
+#include "rootprofile.h"
+#include "threadpool.h"
+#include "opt.h"
 #include "WFA2/wavefront_align.h"
 
+//kalign/run_kalign.c; its struct node clashes with ours, so the header is not included
+struct kalign_engine;
+int alloc_kalign_engine(struct kalign_engine** engine);
+void free_kalign_engine(struct kalign_engine* e);
+int main_kalign(struct kalign_engine* engine, int number_of_seqs, char** names_of_sequences, char** sequences_in_cluster, uint8_t** columns, int* aln_len, int num_threads);
+
 //struct hashmap map;
 char*** clusters;
+int** clusterIds;
+distCache* distanceCache;
 //char** seqNames;
 //char** sequences;
 pthread_mutex_t lock;
-double LRVECnc[4][4], RRVECnc[4][4], RRVALnc[4], PMATnc[2][4][5];
 double LRVEC[STATESPACE][STATESPACE], RRVEC[STATESPACE][STATESPACE], RRVAL[STATESPACE], PMAT1[STATESPACE][STATESPACE], PMAT2[STATESPACE][STATESPACE];
-double parameters[10] = {0.0,1.0,1.0,1.0,1.0,1.0,1.0,1.0,1.0,1.0};
-int COUNT2;//counting the number of tiems the likelihood function is called.
-int COUNT; //this one counts how many times the likelihood function has been called
-int localnode;
-double *localpi, *statevector, *UFCnc, **templike_nc;
 double Logfactorial[MAXNUMBEROFINDINSPECIES];
-double currentestimate[10]; //DELETEME
 node** treeArr;
 char** rootSeqs;
 double** distMat;
@@ -107,13 +118,32 @@ void printtree_newick(int node,int whichTree, FILE* outfile){
 	fprintf(outfile,";\n");
 	fclose(outfile);
 }
-void assignDepth(node** tree, int node0, int node1, int depth, int whichTree){
-	if( node0 != -1 && node1 != -1){
-		tree[whichTree][node0].depth = depth;
-		tree[whichTree][node1].depth = depth;
-		assignDepth(tree,tree[whichTree][node0].up[0], tree[whichTree][node0].up[1],depth+1, whichTree);
-		assignDepth(tree,tree[whichTree][node1].up[0], tree[whichTree][node1].up[1],depth+1, whichTree);
+void assignDepth(node** tree, int node0, int node1, int depth, int whichTree, int number_of_nodes){
+	//explicit stack of (node,depth) pairs so deep trees cannot run out of thread stack
+	int top, node, nodeDepth;
+	if (node0 == -1 || node1 == -1){
+		return;
 	}
+	int* stack = (int *)malloc(2*(number_of_nodes+2)*sizeof(int));
+	stack[0]=node1;
+	stack[1]=depth;
+	stack[2]=node0;
+	stack[3]=depth;
+	top=2;
+	while(top > 0){
+		top--;
+		node = stack[2*top];
+		nodeDepth = stack[2*top+1];
+		tree[whichTree][node].depth = nodeDepth;
+		if (tree[whichTree][node].up[0] != -1 && tree[whichTree][node].up[1] != -1){
+			stack[2*top] = tree[whichTree][node].up[1];
+			stack[2*top+1] = nodeDepth+1;
+			stack[2*top+2] = tree[whichTree][node].up[0];
+			stack[2*top+3] = nodeDepth+1;
+			top=top+2;
+		}
+	}
+	free(stack);
 }
 void readInFasta(FILE* fasta, char** seqNames, char** sequences){
 	char buffer[FASTA_MAXLINE];
@@ -352,181 +382,51 @@ int seqid(int i, int j, int number_of_sequences, int** seq){
 	}
 	return 1;
 }
-void updateChooseK(int* chooseK, int index, int clusterSize){
-	int i;
-	int tmp[clusterSize];
-	for(i=0; i<clusterSize; i++){
-		tmp[i] = chooseK[i];
-	}
-	for(i=0; i<clusterSize-1; i++){
-		if ( i>=index ){
-			chooseK[i]=tmp[i+1];
-		}
-	}
-}
-//this algorithm takes an nxn upper triangular matrix and converts it to an (n-1)x(n-1)
-//upper triangular matrix by deleting row k and column k
-void updatematrix(double **matrix, int k, int n){
-	int i,j;
-	for (i=0; i<n; i++){
-		for (j=i+1; j<n; j++){
-			if (i>=k && j>=k){
-				matrix[i][j]=matrix[i+1][j+1];
-			}else if (i>=k) {
-				matrix[i][j]=matrix[i+1][j];
-			}else if (j>=k) {
-				matrix[i][j]=matrix[i][j+1];
-			}
-		}
-	}
-}
-int NJ(node** tree, double** distMat,int clusterSize,int whichTree, int whichTree2){
-	double *r, minval, D, u1;
-	int child1, child2, i, j, n, min, pair[2], newnode, *nodenum;
-	r = malloc(clusterSize*(sizeof(double)));
-	nodenum = malloc(clusterSize*(sizeof(int)));
-	n=clusterSize;
-	int* index = (int *)malloc(clusterSize*sizeof(int));
-	for(i=0; i<clusterSize; i++){
-		nodenum[i]=i;
-		tree[whichTree][i].up[0]=tree[whichTree][i].up[1]=-1;
-		index[i]=i;
-	}
-	//recurse until tree is found
-	do{
-		for (i=0; i<n; i++){
-			r[i]=0;
-			for (j=0; j<i; j++){
-				r[i] = r[i] + distMat[j][i];
-			}
-			for (j=i+1; j<n; j++){
-				r[i] = r[i] + distMat[i][j];
-			}
-			r[i] = r[i]/(double)(n-2);
-		}
-		//find minival value of D
-		minval = DISTMAX;
-		for (i=0; i<n; i++){
-			for (j=i+1; j<n; j++){
-				if ((D=distMat[i][j] -(r[i]+r[j])) < minval){
-					minval=D;
-					pair[0]=i;
-					pair[1]=j;
-				}
-			}
-		}
-		if (minval==DISTMAX) {
-			printf("error in 'NJ' (%lf, %i)",minval,n); exit(-1);
-		}
-		newnode=2*clusterSize-n;
-		child1 = nodenum[pair[0]];
-		child2 = nodenum[pair[1]];
-		tree[whichTree][newnode].up[0]=child1;
-		tree[whichTree][newnode].up[1]=child2;
-		tree[whichTree][child1].down=newnode;
-		tree[whichTree][child2].down=newnode;
-		if (tree[whichTree][child1].up[0]==-1){
-			strcpy(tree[whichTree][child1].name,clusters[whichTree2][index[pair[0]]]);
-		}
-		if (tree[whichTree][child2].up[1]==-1){
-			strcpy(tree[whichTree][child2].name,clusters[whichTree2][index[pair[1]]]);
-		}
-		// HERE WE DISALLOW NEGATIVE BRANCHLENGTHS!  IS THIS THE BEST THING TO DO?
-		tree[whichTree][child2].distance = distMat[pair[0]][pair[1]];
-		if ((u1 = (distMat[pair[0]][pair[1]] +r[pair[0]]-r[pair[1]])/2.0) < MINBL){
-			tree[whichTree][child1].bl = MINBL;
-		}else{
-			tree[whichTree][child1].bl = u1;
-		}
-		if ((tree[whichTree][child2].bl = distMat[pair[0]][pair[1]]-u1) < MINBL)/*(DM[pair[0]][pair[1]] +r[pair[1]]-r[pair[0]])/2.0;*/{
-			tree[whichTree][child2].bl = MINBL;
-			tree[whichTree][child2].distance = distMat[pair[0]][pair[1]];
-		}
-		for (i=0; i<n; i++){
-			if (i != pair[0] && i != pair[1]){
-				if (i<pair[0]) {
-					distMat[i][n] = (distMat[i][pair[0]]+distMat[i][pair[1]] - distMat[pair[0]][pair[1]])/2.0;
-				}else if (i<pair[1]){
-					distMat[i][n] = (distMat[pair[0]][i]+distMat[i][pair[1]] - distMat[pair[0]][pair[1]])/2.0;
-				}else{
-					distMat[i][n] = (distMat[pair[0]][i]+distMat[pair[1]][i] - distMat[pair[0]][pair[1]])/2.0;
-				}
-			}
-		}
-		for (i=pair[0]; i<pair[1]-1;i++){
-			nodenum[i]=nodenum[i+1];
-		}
-		for (i=pair[1]-1; i<n-2;i++){
-			nodenum[i]=nodenum[i+2];
-		}
-		nodenum[n-2]=newnode;
-		updatematrix(distMat, pair[1], n+1);
-		updatematrix(distMat, pair[0], n);
-		updateChooseK(index, pair[1], clusterSize);
-		updateChooseK(index, pair[0], clusterSize);
-		n--;
-	} while (n>2);
-	if (clusterSize>2){
-	newnode=2*clusterSize-2;
-	child1 = nodenum[0];
-	child2 = nodenum[1];
-	tree[whichTree][newnode].up[0]=child1;
-	tree[whichTree][newnode].up[1]=child2;
-	tree[whichTree][newnode].down=-1;
-	tree[whichTree][newnode].bl=-1.0;
-	tree[whichTree][child1].down=newnode;
-	tree[whichTree][child2].down=newnode;
-	if (tree[whichTree][child1].up[0]==-1 ){
-		strcpy(tree[whichTree][child1].name,clusters[whichTree2][index[0]]);
-	}
-	if (tree[whichTree][child2].up[0]==-1 /*&& strcmp(tree[whichTree][child2].name,"internal")==0*/){
-		strcpy(tree[whichTree][child1].name,clusters[whichTree2][index[0]]);
-	}	
-	if (distMat[0][1] > MINBL*2.0)  // HERE WE DISALLOW NEGATIVE BRANCHLENGTHS!  IS THIS THE BEST THING TO DO?
-		tree[whichTree][child1].bl = tree[whichTree][child2].bl = distMat[0][1]/2.0;
-	else tree[whichTree][child1].bl = tree[whichTree][child2].bl = MINBL;
-	//for (i=0; i<opt.number_of_kseqs+1; i++){
-	//	free(distMat[i]);
-	//}
-	//free(distMat);
-	}
-	free(nodenum);
-	free(r);
-	free(index);
-	return(newnode);
-}
 void printtree(node** tree, int whichTree, int clusterSize){
 	int i;
 	for(i=0; i<2*clusterSize-1; i++){
 		printf("%i: up: %i %i, down: %i, bl: %f, depth: %d, distanceFR: %lf, clusternumber: %d, nd: %d\n",i,tree[whichTree][i].up[0],tree[whichTree][i].up[1],tree[whichTree][i].down,tree[whichTree][i].bl/*totsites*/,tree[whichTree][i].depth,tree[whichTree][i].distanceFromRoot,tree[whichTree][i].clusterNumber,tree[whichTree][i].nd);
 	}
 }
+static int compare_branch_entry(const void* a, const void* b){
+	//longest first, ties broken by node number so the cut order is reproducible
+	const branchEntry* x = (const branchEntry *)a;
+	const branchEntry* y = (const branchEntry *)b;
+	if (x->bl > y->bl) return -1;
+	if (x->bl < y->bl) return 1;
+	return x->index - y->index;
+}
 void sortArray(double* branchLengths, int* indexArray, int kseqs){
-	int i,j, tmp2;
-	double tmp;
-	//Bubble Sort
+	int i;
+	branchEntry* entries = (branchEntry *)malloc((2*kseqs-1)*sizeof(branchEntry));
 	for(i=0; i<2*kseqs-1; i++){
-		indexArray[i]=i;
+		entries[i].bl = branchLengths[i];
+		entries[i].index = i;
 	}
-	for(i=0; i<2*kseqs; i++){
-		for(j=i+1;j<2*kseqs-1;j++){
-			if(branchLengths[i] < branchLengths[j]){
-				tmp=branchLengths[i];
-				branchLengths[i] = branchLengths[j];
-				branchLengths[j] = tmp;
-				tmp2=indexArray[i];
-				indexArray[i] = indexArray[j];
-				indexArray[j]=tmp2;
-			}
-		}
+	qsort(entries,2*kseqs-1,sizeof(branchEntry),compare_branch_entry);
+	for(i=0; i<2*kseqs-1; i++){
+		branchLengths[i] = entries[i].bl;
+		indexArray[i] = entries[i].index;
 	}
+	free(entries);
 	/*for(i=0; i<2*opt.number_of_kseqs-1; i++){
 		printf("branchLengths[%d]: %lf\n",i,branchLengths[i]);
 	}*/
 }
-int get_number_descendants(node** tree, int node, int whichTree){
-	if (tree[whichTree][node].up[0]==-1)  return (tree[whichTree][node].nd=1);
-	else return (tree[whichTree][node].nd=(get_number_descendants(tree,tree[whichTree][node].up[0],whichTree)+get_number_descendants(tree,tree[whichTree][node].up[1],whichTree)));
+int get_number_descendants(node** tree, int node, int whichTree, int number_of_nodes){
+	int i, current;
+	int* order = (int *)malloc(number_of_nodes*sizeof(int));
+	int count = flattree_postorder(tree,whichTree,node,number_of_nodes,order);
+	for(i=0; i<count; i++){
+		current = order[i];
+		if (tree[whichTree][current].up[0]==-1){
+			tree[whichTree][current].nd=1;
+		}else{
+			tree[whichTree][current].nd=tree[whichTree][tree[whichTree][current].up[0]].nd+tree[whichTree][tree[whichTree][current].up[1]].nd;
+		}
+	}
+	free(order);
+	return tree[whichTree][node].nd;
 }
 void printdescendants(node** tree, int node, int clusterNumber, int whichTree, int kseqs){
 	int child1 = tree[whichTree][node].up[0];
@@ -593,6 +493,8 @@ void *fillInMat_avg(void *ptr){
 	int indexB_start = dstr->indexB_start;
 	int indexB_end = dstr->indexB_end;
 	int *clusterSize = dstr->clusterSize;
+	int** ids = dstr->ids;
+	double cached_distance;
 	//struct resultsStruct results = dstr->str;
 	/*affine_penalties_t affine_penalties = {
 		.match = 0,
@@ -628,6 +530,12 @@ void *fillInMat_avg(void *ptr){
 				l=0;
 				end_j=clusterSize[j];
 				while(l<end_j){
+					if (ids != NULL && distcache_get(distanceCache,ids[i][k],ids[j][l],&cached_distance)==1){
+						sum=sum+cached_distance;
+						number_of_pairs++;
+						l++;
+						continue;
+					}
 					/*affine_wavefronts_t* affine_wavefronts = affine_wavefronts_new_complete(strlen(dstr->seq[i][k]),strlen(dstr->seq[j][l]),&affine_penalties,NULL,mm_allocator);
 					affine_wavefronts_align(affine_wavefronts,dstr->seq[i][k],strlen(dstr->seq[i][k]),dstr->seq[j][l],strlen(dstr->seq[j][l]));
 					
@@ -637,19 +545,15 @@ void *fillInMat_avg(void *ptr){
 					char* const ops_alg = mm_allocator_calloc(wf_aligner->mm_allocator,strlen(dstr->seq[i][k])+strlen(dstr->seq[j][l])+1,char,true);
 					char* const text_alg = mm_allocator_calloc(wf_aligner->mm_allocator,strlen(dstr->seq[i][k])+strlen(dstr->seq[j][l])+1,char,true);
 					int alignment_length_initial = perform_WFA_alignment(wf_aligner->cigar,wf_aligner->mm_allocator,dstr->seq[i][k],dstr->seq[j][l],pattern_alg,text_alg,ops_alg,wf_aligner->cigar->begin_offset,wf_aligner->cigar->end_offset);
-					int** DATA = (int **)malloc(2*sizeof(int *));
-					int m;
-					for(m=0; m<2; m++){
-						DATA[m] = (int *)malloc(alignment_length_initial*sizeof(int));
-					}
+					int* scratch = (int *)threadpool_scratch(3*(size_t)alignment_length_initial*sizeof(int));
+					int* DATA[2] = {scratch, scratch+alignment_length_initial};
 					//memset(DATA, 0, sizeof(DATA[0][0]) * 2 * alignment_length_initial);
-					int* mult = (int *)malloc(alignment_length_initial*sizeof(int));
+					int* mult = scratch+2*alignment_length_initial;
 					int alignment_length = populate_DATA(pattern_alg,text_alg,DATA,alignment_length_initial,mult);
 					double distance=Get_dist_JC_avg(alignment_length,DATA,mult);
-					free(DATA[0]);
-					free(DATA[1]);
-					free(DATA);
-					free(mult);
+					if (ids != NULL){
+						distcache_put(distanceCache,ids[i][k],ids[j][l],distance);
+					}
 					mm_allocator_free(wf_aligner->mm_allocator,pattern_alg);
 					mm_allocator_free(wf_aligner->mm_allocator,ops_alg);
 					mm_allocator_free(wf_aligner->mm_allocator,text_alg);
@@ -669,7 +573,7 @@ void *fillInMat_avg(void *ptr){
 	average_on_columns=average_on_columns/number_of_columns;
 	//printf("AVERAGE: %lf\n",average_on_columns);
 	dstr->result=average_on_columns;
-	pthread_exit(NULL);
+	return NULL;
 }
 void *fillInMat(void *ptr){
 	struct distStruct *dstr = (distStruct *) ptr;
@@ -680,9 +584,16 @@ void *fillInMat(void *ptr){
 	if (end_i > end_j){
 		end_i = end_j;
 	}
+	int* ids = dstr->ids;
+	double** mat = dstr->mat;
+	double cached_distance;
 	int i,j;
 	for(i=start_i; i<end_i; i++){
 		for(j=start_j; j<end_j; j++){
+				if (ids != NULL && distcache_get(distanceCache,ids[i],ids[j],&cached_distance)==1){
+					mat[i][j] = cached_distance;
+					continue;
+				}
 				/*mm_allocator_t* const mm_allocator = mm_allocator_new(BUFFER_SIZE_16M);
 				affine_penalties_t affine_penalties = {
 					.match = 0,
@@ -711,19 +622,16 @@ void *fillInMat(void *ptr){
 				char* const ops_alg = mm_allocator_calloc(wf_aligner->mm_allocator,strlen(dstr->seq[i])+strlen(dstr->seq[j])+1,char,true);
 				char* const text_alg = mm_allocator_calloc(wf_aligner->mm_allocator,strlen(dstr->seq[i])+strlen(dstr->seq[j])+1,char,true);
 				int alignment_length = perform_WFA_alignment(wf_aligner->cigar,wf_aligner->mm_allocator,dstr->seq[i],dstr->seq[j],pattern_alg,text_alg,ops_alg,wf_aligner->cigar->begin_offset,wf_aligner->cigar->end_offset);	
-				int** DATA = (int **)malloc(2*sizeof(int *));
-				int k;
-				for(k=0; k<2; k++){
-					DATA[k] = (int *)malloc(alignment_length*sizeof(int));
-				}
-				int* mult = (int *)malloc(alignment_length*sizeof(int));
+				//both DATA rows and mult live in this thread's scratch arena
+				int* scratch = (int *)threadpool_scratch(3*(size_t)alignment_length*sizeof(int));
+				int* DATA[2] = {scratch, scratch+alignment_length};
+				int* mult = scratch+2*alignment_length;
 				alignment_length = populate_DATA(pattern_alg,text_alg,DATA,alignment_length,mult);
-				Get_dist_JC(alignment_length,distMat,DATA,mult,i,j);
+				Get_dist_JC(alignment_length,mat,DATA,mult,i,j);
+				if (ids != NULL){
+					distcache_put(distanceCache,ids[i],ids[j],mat[i][j]);
+				}
 				//mm_allocator_delete(mm_allocator);
-				free(mult);
-				free(DATA[0]);
-				free(DATA[1]);
-				free(DATA);
 				mm_allocator_free(wf_aligner->mm_allocator,pattern_alg);
 				mm_allocator_free(wf_aligner->mm_allocator,ops_alg);
 				mm_allocator_free(wf_aligner->mm_allocator,text_alg);
@@ -737,11 +645,10 @@ void *fillInMat(void *ptr){
 			}
 		}
 	}*/
-	pthread_exit(NULL);
+	return NULL;
 }
-void createDistMat_WFA(char** seqsInCluster, double** distMat, int clusterSize, int threads){
+void createDistMat_WFA(char** seqsInCluster, int* ids, double** distMat, int clusterSize, int threads){
 	int i,j;
-	pthread_t threads_array[threads];
 	int k;
 	distStruct dstr[threads];
 	//char* seq1 = (char *)malloc(2*fasta_specs[1]*sizeof(char));
@@ -763,6 +670,8 @@ void createDistMat_WFA(char** seqsInCluster, double** distMat, int clusterSize,
 			dstr[k].endj = clusterSize;
 		}
 		dstr[k].seq = seqsInCluster;
+		dstr[k].ids = ids;
+		dstr[k].mat = distMat;
 		l=l+divide;
 		m=m+divide;
 	}
@@ -848,12 +757,7 @@ void createDistMat_WFA(char** seqsInCluster, double** distMat, int clusterSize,
 				++k;
 			}*/
 			//}
-	for(k=0; k<threads; k++){
-		pthread_create(&threads_array[k], NULL,fillInMat, &dstr[k]); 
-	}
-	for(k=0; k<threads; k++){
-		pthread_join(threads_array[k], NULL);
-	}
+	threadpool_run(fillInMat,dstr,sizeof(distStruct),threads);
 			/*int alignment_length = perform_WFA_alignment(affine_wavefronts,mm_allocator,seq1,seq2,pattern_alg,text_alg);
 			int** DATA = (int **)malloc(2*sizeof(int *));
 			int k;
@@ -931,9 +835,8 @@ void updateNumberOfDescendants(node** tree, int node, int descendants, int which
 	tree[whichTree][node].nd=tree[whichTree][node].nd-descendants;
 	updateNumberOfDescendants(tree,parent,descendants,whichTree);
 }
-double calculateAverageDist_WFA(char*** cluster_seqs, int *clusterSizes, int threads,int number_of_clusters){
+double calculateAverageDist_WFA(char*** cluster_seqs, int** ids, int *clusterSizes, int threads,int number_of_clusters){
 	int i,j;
-	pthread_t threads_array[threads];
 	int k;
 	int l=1;
 	int m=0;
@@ -958,6 +861,7 @@ double calculateAverageDist_WFA(char*** cluster_seqs, int *clusterSizes, int thr
 			dstr[k].indexB_end = number_of_clusters;
 		}
 		dstr[k].seq = cluster_seqs;
+		dstr[k].ids = ids;
 		dstr[k].thread = k;
 		dstr[k].clusterSize = clusterSizes;
 		//dstr[k].indexA = indexA;
@@ -1042,12 +946,7 @@ double calculateAverageDist_WFA(char*** cluster_seqs, int *clusterSizes, int thr
 			free(seq2);
 		}
 	}*/
-	for(k=0; k<threads; k++){
-		pthread_create(&threads_array[k], NULL,fillInMat_avg, &dstr[k]);
-	}
-	for(k=0; k<threads; k++){
-		pthread_join(threads_array[k], NULL);
-	}
+	threadpool_run(fillInMat_avg,dstr,sizeof(distStruct_Avg),threads);
 	double totalDist=0;
 	for(k=0; k<threads; k++){
 		totalDist=totalDist+dstr[k].result;
@@ -1121,7 +1020,7 @@ void calculateAverageDist(char** seqsA, char** seqsB, int sizeA, int sizeB, int
 	alignment_free(aln);
 	needleman_wunsch_free(nw);
 }
-double findShortestDist_WFA(int index, char* seq, int clusterSize, double** distMat2, int** DATA, int* mult){
+double findShortestDist_WFA(int index, char* seq, int clusterSize, double** distMat2, int** DATA, int* mult, rootCigar* cigar){
 	int i,j;
 	wavefront_aligner_attr_t attributes = wavefront_aligner_attr_default;
 	attributes.distance_metric = gap_affine;
@@ -1198,6 +1097,10 @@ double findShortestDist_WFA(int index, char* seq, int clusterSize, double** dist
 		int alignment_length = strlen(pattern_alg);
 		alignment_length = populate_DATA(pattern_alg,text_alg,DATA,alignment_length,mult);
 		Get_dist_JC(alignment_length,distMat2,DATA,mult,i,0);
+		if (cigar != NULL){
+			//kept for the root profile in case this root turns out to be the closest
+			rootcigar_set(cigar,wf_aligner->cigar->operations+wf_aligner->cigar->begin_offset,wf_aligner->cigar->end_offset-wf_aligner->cigar->begin_offset);
+		}
 		mm_allocator_free(wf_aligner->mm_allocator,pattern_alg);
 		mm_allocator_free(wf_aligner->mm_allocator,ops_alg);
 		mm_allocator_free(wf_aligner->mm_allocator,text_alg);
@@ -1276,35 +1179,27 @@ void makeNewCluster(char*** clusterSeqs, int number_of_clusters, char* sequence_
 	strcpy(clusterSeqs[number_of_clusters][0],sequence_to_add);
 	strcpy(clusterSeqs[0][kseqs],sequence_to_add);
 }
-void addToCluster(int index, int clusterNumber, resultsStruct *results, int sizeOfChunk){
-	int i;
-	for(i=sizeOfChunk-1; i>=0; i--){
-		if (results->clusterNumber[i]!=-1){
-			break;
-		}
-	}
-	//strcpy(results->accession[i+1],sequence_to_add);
-	results->index[i+1]=index;
-	results->clusterNumber[i+1]=clusterNumber;
+void addToCluster(int index, int clusterNumber, resultsStruct *results, int place){
+	//strcpy(results->accession[place],sequence_to_add);
+	results->index[place]=index;
+	results->clusterNumber[place]=clusterNumber;
 }
 void printClusters(int start, int number_of_clusters, Options opt, char** taxonomy, mystruct mstr, int numToPrint, struct hashmap taxMap, int hasTaxFile, int* fasta_specs, int numberToAssign){
 	FILE *clusterFile, *clusterTaxFile;
 	char fileName[FASTA_MAXLINE];
 	char *directory = strdup(opt.output_directory);
 	int i, j, k;
-	char*** assignedSeqs = (char ***)malloc(number_of_clusters*sizeof(char **));
+	//assignedSeqs[c] holds the result positions of cluster c's reads, in read order
+	int** assignedSeqs = (int **)malloc(number_of_clusters*sizeof(int *));
 	for (i=0; i<number_of_clusters; i++){
-		assignedSeqs[i] = (char **)malloc(numberToAssign*sizeof(char *));
-		for(j=0; j<numberToAssign; j++){
-			assignedSeqs[i][j] = (char *)malloc((fasta_specs[2]+1)*sizeof(char));
-		}
+		assignedSeqs[i] = (int *)malloc(numberToAssign*sizeof(int));
 	}
 	int *clusterSizes = (int *)malloc(number_of_clusters*sizeof(int));
 	for(i=0; i<number_of_clusters; i++){
 		clusterSizes[i]=0;
 	}
 	for(i=0; i<numToPrint; i++){
-		strcpy(assignedSeqs[mstr.str->clusterNumber[i]-1][clusterSizes[mstr.str->clusterNumber[i]-1]],readsStruct->name[mstr.str->index[i]]);
+		assignedSeqs[mstr.str->clusterNumber[i]-1][clusterSizes[mstr.str->clusterNumber[i]-1]]=i;
 		clusterSizes[mstr.str->clusterNumber[i]-1]++;
 	}
 	for(i=1; i<number_of_clusters; i++){
@@ -1338,17 +1233,13 @@ void printClusters(int start, int number_of_clusters, Options opt, char** taxono
 			}
 		}*/
 		for(j=0; j<clusterSizes[i-1]; j++){
-			fprintf(clusterFile,">%s\n",assignedSeqs[i-1][j]);
+			k = assignedSeqs[i-1][j];
+			fprintf(clusterFile,">%s\n",readsStruct->name[mstr.str->index[k]]);
 			//fprintf(clusterFile,"%s\n",(char *)hashmap_get(&map,assignedSeqs[i-1][j]));
-			for(k=0; k<numToPrint; k++){
-				if ( strcmp(readsStruct->name[mstr.str->index[k]],assignedSeqs[i-1][j])==0 ){
-					break;
-				}
-			}
 			fprintf(clusterFile,"%s\n",readsStruct->sequence[mstr.str->index[k]]);
 			if (hasTaxFile==1){
 				//fprintf(clusterTaxFile,"%s\t%s\n",assignedSeqs[i-1][j],(char *)hashmap_get(&taxMap,assignedSeqs[i-1][j]));
-				fprintf(clusterTaxFile,"%s\t%s\n",assignedSeqs[i-1][j],readsStruct->taxonomy[mstr.str->index[k]]);
+				fprintf(clusterTaxFile,"%s\t%s\n",readsStruct->name[mstr.str->index[k]],readsStruct->taxonomy[mstr.str->index[k]]);
 			}
 		}
 		fclose(clusterFile);
@@ -1375,24 +1266,17 @@ void saveCLSTR(int start, int number_of_total_seqs, mystruct mstr, int numToPrin
 	for(i=0; i<number_of_clusters; i++){
 		clusterSizes[i]=0;
 	}
-	char*** assignedSeqs = (char ***)malloc(number_of_clusters*sizeof(char **));
+	int** assignedSeqs = (int **)malloc(number_of_clusters*sizeof(int *));
 	for (i=0; i<number_of_clusters; i++){
-		assignedSeqs[i] = (char **)malloc(numberToAssign*sizeof(char *));
-		for(j=0; j<numberToAssign; j++){
-			assignedSeqs[i][j] = (char *)malloc((fasta_specs[2]+1)*sizeof(char));
-		}
+		assignedSeqs[i] = (int *)malloc(numberToAssign*sizeof(int));
 	}
 	for(i=0; i<numToPrint; i++){
-		strcpy(assignedSeqs[start-1+mstr.str->clusterNumber[i]-1][clusterSizes[start-1+mstr.str->clusterNumber[i]-1]],readsStruct->name[mstr.str->index[i]]);
+		assignedSeqs[start-1+mstr.str->clusterNumber[i]-1][clusterSizes[start-1+mstr.str->clusterNumber[i]-1]]=i;
 		clusterSizes[start-1+mstr.str->clusterNumber[i]-1]++;
 	}
 	for(i=0; i<number_of_clusters; i++){
 		for(j=0; j<clusterSizes[i]; j++){
-			for(k=0; k<numToPrint; k++){
-				if ( strcmp(readsStruct->name[mstr.str->index[k]],assignedSeqs[i][j])==0 ){
-					break;
-				}
-			}
+			k = assignedSeqs[i][j];
 			int length = strlen(readsStruct->sequence[mstr.str->index[k]]);
 			//for(l=0; l<max_length; l++){
 			//	if ( sequences[k][l]=='\0' ){
@@ -1713,14 +1597,8 @@ void allocateMemForResults( resultsStruct *results, int sizeOfChunk, int num_thr
 	results->number_of_clusters = number_of_clusters;
 	results->clusterSizes = (int *)malloc((fasta_specs[4]+1)*sizeof(int));
 }
-void saveForLater(int index, resultsStruct *results, int sizeOfChunk, int iteration, int* assigned, int* fasta_specs, int kseqs, int* skipped){
+void saveForLater(int index, resultsStruct *results, int place, int iteration, int* assigned, int* fasta_specs, int kseqs, int* skipped){
 	int i;
-	for(i=sizeOfChunk-1; i>=0; i--){
-		if (results->savedForNewClusters[i]!=-1){
-			break;
-		}
-	}
-	int place = i+1;
 	int index_in_original_file=0;
 	int count_unassigned=0;
 	for(i=0; i<fasta_specs[0]; i++){
@@ -1805,14 +1683,26 @@ double binomialCoeff(double n, double k){
 	if(n<=k) return 0.0;
 	return (n*binomialCoeff(n-1,k-1))/k;
 }
+wavefront_aligner_t* newRootProfileAligner(){
+	//the alignment findShortestDist_WFA scores, for members that were compared with Needleman-Wunsch
+	wavefront_aligner_attr_t attributes = wavefront_aligner_attr_default;
+	attributes.distance_metric = gap_affine;
+	attributes.affine_penalties.mismatch =4;
+	attributes.affine_penalties.gap_opening = 6;
+	attributes.affine_penalties.gap_extension = 2;
+	attributes.alignment_form.span = alignment_endsfree;
+	return wavefront_aligner_new(&attributes);
+}
+void addToRootProfile_WFA(wavefront_aligner_t* wf_aligner, int index, char* seq, rootProfile* profile){
+	wavefront_align(wf_aligner,rootSeqs[index],strlen(rootSeqs[index]),seq,strlen(seq));
+	rootprofile_add(profile,index,wf_aligner->cigar->operations+wf_aligner->cigar->begin_offset,wf_aligner->cigar->end_offset-wf_aligner->cigar->begin_offset,seq);
+}
 void *runAssignToCluster(void *ptr){
 	struct mystruct *mstr = (mystruct *) ptr;
 	resultsStruct *results=mstr->str;
 	int start=mstr->start;
 	int end=mstr->end;
 	int num_threads = mstr->num_threads;
-	int sizeOfChunk=end-start;
-	//printf("sizeOfChunk is %d\n",sizeOfChunk);
 	double average = mstr->average;
 	//double average = 0.2;
 	int number_of_clusters = mstr->number_of_clusters;
@@ -1861,93 +1751,121 @@ void *runAssignToCluster(void *ptr){
 	mult = (int *)malloc(2*fasta_specs[1]*sizeof(int)); //MAX alignment length (2 times the longest sequence)
 	//allocateMemForDistMat(clusterSize,largest_cluster,&distMat2);
 	//allocateMemForAlign(&DATA,fasta_specs[1],&mult);
-	//for(i=start; i<end; i++){
-	for(i=start; i<end; i++){
-		shortest_distance=1;
-		//for(j=0; j<number_of_kseqs; j++){
-		//	if (i+start==mstr->chooseK[j]){
-		//		next=1;
-		//	}
-		//}
-		//for(j=0; j<number_of_kseqs; j++){
-		//	if (strcmp(seqNames[i],clusters[0][j])==0){
-		//		next=1;
-		//	}
-		//}
-		//if ( 1==(int)hashmap_get(&seqsToCompare,seqNames[i]) ){
-		//	next=1;
-		//}
-		//if ( 1==(int)hashmap_get(&assignedSeqs,seqNames[i]) ){
-		//	next = 1;
-		//}
-		//for(j=0; j<end-start; j++){
-		//	if (strcmp(assignedSeqs[j],seqNames[i])==0){
-		//		next=1;
-		//	}
-		//}
-		//if (next != 1){
-			for(j=1; j<number_of_clusters; j++){
-				//for(k=0; k<clusterSize[j]; k++){
-					//for(l=0; l<update_initial_cluster; l++){
-						//if (strcmp(clusters[j][k],clusters[0][l])==0){
-						//	strcpy(seqsInCluster[k],sequences[chooseK[l]]);
+	int numSaved=0;
+	int first, last;
+	//with a root profile, the alignment to the closest root so far and the one just scored
+	rootCigar cigars[2] = {{NULL,0,0},{NULL,0,0}};
+	int closestCigar = 0;
+	rootCigar* candidate;
+	wavefront_aligner_t* profile_aligner = NULL;
+	if (mstr->profile != NULL && mstr->use_nw != 0){
+		profile_aligner = newRootProfileAligner();
+	}
+	//reads are claimed a few at a time, so each thread's results stay in read order
+	while((first=__atomic_fetch_add(mstr->next_read,ASSIGN_GRAIN,__ATOMIC_RELAXED)) < end){
+		last = first+ASSIGN_GRAIN < end ? first+ASSIGN_GRAIN : end;
+		for(i=first; i<last; i++){
+			shortest_distance=1;
+			//for(j=0; j<number_of_kseqs; j++){
+			//	if (i+start==mstr->chooseK[j]){
+			//		next=1;
+			//	}
+			//}
+			//for(j=0; j<number_of_kseqs; j++){
+			//	if (strcmp(seqNames[i],clusters[0][j])==0){
+			//		next=1;
+			//	}
+			//}
+			//if ( 1==(int)hashmap_get(&seqsToCompare,seqNames[i]) ){
+			//	next=1;
+			//}
+			//if ( 1==(int)hashmap_get(&assignedSeqs,seqNames[i]) ){
+			//	next = 1;
+			//}
+			//for(j=0; j<end-start; j++){
+			//	if (strcmp(assignedSeqs[j],seqNames[i])==0){
+			//		next=1;
+			//	}
+			//}
+			//if (next != 1){
+				for(j=1; j<number_of_clusters; j++){
+					//for(k=0; k<clusterSize[j]; k++){
+						//for(l=0; l<update_initial_cluster; l++){
+							//if (strcmp(clusters[j][k],clusters[0][l])==0){
+							//	strcpy(seqsInCluster[k],sequences[chooseK[l]]);
+							//}
+						//}
+						//if ( 1==(int)hashmap_get(&seqsToCompare,clusters[j][k]) ){
+						//	strcpy(seqsInCluster[k],(char *)hashmap_get(&map,clusters[j][k]));
 						//}
 					//}
-					//if ( 1==(int)hashmap_get(&seqsToCompare,clusters[j][k]) ){
-					//	strcpy(seqsInCluster[k],(char *)hashmap_get(&map,clusters[j][k]));
+					//pthread_mutex_lock(&lock);
+					//distance=findShortestDist(clusterSeqs[j],sequences[i],clusterSize[j],fasta_specs[3],nw_struct,distMat2,DATA,mult);
+					if (mstr->use_nw==0){
+						candidate = mstr->profile != NULL ? &cigars[1-closestCigar] : NULL;
+						distance=findShortestDist_WFA(j-1,readsStruct->sequence[i],1,distMat2,DATA,mult,candidate);
+					}else{
+						distance=findShortestDist(j-1,readsStruct->sequence[i],1,nw_struct,distMat2,DATA,mult);
+					}
+					//pthread_mutex_unlock(&lock);
+					if (distance < shortest_distance){
+						shortest_distance = distance;
+						closestCluster=j;
+						closestCigar = 1-closestCigar;
+					}
+				}
+				//printf("thread %d\t%s\t%d\t%lf\t%s\n",mstr->threadnumber,seqNames[i],closestCluster,shortest_distance,taxonomy[i]);
+				if (shortest_distance > average){
+					//printf("making new cluster for %s number of clusters now %d\n",seqNames[i],number_of_clusters);
+					//if (num_threads==1){
+					/*
+					makeNewCluster(clusterSeqs,number_of_clusters,sequences[i],number_of_kseqs);
+					addToCluster(seqNames[i],number_of_clusters,results,sizeOfChunk);
+					clusterSize[number_of_clusters]=1;	
+					number_of_clusters++;
+					number_of_kseqs++;
+					//newClusterSizes[numberOfNodesToCut]=1;
+					//clusterSize[numberOfNodesToCut]=1;
+					//update_initial_cluster++;
+					//numberOfNodesToCut++;
+					results->number_of_clusters++;
+					numAssigned++;*/
 					//}
-				//}
-				//pthread_mutex_lock(&lock);
-				//distance=findShortestDist(clusterSeqs[j],sequences[i],clusterSize[j],fasta_specs[3],nw_struct,distMat2,DATA,mult);
-				if (mstr->use_nw==0){
-					distance=findShortestDist_WFA(j-1,readsStruct->sequence[i],1,distMat2,DATA,mult);
+					saveForLater(i,results,numSaved,mstr->iteration,mstr->chooseK,fasta_specs,number_of_kseqs,mstr->skipped);
+					numSaved++;
+					results->numunassigned++;
 				}else{
-					distance=findShortestDist(j-1,readsStruct->sequence[i],1,nw_struct,distMat2,DATA,mult);
-				}
-				//pthread_mutex_unlock(&lock);
-				if (distance < shortest_distance){
-					shortest_distance = distance;
-					closestCluster=j;
+					//for(j=sizeOfChunk-1; j>=0; j--){
+					//	if(results->assigned[j][0]=='\0'){
+					//		break;
+					//	}
+					//}
+					//strcpy(results->assigned[j],seqNames[i]);
+					addToCluster(i,closestCluster,results,numAssigned);
+					if (mstr->profile != NULL){
+						if (mstr->use_nw==0){
+							rootprofile_add(mstr->profile,closestCluster-1,cigars[closestCigar].ops,cigars[closestCigar].number_of_ops,readsStruct->sequence[i]);
+						}else{
+							addToRootProfile_WFA(profile_aligner,closestCluster-1,readsStruct->sequence[i],mstr->profile);
+						}
+					}
+					numAssigned++;
+					results->numassigned++;
+					//newClusterSizes[closestCluster]++;
 				}
-			}
-			//printf("thread %d\t%s\t%d\t%lf\t%s\n",mstr->threadnumber,seqNames[i],closestCluster,shortest_distance,taxonomy[i]);
-			if (shortest_distance > average){
-				//printf("making new cluster for %s number of clusters now %d\n",seqNames[i],number_of_clusters);
-				//if (num_threads==1){
-				/*
-				makeNewCluster(clusterSeqs,number_of_clusters,sequences[i],number_of_kseqs);
-				addToCluster(seqNames[i],number_of_clusters,results,sizeOfChunk);
-				clusterSize[number_of_clusters]=1;	
-				number_of_clusters++;
-				number_of_kseqs++;
-				//newClusterSizes[numberOfNodesToCut]=1;
-				//clusterSize[numberOfNodesToCut]=1;
-				//update_initial_cluster++;
-				//numberOfNodesToCut++;
-				results->number_of_clusters++;
-				numAssigned++;*/
-				//}
-				saveForLater(i,results,sizeOfChunk,mstr->iteration,mstr->chooseK,fasta_specs,number_of_kseqs,mstr->skipped);
-				results->numunassigned++;
-			}else{
-				//for(j=sizeOfChunk-1; j>=0; j--){
-				//	if(results->assigned[j][0]=='\0'){
-				//		break;
-				//	}
-				//}
-				//strcpy(results->assigned[j],seqNames[i]);
-				addToCluster(i,closestCluster,results,sizeOfChunk);
-				numAssigned++;
-				results->numassigned++;
-				//newClusterSizes[closestCluster]++;
-			}
-		//}
-		//next=0;
+			//}
+			//next=0;
+		}
 	}
 	free(DATA[0]);
 	free(DATA[1]);
 	free(DATA);
 	free(mult);
+	free(cigars[0].ops);
+	free(cigars[1].ops);
+	if (profile_aligner != NULL){
+		wavefront_aligner_delete(profile_aligner);
+	}
 	//free_nw(nw_struct);
 	for(i=0; i<clusterSize[largest_cluster];i++){
 		free(distMat2[i]);
@@ -1955,7 +1873,48 @@ void *runAssignToCluster(void *ptr){
 	free(distMat2);
 	//freeSeqsInCluster(seqsInCluster,number_of_kseqs);
 	mstr->numAssigned = numAssigned;
-	pthread_exit(NULL);
+	mstr->numSaved = numSaved;
+	return NULL;
+}
+//each thread's results are in read order, so merging them puts the whole chunk back in read order
+void mergeAssignResults(mystruct* mstr, int threads, resultsStruct* merged, int* numAssigned, int* numSaved){
+	int i, best, n;
+	int* next = (int *)malloc(threads*sizeof(int));
+	for(i=0; i<threads; i++){
+		next[i]=0;
+	}
+	for(n=0; ; n++){
+		best=-1;
+		for(i=0; i<threads; i++){
+			if (next[i] < mstr[i].numAssigned && (best==-1 || mstr[i].str->index[next[i]] < mstr[best].str->index[next[best]])){
+				best=i;
+			}
+		}
+		if (best==-1){
+			break;
+		}
+		addToCluster(mstr[best].str->index[next[best]],mstr[best].str->clusterNumber[next[best]],merged,n);
+		next[best]++;
+	}
+	*numAssigned = n;
+	for(i=0; i<threads; i++){
+		next[i]=0;
+	}
+	for(n=0; ; n++){
+		best=-1;
+		for(i=0; i<threads; i++){
+			if (next[i] < mstr[i].numSaved && (best==-1 || mstr[i].str->savedForNewClusters[next[i]] < mstr[best].str->savedForNewClusters[next[best]])){
+				best=i;
+			}
+		}
+		if (best==-1){
+			break;
+		}
+		merged->savedForNewClusters[n]=mstr[best].str->savedForNewClusters[next[best]];
+		next[best]++;
+	}
+	*numSaved = n;
+	free(next);
 }
 int countNumUnassigned(int* sequencesToClusterLater, int* fasta_specs, int kseqs){
 	int i;
@@ -2207,38 +2166,6 @@ void findFirstNodeCut(node** tree, int node, int whichTree, int* answer){
 		findFirstNodeCut(tree,child2,whichTree,answer);
 	}
 }
-int findMaxClade(node** tree, int number_of_leaves, double** distMat2){
-	int i,j;
-	int numberOfNodesToCut = 0;
-	for(i=0; i<number_of_leaves; i++){
-		for(j=i+1; j<number_of_leaves; j++){
-			int lca = findLCA(tree,i,j);
-			//printf("LCA is %d\n",lca);
-			//double* distance = (double *)malloc(1*sizeof(double));
-			//distance[0]=0;
-			//calculateDistance(tree,i,lca,distance);
-			//calculateDistance(tree,j,lca,distance);
-			//printf("distance between %d and %d is %lf\n",i,j,distance[0]);
-			//if (distance[0] > 0.55 && tree[0][tree[0][lca].up[0]].nodeToCut != 1){
-			if ( distMat2[i][j] > 0.57 && tree[0][tree[0][lca].up[0]].nodeToCut != 1){
-				tree[0][tree[0][lca].up[0]].nodeToCut = 1;
-				tree[0][tree[0][lca].up[0]].nodeToCut = 1;
-				//tree[0][tree[0][lca].down].nodeToCut=1;
-				//tree[0][lca].nodeToCut = 1;
-				numberOfNodesToCut++;
-			}
-		}
-	}
-	return numberOfNodesToCut;
-}
-double findLengthToLCA(node** tree, int tip, int lca, double length, int whichTree){
-	if (tip == lca){
-		return length;
-	}else{
-		length = length + tree[whichTree][tip].bl;
-		findLengthToLCA(tree,tree[whichTree][tip].down,lca,length,whichTree);
-	}
-}
 void reRoot(node** tree, int node, int childToRestructure, int whichTree, int clusterSize, int number_of_rotations){
 	int end=0;
 	if (tree[whichTree][tree[whichTree][node].down].down == -1){
@@ -2466,8 +2393,8 @@ int rotateTree(node** tree, int whichTree, int new_root, int node, int number_of
 		//tree[whichTree][node].up[0] = tree[whichTree][child1].up[1];
 		tree[whichTree][child1].down = node;
 		tree[whichTree][child0].down = -1;
-		assignDepth(tree,tree[whichTree][child0].up[0],tree[whichTree][child0].up[1],1,whichTree);
-		calculateTotalDistanceFromRoot(child0,0.0,whichTree);
+		assignDepth(tree,tree[whichTree][child0].up[0],tree[whichTree][child0].up[1],1,whichTree,number_of_nodes);
+		calculateTotalDistanceFromRoot(child0,0.0,whichTree,number_of_nodes);
 		if ( tree[whichTree][tipA].distanceFromRoot + tree[whichTree][tipB].distanceFromRoot == distance){
 			return node;
 		}
@@ -2537,8 +2464,8 @@ int rotateTree(node** tree, int whichTree, int new_root, int node, int number_of
 		tree[whichTree][child0].down = node;
 		tree[whichTree][child1].down = -1;
 		tree[whichTree][child1].depth = 0;
-		assignDepth(tree,tree[whichTree][child1].up[0],tree[whichTree][child1].up[1],1,whichTree);
-		calculateTotalDistanceFromRoot(child1,0.0,whichTree);
+		assignDepth(tree,tree[whichTree][child1].up[0],tree[whichTree][child1].up[1],1,whichTree,number_of_nodes);
+		calculateTotalDistanceFromRoot(child1,0.0,whichTree,number_of_nodes);
 		if ( tree[whichTree][tipA].distanceFromRoot + tree[whichTree][tipB].distanceFromRoot == distance){
 			return node;
 		}
@@ -2780,7 +2707,7 @@ int findMidpoint(node** tree, int node, double midpoint, int whichTree, int numb
 	for(i=0; i<2*number_of_nodes-1; i++){
 		path[i]=-1;
 	}
-	findPathToTipB(tree,tipA,tipB,whichTree,lca,path,2*number_of_nodes-1,0);
+	treeutils_path(tree,whichTree,tipA,tipB,lca,path);
 	//for(i=0; i<2*number_of_nodes-1; i++){
 	//	printf("path[%d]=%d\n",i,path[i]);
 	//}
@@ -2845,8 +2772,8 @@ int findMidpoint(node** tree, int node, double midpoint, int whichTree, int numb
 	//node = rotateTree(tree,whichTree,lca,currentRoot,number_of_nodes);
 	//tree[whichTree][node].depth =0;
 	//tree[whichTree][node].bl = 0;
-	assignDepth(tree,tree[whichTree][node].up[0],tree[whichTree][node].up[1],1,whichTree);
-	calculateTotalDistanceFromRoot(node,0.0,whichTree);
+	assignDepth(tree,tree[whichTree][node].up[0],tree[whichTree][node].up[1],1,whichTree,2*number_of_nodes-1);
+	calculateTotalDistanceFromRoot(node,0.0,whichTree,2*number_of_nodes-1);
 	if ( tree[whichTree][tipA].distanceFromRoot > tree[whichTree][tipB].distanceFromRoot ){
 		//reposition_difference = midpoint - tree[whichTree][tipB].distanceFromRoot;
 		int leftOrRight = findLeftOrRight(tree,whichTree,tipB,tree[whichTree][node].up[0]);
@@ -2868,7 +2795,7 @@ int findMidpoint(node** tree, int node, double midpoint, int whichTree, int numb
 			tree[whichTree][tree[whichTree][node].up[0]].bl = midpoint - tree[whichTree][tipB].distanceFromRoot;
 		}
 	}
-	calculateTotalDistanceFromRoot(node,0.0,whichTree);
+	calculateTotalDistanceFromRoot(node,0.0,whichTree,2*number_of_nodes-1);
 	//int max_lca = -1;
 	//max_lca = findLCA(tree,tipA,tipB,whichTree);
 	/*if (max_lca != node){
@@ -2978,27 +2905,10 @@ int findMidpoint(node** tree, int node, double midpoint, int whichTree, int numb
 	return node;
 }
 int findLongestTipToTip(node** tree, int number_of_leaves, int whichTree, int root){
-	int i,j;
-	double max_distance = 0;
 	int tipA=-1;
 	int tipB=-2;
 	int lca_max = -1;
-	for(i=0; i<number_of_leaves; i++){
-		for(j=i+1; j<number_of_leaves; j++){
-			int lca = findLCA(tree,i,j,whichTree);
-			double lengthA=0;
-			double lengthB=0;
-			lengthA=findLengthToLCA(tree,i,lca,0,whichTree);
-			lengthB=findLengthToLCA(tree,j,lca,0,whichTree);
-			if (lengthA + lengthB > max_distance){
-				max_distance = lengthA + lengthB;
-				tipA = i;
-				tipB = j;
-				lca_max = lca;
-				//printf("lengthA: %lf\nlengthB: %lf\n",lengthA,lengthB);
-			}
-		}
-	}
+	double max_distance = treeutils_diameter(tree,whichTree,root,2*number_of_leaves-1,&tipA,&tipB,&lca_max);
 	//double midpoint = tree[whichTree][tree[whichTree][lca_max].up[0]].bl + tree[whichTree][tree[whichTree][lca_max].up[1]].bl;
 	double midpoint = max_distance;
 	midpoint = midpoint/2;
@@ -3022,138 +2932,68 @@ int findLongestTipToTip(node** tree, int number_of_leaves, int whichTree, int ro
 	assert(tree[whichTree][tipB].distanceFromRoot-tree[whichTree][tipA].distanceFromRoot < 0.001 && tree[whichTree][tipB].distanceFromRoot-tree[whichTree][tipA].distanceFromRoot > -0.001);
 	return new_root;
 }
-void calculateDistance(node** tree, int leaf, int LCA,double* distance){
-	if (leaf==LCA){ return;
-	}else{
-		if ( tree[0][leaf].bl > 0 ){
-			distance[0] = tree[0][leaf].bl + distance[0];
-		}
-		calculateDistance(tree,tree[0][leaf].down,LCA,distance);
-	}
-}
-int findLCA(node** tree, int nodeA, int nodeB, int whichTree){
-	if (nodeA == nodeB){ return nodeA; }
-	if (tree[whichTree][nodeA].depth > tree[whichTree][nodeB].depth){
-		int tmp = nodeA;
-		nodeA = nodeB;
-		nodeB = tmp;
-	}
-	if ( tree[whichTree][nodeB].down == -1 ){ return nodeB; }
-	nodeB = tree[whichTree][nodeB].down;
-	return findLCA(tree,nodeA,nodeB,whichTree);
-}
-void findLeaves(node** tree, int node, int whichTree, int* parentCuts, /*int** clusterarr,*/ char*** cluster_seqs, int number_of_sequences){
-	int child1 = tree[whichTree][node].up[0];
-	int child2 = tree[whichTree][node].up[1];
-	if (tree[whichTree][node].up[0]==-1 && tree[whichTree][node].up[1]==-1){
-		//printf("finding node to cut parent of %d %s\n",node,tree[whichTree][node].name);
-		int parentCut = findParentCut(tree,node,whichTree);
-		if (parentCut==-1){ return; }
-		//int *nodesInCluster = (int *)malloc(100*sizeof(int));
-		//nodesInCluster = (int *)hashmap_get(&clusterhash,parentCut);
-		int i=0;
-		int index=-1;
-		for(i=0; i<2*number_of_sequences-1; i++){
-			if ( parentCuts[i]==parentCut){
-				index=i;
-			}
-		}
-		if (index==-1){
-			for(i=2*number_of_sequences-2; i>=0; i--){
-				if (parentCuts[i]==-1){
-					index=i;
-				}
-			}
-		}
-		parentCuts[index]=parentCut;
-		int placement=-1;
-		/*for(i=number_of_sequences-1; i>=0; i--){
-			if (clusterarr[index][i]==-1){
-				placement=i;
-			}
-		}
-		clusterarr[index][placement]=node;*/
-		for(i=0; i<number_of_sequences; i++){
-			if (clusters[index+1][i][0]=='\0'){
-				placement=i;
-				break;
-			}
-		}
-		strcpy(clusters[index+1][placement],tree[whichTree][node].name);
-		tree[whichTree][node].clusterNumber = index+1;
-		for(i=0; i<number_of_sequences; i++){
-			if (strcmp(clusters[0][i],tree[whichTree][node].name)==0){
-				break;
-			}
-		}
-		strcpy(cluster_seqs[index+1][placement],cluster_seqs[0][i]);
-		//if (nodesInCluster==NULL){
-		//	nodesInCluster[0] = node;
-		//	int i=1;
-		//	for(i=1; i<100; i++){
-		//		nodesInCluster[i]=-1;
-		//	}
-		//}else{
-		//	int count = 0;
-		//	int i;
-		//	for(i=100-1; i>=0; i--){
-		//		if (nodesInCluster[i]==-1){
-		//			count=i;
-		//		}
-		//	}
-		//	nodesInCluster[count]=node;
-		//}		
-		//hashmap_put(&clusterhash,parentCut,nodesInCluster);
-	}else{
-		findLeaves(tree,child1,whichTree,parentCuts,cluster_seqs,number_of_sequences);
-		findLeaves(tree,child2,whichTree,parentCuts,cluster_seqs,number_of_sequences);
-	}
-}
-int findParentCut(node** tree, int node, int whichTree){
-	if ( tree[whichTree][node].down == -1 ){ return -1; }
-	int parent = tree[whichTree][node].down;
-	if ( tree[whichTree][node].nodeToCut == 1){
-		//printf("We have node %d\n",node);
-		return node;
-	}else{
-		findParentCut(tree,parent,whichTree);
-	}
-}
-void addFirstCluster(node** tree, int node, int whichTree, int* parentCuts, int number_of_sequences, int max_num_clusters, char*** cluster_seqs, int index){
-	int i=0;
-	/*int index = -1;
-	for(i=number_of_sequences; i>=0; i--){
-		if (parentCuts[i]==-1){
-			index=i;
-		}
-	}*/
-	int placement=-1;
-	/*for(i=1; i<max_num_clusters; i++){
-		if ( clusters[i][0][0] == '\0' ){
-			index=i;
-			break;
-		}
-	}*/
-	for(i=number_of_sequences; i>=0; i--){
-		if ( clusters[index][i][0]=='\0' ){
-			placement=i;
-		}
-	}
-	strcpy(clusters[index][placement],tree[whichTree][node].name);
-	tree[whichTree][node].clusterNumber = index;
-	for(i=0; i<number_of_sequences+1; i++){
-		if (strcmp(clusters[0][i],clusters[index][placement])==0){
-			strcpy(cluster_seqs[index][placement],cluster_seqs[0][i]);
-		}
-	}
-}
-void findPathToRoot(node** tree, int node, int whichTree, int* foundPath){
-	int parent = tree[whichTree][node].down;
-	if (parent==-1){ return; }
-	if (tree[whichTree][node].nodeToCut==1){
-		foundPath[0]=1;
+void findLeaves(node** tree, int root, int whichTree, char*** cluster_seqs, int number_of_sequences, int max_num_clusters){
+	//one preorder sweep hands every node the nearest cut at or above it (the root never counts as a cut).
+	//Cut clusters are numbered in the order their first leaf is reached; leaves under no cut go, in index
+	//order, to the first cluster left empty.
+	int i, k, node, parent, index, placement;
+	int number_of_nodes = 2*number_of_sequences-1;
+	int* order = (int *)malloc(number_of_nodes*sizeof(int));
+	int* cutOf = (int *)malloc(number_of_nodes*sizeof(int));
+	int* slotOfCut = (int *)malloc(number_of_nodes*sizeof(int));
+	int* filled = (int *)calloc(max_num_clusters+1,sizeof(int));
+	for(i=0; i<number_of_nodes; i++){
+		cutOf[i]=-1;
+		slotOfCut[i]=-1;
 	}
-	findPathToRoot(tree,parent,whichTree,foundPath);
+	int number_of_slots=0;
+	int count = flattree_preorder(tree,whichTree,root,number_of_nodes,order);
+	for(k=0; k<count; k++){
+		node = order[k];
+		parent = tree[whichTree][node].down;
+		if (parent==-1){
+			continue;
+		}
+		cutOf[node] = tree[whichTree][node].nodeToCut==1 ? node : cutOf[parent];
+		if (tree[whichTree][node].up[0]!=-1 || tree[whichTree][node].up[1]!=-1 || cutOf[node]==-1){
+			continue;
+		}
+		if (slotOfCut[cutOf[node]]==-1){
+			slotOfCut[cutOf[node]] = number_of_slots;
+			number_of_slots++;
+		}
+		index = slotOfCut[cutOf[node]]+1;
+		tree[whichTree][node].clusterNumber = index;
+		//placeholder leaves (fewer sequences left than kseqs) have no name and take no place in the cluster
+		if (tree[whichTree][node].name[0]=='\0'){
+			continue;
+		}
+		placement = filled[index];
+		filled[index]++;
+		strcpy(clusters[index][placement],tree[whichTree][node].name);
+		strcpy(cluster_seqs[index][placement],cluster_seqs[0][node]);
+		clusterIds[index][placement]=clusterIds[0][node];
+	}
+	//the first cluster left empty, which is number_of_slots+1 unless a cut held only placeholders
+	for(index=1; index<=max_num_clusters && filled[index]>0; index++);
+	for(i=0; i<number_of_sequences; i++){
+		if (cutOf[i]!=-1 || index > max_num_clusters){
+			continue;
+		}
+		tree[whichTree][i].clusterNumber = index;
+		if (tree[whichTree][i].name[0]=='\0'){
+			continue;
+		}
+		placement = filled[index];
+		filled[index]++;
+		strcpy(clusters[index][placement],tree[whichTree][i].name);
+		strcpy(cluster_seqs[index][placement],cluster_seqs[0][i]);
+		clusterIds[index][placement]=clusterIds[0][i];
+	}
+	free(order);
+	free(cutOf);
+	free(slotOfCut);
+	free(filled);
 }
 void findLeavesOfNodeCut(node** tree, int node, int whichTree, int clusterNumber, int kseqs, int firstiter){
 	int child1 = tree[whichTree][node].up[0];
@@ -3210,221 +3050,635 @@ void shiftColumns(int kseqs){
 	}
 	free(tmp);
 }
-void createTreesForClusters(node** treeArr, int number_of_clusters, int* clusterSize, char*** cluster_seqs, int* rootArr, int threads){
-	//int rootArr[number_of_clusters];
-	int i=0;
-	int j=0;
-	int k=0;
-	for(i=1; i<number_of_clusters; i++){
-		if (clusterSize[i] > 3){
-		distMat = (double **)malloc((clusterSize[i]+1)*sizeof(double *));
-		for(j=0; j<clusterSize[i]+1; j++){
-			distMat[j] = (double *)malloc((clusterSize[i]+1)*sizeof(double));
-		}
-		for(j=0; j<clusterSize[i]+1; j++){
-			for(k=0; k<clusterSize[i]+1; k++){
-				distMat[j][k]=0;
+int findMedoid(double** distMat, int clusterSize){
+	//only the upper triangle of a cluster's distance matrix is filled
+	int i, j, medoid=0;
+	double sum, best=-1.0;
+	for(i=0; i<clusterSize; i++){
+		sum=0.0;
+		for(j=0; j<clusterSize; j++){
+			if (i < j){
+				sum += distMat[i][j];
+			}else if (j < i){
+				sum += distMat[j][i];
 			}
 		}
-		createDistMat_WFA(cluster_seqs[i],distMat,clusterSize[i],threads);
-		//}
-		//if ( clusterSize[i] > 3 ){
-			rootArr[i-1] = NJ(treeArr,distMat,clusterSize[i],i-1,i);
-			treeArr[i-1][rootArr[i-1]].bl = 0;
-			treeArr[i-1][rootArr[i-1]].depth = 0;
-			assignDepth(treeArr,treeArr[i-1][rootArr[i-1]].up[0],treeArr[i-1][rootArr[i-1]].up[1],1,i-1);
-			calculateTotalDistanceFromRoot(rootArr[i-1],0.0,i-1);
-			//printtree(treeArr, i-1, clusterSize[i]);
-			//FILE* beforetree = fopen("before.nw","w");
-			//printtree_newick(rootArr[i-1],i-1,beforetree);
-			rootArr[i-1]=findLongestTipToTip(treeArr,clusterSize[i],i-1,rootArr[i-1]);
-			//printtree(treeArr, i-1, clusterSize[i]);
-			//FILE* aftertree = fopen("after.nw","w");
-			//printtree_newick(rootArr[i-1],i-1,aftertree);
-		}else{
-			rootArr[i-1]=0;
-		}
-		if (clusterSize[i] > 3){
-			for(j=0; j<clusterSize[i]+1; j++){
-				free(distMat[j]);
-			}
-			free(distMat);
+		if (best < 0.0 || sum < best){
+			best = sum;
+			medoid = i;
 		}
 	}
+	return medoid;
 }
-void clearGlobals(){
-	int i,j, k;
-	for(i=0;i<STATESPACE;i++){
-		RRVAL[i]=0;
-		for(j=0; j<STATESPACE;j++){
-			LRVEC[i][j]=0;
-			RRVEC[i][j]=0;
-			PMAT1[i][j]=0;
-			PMAT2[i][j]=0;
-		}
-	}
-	for(i=4;i<4;i++){
-		RRVALnc[i]=0;
-		for(i=4;i<4;i++){
-			LRVECnc[i][j]=0;
-			RRVECnc[i][j]=0;
-		}
-	}
-	for (i=0;i<4;i++){
-		PMATnc[0][i][4]=1.0;//missing data
-		PMATnc[1][i][4]=1.0;//missing data
-	}
-	parameters[0]=0.0;
-	for(i=1;i<10;i++){
-		parameters[i]=1.0;
+double distance_WFA(wavefront_aligner_t* wf_aligner, char* seqA, char* seqB, int idA, int idB){
+	//a single pair, scored like the cluster distance matrices and shared through the distance cache
+	double distance;
+	if (distcache_get(distanceCache,idA,idB,&distance)==1){
+		return distance;
 	}
+	wavefront_align(wf_aligner,seqA,strlen(seqA),seqB,strlen(seqB));
+	char* const pattern_alg = mm_allocator_calloc(wf_aligner->mm_allocator,strlen(seqA)+strlen(seqB)+1,char,true);
+	char* const ops_alg = mm_allocator_calloc(wf_aligner->mm_allocator,strlen(seqA)+strlen(seqB)+1,char,true);
+	char* const text_alg = mm_allocator_calloc(wf_aligner->mm_allocator,strlen(seqA)+strlen(seqB)+1,char,true);
+	int alignment_length = perform_WFA_alignment(wf_aligner->cigar,wf_aligner->mm_allocator,seqA,seqB,pattern_alg,text_alg,ops_alg,wf_aligner->cigar->begin_offset,wf_aligner->cigar->end_offset);
+	int* scratch = (int *)threadpool_scratch(3*(size_t)alignment_length*sizeof(int));
+	int* DATA[2] = {scratch, scratch+alignment_length};
+	int* mult = scratch+2*alignment_length;
+	alignment_length = populate_DATA(pattern_alg,text_alg,DATA,alignment_length,mult);
+	distance = Get_dist_JC_avg(alignment_length,DATA,mult);
+	distcache_put(distanceCache,idA,idB,distance);
+	mm_allocator_free(wf_aligner->mm_allocator,pattern_alg);
+	mm_allocator_free(wf_aligner->mm_allocator,ops_alg);
+	mm_allocator_free(wf_aligner->mm_allocator,text_alg);
+	return distance;
 }
-void inittransitionmatrixnc(double pi[4]){
-	int i, j;
-	double sum, piT, RIVAL[4], RIVEC[4][4],  A[4][4], workspace[8];
-	for (i=0; i<8; i++){
-		workspace[i]=0;
-	}
-	A[0][1]=pi[1]*parameters[4];
-	A[0][2]=pi[2]*parameters[5];
-	A[0][3]=pi[3]*parameters[6];
-	A[1][0]=pi[0]*parameters[4];
-	A[1][2]=pi[2]*parameters[7];
-	A[1][3]=pi[3]*parameters[8];
-	A[2][0]=pi[0]*parameters[5];
-	A[2][1]=pi[1]*parameters[7];
-	A[2][3]=pi[3]; //unscaled rate of GT = 1.0
-	A[3][0]=pi[0]*parameters[6];
-	A[3][1]=pi[1]*parameters[8];
-	A[3][2]=pi[2]; //unscaled rate of GT = 1.0
-	for (i=0; i<4; i++){
-		A[i][i]=0.0;
-		sum=0.0;
-		for (j=0; j<4; j++){
-			sum = sum + A[i][j];
+void *updateFarthestDistances(void *ptr){
+	struct farthestStruct *fstr = (farthestStruct *) ptr;
+	wavefront_aligner_attr_t attributes = wavefront_aligner_attr_default;
+	attributes.distance_metric = gap_affine;
+	attributes.affine_penalties.mismatch =4;
+	attributes.affine_penalties.gap_opening = 6;
+	attributes.affine_penalties.gap_extension = 2;
+	attributes.alignment_form.span = alignment_endsfree;
+	wavefront_aligner_t* const wf_aligner = wavefront_aligner_new(&attributes);
+	int j;
+	double distance;
+	for(j=fstr->start; j<fstr->end; j++){
+		if (fstr->minDist[j] < 0){
+			continue;
 		}
-		A[i][i] = -sum;
-	}
-	if (eigen(1, A[0], 4, RRVALnc, RIVAL, RRVECnc[0], RIVEC[0], workspace) != 0){
-		printf("Transitions matrix did not converge or contained non-real values!\n");
-		exit(-1);
-	}
-	for (i=0; i<4; i++){
-		for (j=0; j<4; j++){
-			LRVECnc[i][j] = RRVECnc[i][j];
+		distance = distance_WFA(wf_aligner,fstr->seq[fstr->pick],fstr->seq[j],fstr->ids[fstr->pick],fstr->ids[j]);
+		if (distance < fstr->minDist[j]){
+			fstr->minDist[j] = distance;
 		}
 	}
-	if (matinv(RRVECnc[0],4, 4, workspace) != 0){
-		printf("Could not invert matrix!\nResults may not be reliable!\n");
-	}
+	wavefront_aligner_delete(wf_aligner);
+	return NULL;
 }
-void maketransitionmatrixnc(int n, double t, int whichRoot){
-	int i, j, k;
-	double EXPOS[4];
-	for (k=0; k<4; k++){
-		EXPOS[k] = exp(t*RRVALnc[k]);
-		if ( EXPOS[k] < 0.000000 ){
-			printf("EXPOS[k]=%e\n",EXPOS[k]);
-		}
-	}
-	for (i=0; i<4; i++){
-		for (j=0; j<4; j++){
-			PMATnc[n][i][j] = 0.0;
-			for (k=0; k<4; k++){
-				PMATnc[n][i][j] =  PMATnc[n][i][j] + RRVECnc[k][j]*LRVECnc[i][k]*EXPOS[k];
+void pickDiverseMembers(char** seqs, int* ids, int clusterSize, int number_to_pick, int* picked, int threads){
+	//farthest-point sampling: start from the first member, then keep taking the member farthest
+	//from everything picked so far; costs number_to_pick*clusterSize distances instead of all pairs
+	int i,j,k;
+	int workers = threads;
+	if (workers > clusterSize){
+		workers = clusterSize;
+	}
+	int divide = clusterSize/workers;
+	farthestStruct fstr[workers];
+	double* minDist = (double *)malloc(clusterSize*sizeof(double));
+	for(j=0; j<clusterSize; j++){
+		minDist[j] = DISTMAX+1.0;
+	}
+	picked[0] = 0;
+	for(i=0; i<number_to_pick; i++){
+		if (i > 0){
+			picked[i] = -1;
+			for(j=0; j<clusterSize; j++){
+				if (minDist[j] >= 0 && (picked[i] == -1 || minDist[j] > minDist[picked[i]])){
+					picked[i] = j;
+				}
 			}
 		}
-	}
-}
-void makeconnc(int node, double lambda, int whichRoot, int numbase, int numspec, int** seqArr, int root){
-	int i, j, child, seqn, site;
-	double L, max;
-	child = treeArr[whichRoot][node].up[0];
-	if (treeArr[whichRoot][child].up[0]==-1){
-		maketransitionmatrixnc(0, lambda*treeArr[whichRoot][child].bl,whichRoot);
-		//seqn=child-numspec+1;
-		seqn=child;
-		for (site=0; site<numbase; site++){
-			for (i=0; i<4; i++){
-				treeArr[whichRoot][node].likenc[site][i] = PMATnc[0][i][seqArr[seqn][site]];
-			}
-			//if (site==0 && node ==root) printf("node 10 (b=%i): %lf %lf %lf %lf\n",seqArr[whichRoot][seqn][site],PMATnc[0][0][seqArr[whichRoot][seqn][site]],PMATnc[0][1][seqArr[whichRoot][seqn][site]],PMATnc[0][2][seqArr[whichRoot][seqn][site]],PMATnc[0][3][seqArr[whichRoot][seqn][site]]);
+		minDist[picked[i]] = -1.0;
+		if (i == number_to_pick-1){
+			break;
 		}
-	}else{
-		makeconnc(child, lambda, whichRoot, numbase, numspec, seqArr, root);
-		maketransitionmatrixnc(0, lambda*treeArr[whichRoot][child].bl,whichRoot);
-		for (site=0; site<numbase; site++){
-			for (i=0; i<4; i++){
-				treeArr[whichRoot][node].likenc[site][i]=0.0;
-				for (j=0; j<4; j++){
-					treeArr[whichRoot][node].likenc[site][i] += PMATnc[0][i][j]*treeArr[whichRoot][child].likenc[site][j];
-				}
+		for(k=0; k<workers; k++){
+			fstr[k].seq = seqs;
+			fstr[k].ids = ids;
+			fstr[k].pick = picked[i];
+			fstr[k].start = k*divide;
+			fstr[k].end = (k+1)*divide;
+			if (k == workers-1){
+				fstr[k].end = clusterSize;
 			}
+			fstr[k].minDist = minDist;
 		}
-
+		threadpool_run(updateFarthestDistances,fstr,sizeof(farthestStruct),workers);
 	}
-	child = treeArr[whichRoot][node].up[1];
-	if (treeArr[whichRoot][child].up[1]==-1){
-		maketransitionmatrixnc(0,lambda*treeArr[whichRoot][child].bl,whichRoot);
-		//seqn=child-numspec+1;
-		seqn=child;
-		for (site=0; site<numbase; site++){
-			for (i=0; i<4; i++){
-				treeArr[whichRoot][node].likenc[site][i] = treeArr[whichRoot][node].likenc[site][i]*PMATnc[0][i][seqArr[seqn][site]];
+	free(minDist);
+}
+void swapClusterMembers(char*** cluster_seqs, int cluster, int a, int b){
+	char* tmp;
+	int id;
+	tmp = clusters[cluster][a];
+	clusters[cluster][a] = clusters[cluster][b];
+	clusters[cluster][b] = tmp;
+	tmp = cluster_seqs[cluster][a];
+	cluster_seqs[cluster][a] = cluster_seqs[cluster][b];
+	cluster_seqs[cluster][b] = tmp;
+	id = clusterIds[cluster][a];
+	clusterIds[cluster][a] = clusterIds[cluster][b];
+	clusterIds[cluster][b] = id;
+}
+int subsampleClusters(int number_of_clusters, int* clusterSize, char*** cluster_seqs, int* msaSize, int** msaSwaps, int max_members, int threads){
+	//moves a diverse sample of every cluster larger than max_members to the front of its member
+	//arrays, so the tree, alignment and root are built from the first msaSize[i] members only;
+	//restoreClusterOrder puts the members back afterwards. Returns how many clusters were sampled.
+	int i,k,p,m;
+	int subsampled=0;
+	for(i=0; i<number_of_clusters; i++){
+		msaSize[i] = clusterSize[i];
+		msaSwaps[i] = NULL;
+		if (i == 0 || max_members == 0 || clusterSize[i] <= max_members){
+			continue;
+		}
+		int* picked = (int *)malloc(max_members*sizeof(int));
+		int* slotOf = (int *)malloc(clusterSize[i]*sizeof(int));
+		int* memberIn = (int *)malloc(clusterSize[i]*sizeof(int));
+		for(k=0; k<clusterSize[i]; k++){
+			slotOf[k] = k;
+			memberIn[k] = k;
+		}
+		pickDiverseMembers(cluster_seqs[i],clusterIds[i],clusterSize[i],max_members,picked,threads);
+		msaSwaps[i] = (int *)malloc(max_members*sizeof(int));
+		for(k=0; k<max_members; k++){
+			p = slotOf[picked[k]];
+			msaSwaps[i][k] = p;
+			swapClusterMembers(cluster_seqs,i,k,p);
+			m = memberIn[k];
+			memberIn[k] = picked[k];
+			memberIn[p] = m;
+			slotOf[picked[k]] = k;
+			slotOf[m] = p;
+		}
+		msaSize[i] = max_members;
+		subsampled++;
+		free(picked);
+		free(slotOf);
+		free(memberIn);
+	}
+	return subsampled;
+}
+void restoreClusterOrder(int number_of_clusters, char*** cluster_seqs, int* msaSize, int** msaSwaps){
+	int i,k;
+	for(i=0; i<number_of_clusters; i++){
+		if (msaSwaps[i] == NULL){
+			continue;
+		}
+		for(k=msaSize[i]-1; k>=0; k--){
+			swapClusterMembers(cluster_seqs,i,k,msaSwaps[i][k]);
+		}
+		free(msaSwaps[i]);
+		msaSwaps[i] = NULL;
+	}
+}
+void *buildClusterTrees(void *ptr){
+	struct clusterTreeStruct *cstr = (clusterTreeStruct *) ptr;
+	int i,j;
+	while(1){
+		pthread_mutex_lock(cstr->lock);
+		i = cstr->next[0];
+		cstr->next[0]++;
+		pthread_mutex_unlock(cstr->lock);
+		if (i >= cstr->number_of_clusters){
+			break;
+		}
+		if (cstr->clusterSize[i] > 3 && (cstr->root_method == ROOT_METHOD_CONSENSUS || cstr->root_method == ROOT_METHOD_MEDOID)){
+			//the consensus is read straight off the alignment and the medoid off the distances
+			//reconstructClusterRoots computes, so neither needs a tree here
+			cstr->rootArr[i-1]=0;
+		}else if (cstr->clusterSize[i] > 3){
+		double** clusterDistMat = (double **)malloc((cstr->clusterSize[i]+1)*sizeof(double *));
+		for(j=0; j<cstr->clusterSize[i]+1; j++){
+			clusterDistMat[j] = (double *)calloc(cstr->clusterSize[i]+1,sizeof(double));
+		}
+		createDistMat_WFA(cstr->cluster_seqs[i],clusterIds[i],clusterDistMat,cstr->clusterSize[i],cstr->threads);
+		cstr->rootArr[i-1] = NJ(cstr->treeArr,clusterDistMat,cstr->clusterSize[i],i-1,i,cstr->threads);
+		cstr->treeArr[i-1][cstr->rootArr[i-1]].bl = 0;
+		cstr->treeArr[i-1][cstr->rootArr[i-1]].depth = 0;
+		assignDepth(cstr->treeArr,cstr->treeArr[i-1][cstr->rootArr[i-1]].up[0],cstr->treeArr[i-1][cstr->rootArr[i-1]].up[1],1,i-1,2*cstr->clusterSize[i]-1);
+		calculateTotalDistanceFromRoot(cstr->rootArr[i-1],0.0,i-1,2*cstr->clusterSize[i]-1);
+		cstr->rootArr[i-1]=findLongestTipToTip(cstr->treeArr,cstr->clusterSize[i],i-1,cstr->rootArr[i-1]);
+			for(j=0; j<cstr->clusterSize[i]+1; j++){
+				free(clusterDistMat[j]);
+			}
+			free(clusterDistMat);
+		}else{
+			cstr->rootArr[i-1]=0;
+		}
+	}
+	return NULL;
+}
+void createTreesForClusters(node** treeArr, int number_of_clusters, int* clusterSize, char*** cluster_seqs, int* rootArr, int root_method, int threads){
+	//each worker takes the next cluster and builds its tree on its own distance matrix
+	int i=0;
+	int k=0;
+	int workers=0;
+	for(i=1; i<number_of_clusters; i++){
+		if (clusterSize[i] > 3){
+			workers++;
+		}
+	}
+	if (workers > threads){
+		workers = threads;
+	}
+	if (workers < 1){
+		workers = 1;
+	}
+	int next = 1;
+	pthread_mutex_t next_lock;
+	pthread_mutex_init(&next_lock,NULL);
+	clusterTreeStruct cstr[workers];
+	for(k=0; k<workers; k++){
+		cstr[k].treeArr = treeArr;
+		cstr[k].number_of_clusters = number_of_clusters;
+		cstr[k].clusterSize = clusterSize;
+		cstr[k].cluster_seqs = cluster_seqs;
+		cstr[k].rootArr = rootArr;
+		cstr[k].root_method = root_method;
+		cstr[k].threads = threads/workers;
+		if (cstr[k].threads < 1){
+			cstr[k].threads = 1;
+		}
+		cstr[k].next = &next;
+		cstr[k].lock = &next_lock;
+	}
+	threadpool_run(buildClusterTrees,cstr,sizeof(clusterTreeStruct),workers);
+	pthread_mutex_destroy(&next_lock);
+}
+likeContext* likecontext_new(){
+	likeContext* ctx = (likeContext *)malloc(sizeof(likeContext));
+	if (ctx == NULL){
+		fprintf(stderr,"Could not allocate likelihood context\n");
+		exit(1);
+	}
+	ctx->treeArr = NULL;
+	ctx->seqArr = NULL;
+	ctx->weight = NULL;
+	ctx->scalenc = NULL;
+	ctx->partials = NULL;
+	ctx->rebuilt = NULL;
+	ctx->alloc_partials = 0;
+	ctx->cl_rebuilt = 0;
+	ctx->cl_reused = 0;
+	ctx->ft = NULL;
+	ctx->templike_nc = NULL;
+	ctx->work = NULL;
+	ctx->tiprow = NULL;
+	ctx->locloglike = NULL;
+	ctx->alloc_numbase = 0;
+	ctx->arena = NULL;
+	ctx->alloc_arena = 0;
+	ctx->ptcache = NULL;
+	ctx->ptcache_t = NULL;
+	ctx->ptcache_version = NULL;
+	ctx->alloc_ptcache = 0;
+	ctx->model_version = 0;
+	ctx->model_valid = 0;
+	ctx->pt_hits = 0;
+	ctx->pt_misses = 0;
+	doNRinits(&ctx->nr,NR_MAXPAR);
+	return ctx;
+}
+void likecontext_free(likeContext* ctx){
+	int i;
+	if (ctx == NULL){
+		return;
+	}
+	for(i=0; i<ctx->alloc_numbase; i++){
+		free(ctx->locloglike[i]);
+	}
+	free(ctx->locloglike);
+	free(ctx->tiprow);
+	free(ctx->partials);
+	free(ctx->rebuilt);
+	flattree_free(ctx->ft);
+	free(ctx->arena);
+	free(ctx->ptcache);
+	free(ctx->ptcache_t);
+	free(ctx->ptcache_version);
+	freeNRinits(&ctx->nr,NR_MAXPAR);
+	free(ctx);
+}
+void likecontext_bind(likeContext* ctx, node** treeArr, int whichRoot, int root, int numspec, sitePatterns* sp, int posterior_mode){
+	//point the context at one cluster and put the model back to its starting values
+	int i,j;
+	int numbase = sp->number_of_patterns;
+	int number_of_nodes = 2*numspec-1;
+	size_t per_node = (size_t)4*numbase;
+	//internal nodes need partials and posteriors; leaves are read straight from the
+	//alignment and only need a posterior buffer when leaf marginals are requested
+	size_t buffers = 2*(size_t)(numspec-1) + (posterior_mode == POSTERIOR_ALL ? (size_t)numspec : 0) + 1;
+	//the like_t buffers come first, then the double work and scaler arrays from the next cache line
+	size_t like_bytes = (buffers*per_node*sizeof(like_t) + LK_ALIGN-1)/LK_ALIGN*LK_ALIGN;
+	size_t need = like_bytes + (per_node + (size_t)number_of_nodes*numbase)*sizeof(double);
+	like_t* next;
+	ctx->treeArr = treeArr;
+	ctx->whichRoot = whichRoot;
+	ctx->numbase = numbase;
+	ctx->number_of_sites = sp->number_of_sites;
+	ctx->root = root;
+	ctx->numspec = numspec;
+	ctx->seqArr = &sp->patterns;
+	ctx->weight = sp->weight;
+	ctx->posterior_mode = posterior_mode;
+	if (numbase > ctx->alloc_numbase){
+		ctx->locloglike = (double **)realloc(ctx->locloglike,numbase*sizeof(double *));
+		ctx->tiprow = (uint8_t *)realloc(ctx->tiprow,numbase*sizeof(uint8_t));
+		if (ctx->locloglike == NULL || ctx->tiprow == NULL){
+			fprintf(stderr,"Could not allocate likelihood buffers\n");
+			exit(1);
+		}
+		for(i=ctx->alloc_numbase; i<numbase; i++){
+			ctx->locloglike[i] = (double *)malloc(NUMCAT*sizeof(double));
+		}
+		ctx->alloc_numbase = numbase;
+	}
+	//one aligned block holds the node buffers, so the tree needs no per-site
+	//allocations and each node's sites are contiguous
+	if (need > ctx->alloc_arena){
+		free(ctx->arena);
+		ctx->arena = lk_alloc(need);
+		ctx->alloc_arena = need;
+	}
+	next = ctx->arena;
+	for(i=0; i<number_of_nodes; i++){
+		if (treeArr[whichRoot][i].up[0] != -1){
+			treeArr[whichRoot][i].likenc = next;
+			treeArr[whichRoot][i].posteriornc = next + per_node;
+			next += 2*per_node;
+		}else{
+			treeArr[whichRoot][i].likenc = NULL;
+			treeArr[whichRoot][i].posteriornc = NULL;
+			if (posterior_mode == POSTERIOR_ALL){
+				treeArr[whichRoot][i].posteriornc = next;
+				next += per_node;
+			}
+		}
+	}
+	ctx->templike_nc = next;
+	ctx->work = (double *)((char *)ctx->arena + like_bytes);
+	ctx->scalenc = ctx->work + per_node;
+	if (number_of_nodes > ctx->alloc_partials){
+		free(ctx->partials);
+		free(ctx->rebuilt);
+		ctx->alloc_partials = number_of_nodes;
+		ctx->partials = (partialState *)malloc(number_of_nodes*sizeof(partialState));
+		ctx->rebuilt = (char *)malloc(number_of_nodes*sizeof(char));
+		if (ctx->partials == NULL || ctx->rebuilt == NULL){
+			fprintf(stderr,"Could not allocate likelihood buffers\n");
+			exit(1);
+		}
+		for(i=0; i<number_of_nodes; i++){
+			ctx->partials[i].version = 0;
+		}
+	}
+	for(i=0; i<number_of_nodes; i++){
+		ctx->rebuilt[i] = 0;
+	}
+	flattree_free(ctx->ft);
+	ctx->ft = flattree_new(treeArr,whichRoot,root,number_of_nodes);
+	if (number_of_nodes*NUMCAT > ctx->alloc_ptcache){
+		free(ctx->ptcache);
+		free(ctx->ptcache_t);
+		free(ctx->ptcache_version);
+		ctx->alloc_ptcache = number_of_nodes*NUMCAT;
+		ctx->ptcache = lk_alloc((size_t)ctx->alloc_ptcache*20*sizeof(like_t));
+		ctx->ptcache_t = (double *)malloc(ctx->alloc_ptcache*sizeof(double));
+		ctx->ptcache_version = (unsigned int *)malloc(ctx->alloc_ptcache*sizeof(unsigned int));
+		if (ctx->ptcache_t == NULL || ctx->ptcache_version == NULL){
+			fprintf(stderr,"Could not allocate transition matrix cache\n");
+			exit(1);
+		}
+		for(i=0; i<ctx->alloc_ptcache; i++){
+			ctx->ptcache_version[i] = ctx->model_version;
+			ctx->ptcache[20*(size_t)i+16] = ctx->ptcache[20*(size_t)i+17] = ctx->ptcache[20*(size_t)i+18] = ctx->ptcache[20*(size_t)i+19] = 1.0; //missing data
+		}
+	}
+	//a new tree and a fresh model: nothing cached so far can be reused
+	ctx->model_valid = 0;
+	ctx->model_version++;
+	for(i=0; i<4; i++){
+		ctx->RRVALnc[i]=0;
+		for(j=0; j<4; j++){
+			ctx->LRVECnc[i][j]=0;
+			ctx->RRVECnc[i][j]=0;
+		}
+	}
+	for (i=0;i<4;i++){
+		ctx->PMATnc[0][i][4]=1.0;//missing data
+		ctx->PMATnc[1][i][4]=1.0;//missing data
+		ctx->PTnc[0][16+i]=1.0;
+		ctx->PTnc[1][16+i]=1.0;
+	}
+	ctx->parameters[0]=0.0;
+	for(i=1;i<10;i++){
+		ctx->parameters[i]=1.0;
+	}
+	ctx->COUNT=ctx->COUNT2=0;
+	ctx->nr.CENTRALMODE=0;
+}
+void inittransitionmatrixnc(likeContext* ctx, double pi[4]){
+	int i, j;
+	double sum, piT, RIVAL[4], RIVEC[4][4],  A[4][4], workspace[8], key[9];
+	//the eigensystem, and so every cached P(t), only changes with pi or the exchangeabilities
+	for (i=0; i<4; i++){
+		key[i]=pi[i];
+	}
+	for (i=4; i<9; i++){
+		key[i]=ctx->parameters[i];
+	}
+	if (ctx->model_valid && memcmp(key,ctx->model_key,sizeof(key))==0){
+		return;
+	}
+	for (i=0; i<8; i++){
+		workspace[i]=0;
+	}
+	A[0][1]=pi[1]*ctx->parameters[4];
+	A[0][2]=pi[2]*ctx->parameters[5];
+	A[0][3]=pi[3]*ctx->parameters[6];
+	A[1][0]=pi[0]*ctx->parameters[4];
+	A[1][2]=pi[2]*ctx->parameters[7];
+	A[1][3]=pi[3]*ctx->parameters[8];
+	A[2][0]=pi[0]*ctx->parameters[5];
+	A[2][1]=pi[1]*ctx->parameters[7];
+	A[2][3]=pi[3]; //unscaled rate of GT = 1.0
+	A[3][0]=pi[0]*ctx->parameters[6];
+	A[3][1]=pi[1]*ctx->parameters[8];
+	A[3][2]=pi[2]; //unscaled rate of GT = 1.0
+	for (i=0; i<4; i++){
+		A[i][i]=0.0;
+		sum=0.0;
+		for (j=0; j<4; j++){
+			sum = sum + A[i][j];
+		}
+		A[i][i] = -sum;
+	}
+	if (eigen(1, A[0], 4, ctx->RRVALnc, RIVAL, ctx->RRVECnc[0], RIVEC[0], workspace) != 0){
+		printf("Transitions matrix did not converge or contained non-real values!\n");
+		exit(-1);
+	}
+	for (i=0; i<4; i++){
+		for (j=0; j<4; j++){
+			ctx->LRVECnc[i][j] = ctx->RRVECnc[i][j];
+		}
+	}
+	if (matinv(ctx->RRVECnc[0],4, 4, workspace) != 0){
+		printf("Could not invert matrix!\nResults may not be reliable!\n");
+	}
+	memcpy(ctx->model_key,key,sizeof(key));
+	ctx->model_valid = 1;
+	ctx->model_version++;
+}
+void maketransitionmatrixnc(likeContext* ctx, int n, double t){
+	int i, j, k;
+	double EXPOS[4];
+	for (k=0; k<4; k++){
+		EXPOS[k] = exp(t*ctx->RRVALnc[k]);
+		if ( EXPOS[k] < 0.000000 ){
+			printf("EXPOS[k]=%e\n",EXPOS[k]);
+		}
+	}
+	for (i=0; i<4; i++){
+		for (j=0; j<4; j++){
+			ctx->PMATnc[n][i][j] = 0.0;
+			for (k=0; k<4; k++){
+				ctx->PMATnc[n][i][j] =  ctx->PMATnc[n][i][j] + ctx->RRVECnc[k][j]*ctx->LRVECnc[i][k]*EXPOS[k];
 			}
+			ctx->PTnc[n][4*j+i] = ctx->PMATnc[n][i][j];
 		}
-	}else{
-		makeconnc(child, lambda,whichRoot, numbase, numspec, seqArr, root);
-		maketransitionmatrixnc(0,lambda*treeArr[whichRoot][child].bl,whichRoot);
-		for (site=0; site<numbase; site++){
-			max=0.0;
-			for (i=0; i<4; i++){
-				L=0.0;
-				for (j=0; j<4; j++){
-					L += PMATnc[0][i][j]*treeArr[whichRoot][child].likenc[site][j];
-				}
-				if ((treeArr[whichRoot][node].likenc[site][i] = treeArr[whichRoot][node].likenc[site][i]*L)>max){
-					max = treeArr[whichRoot][node].likenc[site][i];
-				}
+	}
+}
+like_t* branchtransitionmatrixnc(likeContext* ctx, int node, int cat, double t){
+	//transposed P(t) of the branch below node in rate category cat, rebuilt only when the
+	//branch length, the rate or the model has changed since the entry was last filled
+	int i, j, k;
+	double EXPOS[4], p;
+	int e = node*NUMCAT+cat;
+	like_t* PT = ctx->ptcache+20*(size_t)e;
+	if (ctx->ptcache_version[e] == ctx->model_version && ctx->ptcache_t[e] == t){
+		ctx->pt_hits++;
+		return PT;
+	}
+	ctx->pt_misses++;
+	for (k=0; k<4; k++){
+		EXPOS[k] = exp(t*ctx->RRVALnc[k]);
+	}
+	for (i=0; i<4; i++){
+		for (j=0; j<4; j++){
+			p = 0.0;
+			for (k=0; k<4; k++){
+				p = p + ctx->RRVECnc[k][j]*ctx->LRVECnc[i][k]*EXPOS[k];
 			}
-			if (max<0.00000000001) printf("Warning, max = %lf\n",max);
-			for (i=0; i<4; i++){
-				treeArr[whichRoot][node].likenc[site][i]=treeArr[whichRoot][node].likenc[site][i]/max;
+			PT[4*j+i] = p;
+		}
+	}
+	ctx->ptcache_t[e] = t;
+	ctx->ptcache_version[e] = ctx->model_version;
+	return PT;
+}
+//divides each site's partials by their largest state and adds childscale, if given, and the log of that state to scale
+static void rescalepartials(like_t* like, double* scale, const double* childscale, int numbase){
+	int i, site;
+	double max;
+	for (site=0; site<numbase; site++){
+		max=0.0;
+		for (i=0; i<4; i++){
+			if (like[4*site+i]>max){
+				max = like[4*site+i];
 			}
-			UFCnc[site] = UFCnc[site] + log(max);
 		}
+		if (max<0.00000000001) printf("Warning, max = %lf\n",max);
+		for (i=0; i<4; i++){
+			like[4*site+i]=like[4*site+i]/max;
+		}
+		if (childscale != NULL){
+			scale[site] = scale[site] + childscale[site];
+		}
+		scale[site] = scale[site] + log(max);
 	}
 }
-double getlike_gamma(double par[],int whichRoot, int numbase, int root, int numspec, int** seqArr){
-	double stand, L, loclike, **locloglike, max, pi[4], gampar[2], d, like = 0.0;
+void makeconnc(likeContext* ctx, flatTree* ft, int cat){
+	//internal nodes in postorder, so both children are finished before their parent.
+	//A node whose partials were built under the same model and rate category from the
+	//same two branch lengths, with neither child rebuilt since, is left as it is
+	int k, node, c0, c1, site;
+	double t0, t1, *scale;
+	like_t *like, *PT;
+	double lambda = ctx->statevector[cat];
+	struct node** treeArr = ctx->treeArr;
+	int whichRoot = ctx->whichRoot;
+	int numbase = ctx->numbase;
+	alignmentMatrix* seqArr = ctx->seqArr;
+	partialState* ps;
+	for(k=0; k<ft->number_in_postorder; k++){
+		node = ft->postorder[k];
+		if (ft->child0[node]==-1){
+			continue;
+		}
+		c0 = ft->child0[node];
+		c1 = ft->child1[node];
+		t0 = lambda*ft->bl[c0];
+		t1 = lambda*ft->bl[c1];
+		ps = &ctx->partials[node];
+		if (ps->version == ctx->model_version && ps->cat == cat && ps->t[0] == t0 && ps->t[1] == t1 && !ctx->rebuilt[c0] && !ctx->rebuilt[c1]){
+			ctx->rebuilt[node] = 0;
+			ctx->cl_reused++;
+			continue;
+		}
+		ctx->rebuilt[node] = 1;
+		ctx->cl_rebuilt++;
+		like = treeArr[whichRoot][node].likenc;
+		scale = ctx->scalenc+(size_t)node*numbase;
+		PT = branchtransitionmatrixnc(ctx,c0,cat,t0);
+		if (ft->seqId[c0]!=-1){
+			lk_tip(PT,&ALN_BASE(seqArr,ft->seqId[c0],0),seqArr->number_of_seqs,like,numbase);
+			for (site=0; site<numbase; site++){
+				scale[site] = 0.0;
+			}
+		}else{
+			lk_transform(PT,treeArr[whichRoot][c0].likenc,like,numbase);
+			memcpy(scale,ctx->scalenc+(size_t)c0*numbase,numbase*sizeof(double));
+		}
+		PT = branchtransitionmatrixnc(ctx,c1,cat,t1);
+		if (ft->seqId[c1]!=-1){
+			lk_tip_mul(PT,&ALN_BASE(seqArr,ft->seqId[c1],0),seqArr->number_of_seqs,like,numbase);
+#ifdef LIKE_FLOAT
+			//a float partial has no room for a chain of tips shrinking it unscaled, as on a caterpillar spine
+			rescalepartials(like,scale,NULL,numbase);
+#endif
+		}else{
+			lk_transform_mul(PT,treeArr[whichRoot][c1].likenc,like,numbase);
+			rescalepartials(like,scale,ctx->scalenc+(size_t)c1*numbase,numbase);
+		}
+		ps->version = ctx->model_version;
+		ps->cat = cat;
+		ps->t[0] = t0;
+		ps->t[1] = t1;
+	}
+	//leaves never change while the context is bound to this tree
+	for(k=0; k<ft->number_in_postorder; k++){
+		ctx->rebuilt[ft->postorder[k]] = 0;
+	}
+}
+double getlike_gamma(double par[], likeContext* ctx){
+	double stand, L, loclike, max, pi[4], gampar[2], d, like = 0.0;
 	int i, j, k;
-	COUNT2++;
+	struct node** treeArr = ctx->treeArr;
+	int whichRoot = ctx->whichRoot;
+	int numbase = ctx->numbase;
+	int root = ctx->root;
+	double** locloglike = ctx->locloglike;
+	ctx->COUNT2++;
 	stand = 1.0+par[1]+par[2]+par[3];
 	pi[0]=par[1]/stand;
 	pi[1]=par[2]/stand;
 	pi[2]=par[3]/stand;
 	pi[3]=1.0-pi[0]-pi[1]-pi[2];
 	gampar[0]=gampar[1]=par[9]; //We are setting alpha=beta to keep a constant mean to avoid identifiability issues.  This is not the same as a standard gammma.
-	UFCnc = malloc(numbase*(sizeof(double)));
-	statevector = malloc(NUMCAT*(sizeof(double)));
-	locloglike = malloc(numbase*(sizeof(double *)));
-	for (i=0; i<numbase; i++){
-		locloglike[i] = malloc(NUMCAT*(sizeof(double)));
-	}
-	definegammaquantiles(NUMCAT, gampar);
-	statevector[0]=1.0;
-	inittransitionmatrixnc(pi);
+	definegammaquantiles(NUMCAT, gampar, ctx->statevector);
+	ctx->statevector[0]=1.0;
+	inittransitionmatrixnc(ctx,pi);
+	flattree_update_bl(ctx->ft,treeArr,whichRoot);
 	for (j=0; j<NUMCAT; j++){
-		for (i=0; i<numbase; i++){
-			UFCnc[i]=0.0;
-		}
-		makeconnc(root, statevector[j],whichRoot,numbase,numspec,seqArr,root);
+		makeconnc(ctx, ctx->ft, j);
 		for (i=0; i<numbase; i++){
 			L=0.0;
 			for (k=0;k<4;k++){
-				L += treeArr[whichRoot][root].likenc[i][k]*pi[k];
+				L += treeArr[whichRoot][root].likenc[4*i+k]*pi[k];
 			}
-			if (L>0.0) locloglike[i][j] = log(L) + UFCnc[i];
+			if (L>0.0) locloglike[i][j] = log(L) + ctx->scalenc[(size_t)root*numbase+i];
 		}
 	}
 	for (i=0; i<numbase; i++){
@@ -3441,115 +3695,190 @@ double getlike_gamma(double par[],int whichRoot, int numbase, int root, int nums
 				loclike += exp(d);
 			}
 		}
-		like = like + log(loclike) + max;
-	}
-	free(statevector);
-	for (i=0; i<numbase; i++){
-		free(locloglike[i]);
+		like = like + ctx->weight[i]*(log(loclike) + max);
 	}
-	free(locloglike);
-	//printf("LIKE: %lf\n",like - (double)numbase*log((double)NUMCAT));
+	//printf("LIKE: %lf\n",like - (double)ctx->number_of_sites*log((double)NUMCAT));
 	//printf("\n");
-	free(UFCnc);
-	return -like + (double)numbase*log((double)NUMCAT);
+	return -like + (double)ctx->number_of_sites*log((double)NUMCAT);
 }
-double like_bl_Arr(double par[2], int whichRoot, int numbase, int root, int numspec, int** seqArr){
-	int i, j, s, base;
-	double b, p, L=0.0;
-	maketransitionmatrixnc(0,par[1],whichRoot);
-	for (s=0; s<numbase; s++){
-		p=0.0;
-		if (treeArr[whichRoot][localnode].up[0]==-1){
-			//base = seqArr[whichRoot][localnode-numspecArr[whichRoot]+1][s];
-			base = seqArr[localnode][s];
-			assert(base >= 0 && base <= 4);
-			if (base<4){
-				for (j=0; j<4; j++){
-					p += localpi[base]*PMATnc[0][base][j]*templike_nc[s][j];
-				}
+double branch_loglike(likeContext* ctx, int node, double t, double* d1, double* d2){
+	//log likelihood of the branch below node at length t with its first and second derivatives,
+	//from the site coefficients branch_coefficients left in ctx->work
+	int k, s;
+	double e[4], le[4], lle[4], f, f1, f2, r1, L=0.0;
+	double* c = ctx->work;
+	int tip = ctx->treeArr[ctx->whichRoot][node].up[0]==-1;
+	for (k=0; k<4; k++){
+		e[k] = exp(t*ctx->RRVALnc[k]);
+		le[k] = ctx->RRVALnc[k]*e[k];
+		lle[k] = ctx->RRVALnc[k]*le[k];
+	}
+	*d1 = 0.0;
+	*d2 = 0.0;
+	for (s=0; s<ctx->numbase; s++){
+		if (tip && ctx->tiprow[s]==4){
+			continue; //a missing base says nothing about this branch
+		}
+		f = f1 = f2 = 0.0;
+		for (k=0; k<4; k++){
+			f += c[4*s+k]*e[k];
+			f1 += c[4*s+k]*le[k];
+			f2 += c[4*s+k]*lle[k];
+		}
+		r1 = f1/f;
+		L += ctx->weight[s]*log(f);
+		*d1 += ctx->weight[s]*r1;
+		*d2 += ctx->weight[s]*(f2/f - r1*r1);
+	}
+	ctx->COUNT++;
+	return L;
+}
+void branch_coefficients(likeContext* ctx, int node, double pi[4]){
+	//with P(t)[i][j] = sum_k LRVECnc[i][k] RRVECnc[k][j] exp(RRVALnc[k] t) the likelihood of a site
+	//across the branch is sum_k c[k] exp(RRVALnc[k] t), so the partials are folded into c once
+	int i, j, k, s, base;
+	double a, b, tipcoef[5][4];
+	double* c = ctx->work;
+	like_t* templike = ctx->templike_nc;
+	like_t* like = ctx->treeArr[ctx->whichRoot][node].likenc;
+	uint8_t* row = ctx->tiprow;
+	int tip = ctx->treeArr[ctx->whichRoot][node].up[0]==-1;
+	if (tip){
+		//a leaf's side of every site is one of five rows, and its bases are read
+		//once here rather than at the alignment's column stride on every evaluation
+		for (base=0; base<5; base++){
+			for (k=0; k<4; k++){
+				tipcoef[base][k] = base==4 ? 0.0 : pi[base]*ctx->LRVECnc[base][k];
+			}
+		}
+		for (s=0; s<ctx->numbase; s++){
+			row[s] = ALN_BASE(ctx->seqArr,node,s);
+		}
+	}
+	for (s=0; s<ctx->numbase; s++){
+		for (k=0; k<4; k++){
+			b = 0.0;
+			for (j=0; j<4; j++){
+				b += ctx->RRVECnc[k][j]*templike[4*s+j];
+			}
+			if (tip){
+				a = tipcoef[row[s]][k];
 			}else{
-				p=1.0;
+				a = 0.0;
+				for (i=0; i<4; i++){
+					a += pi[i]*like[4*s+i]*ctx->LRVECnc[i][k];
+				}
 			}
+			c[4*s+k] = a*b;
+		}
+	}
+}
+void maxbl_nc(likeContext* ctx, int node, int parent, double pi[4], int precision){
+	//Newton-Raphson on the branch length with analytic derivatives; a step that does not
+	//improve the likelihood is halved, and a non-concave point takes a plain ascent step
+	int iter, halvings, maxiter;
+	double t, tnew, step, L, Lnew, d1, d2, d1new, d2new, tol;
+	struct node** treeArr = ctx->treeArr;
+	int whichRoot = ctx->whichRoot;
+	if (precision == 2){
+		tol = 1.0e-8;
+		maxiter = 100;
+	}else if (precision == 1){
+		tol = 1.0e-6;
+		maxiter = 50;
+	}else{
+		tol = 1.0e-4;
+		maxiter = 20;
+	}
+	branch_coefficients(ctx,node,pi);
+	t = treeArr[whichRoot][node].bl;
+	if (t < MINBL) t = MINBL;
+	if (t > MAXBL) t = MAXBL;
+	L = branch_loglike(ctx,node,t,&d1,&d2);
+	for (iter=0; iter<maxiter; iter++){
+		if (d2 < 0.0){
+			step = -d1/d2;
+		}else if (d1 > 0.0){
+			step = t;
 		}else{
-			for (i=0; i<4; i++){
-				b=0;
-				for (j=0; j<4; j++){
-					b += PMATnc[0][i][j]*templike_nc[s][j];
-				}
-				p += b*localpi[i]*treeArr[whichRoot][localnode].likenc[s][i];
-			}
-		}
-		L += log(p);
-	} COUNT++;
-	return -L;
-}
-void maxbl_nc(int node, int parent, double pi[4], int precision, int whichRoot, int numbase, int** seqArr, int root, int numspec){
-	double par[2], minpar[2], maxpar[2], L;
-	par[1]=treeArr[whichRoot][node].bl; /*This stuff should probably be cleaned up*/
-	minpar[1]=MINBL;
-	maxpar[1]=MAXBL;
-	localpi=pi;
-	localnode=node;
-	L = findmax_Arr(par, minpar, maxpar, 1, like_bl_Arr, precision, whichRoot, numbase, root, numspec, seqArr);
-	treeArr[whichRoot][node].bl = par[1];
-}
-void recurse_estimatebranchlengths(int node, double pi[4], int precision, int whichRoot, int numbase, int** seqArr, int root, int numspec){
-	int i,j, s, parent, otherb, child1, child2;
-	double max, bl;
+			step = -0.5*t;
+		}
+		tnew = t+step;
+		if (tnew < MINBL) tnew = MINBL;
+		if (tnew > MAXBL) tnew = MAXBL;
+		if (fabs(tnew-t) < tol){
+			break;
+		}
+		Lnew = branch_loglike(ctx,node,tnew,&d1new,&d2new);
+		for (halvings=0; Lnew < L && halvings < 30 && fabs(tnew-t) >= tol; halvings++){
+			tnew = 0.5*(t+tnew);
+			Lnew = branch_loglike(ctx,node,tnew,&d1new,&d2new);
+		}
+		if (Lnew < L){
+			break;
+		}
+		step = tnew-t;
+		t = tnew;
+		L = Lnew;
+		d1 = d1new;
+		d2 = d2new;
+		if (fabs(step) < tol){
+			break;
+		}
+	}
+	treeArr[whichRoot][node].bl = t;
+}
+void recurse_estimatebranchlengths(likeContext* ctx, int node, double pi[4], int precision){
+	int i, s, parent, otherb, child1, child2;
+	double max;
+	like_t *post, *PT;
+	struct node** treeArr = ctx->treeArr;
+	int whichRoot = ctx->whichRoot;
+	int numbase = ctx->numbase;
+	alignmentMatrix* seqArr = ctx->seqArr;
 	child1 = treeArr[whichRoot][node].up[0];
 	parent = treeArr[whichRoot][node].down;
-	bl = treeArr[whichRoot][node].bl;
 	if ((otherb = treeArr[whichRoot][parent].up[0])==node){
 		otherb = treeArr[whichRoot][parent].up[1];
 	}
-	maketransitionmatrixnc(1, treeArr[whichRoot][otherb].bl,whichRoot);
-	for (s=0; s<numbase; s++){
-		for (i=0; i<4; i++){
-			max=0.0;
-			if (treeArr[whichRoot][otherb].up[0]==-1){
-				//templike_nc[s][i] = PMATnc[1][i][seqArr[whichRoot][otherb-numspec+1][s]]; /*if(s==0) printf("temp[s][%i]: %lf (b=%i, %lf), ",i,templike_nc[s][i],seq[otherb-numspec+1][s], PMATnc[1][i][seq[otherb-numspec+1][s]]);*/
-				templike_nc[s][i] = PMATnc[1][i][seqArr[otherb][s]]; /*if(s==0) printf("temp[s][%i]: %lf (b=%i, %lf), ",i,templike_nc[s][i],seq[otherb-numspec+1][s], PMATnc[1][i][seq[otherb-numspec+1][s]]);*/
-			}else{
-				templike_nc[s][i]=0.0;
-				for (j=0; j<4; j++){
-					templike_nc[s][i]=templike_nc[s][i]+treeArr[whichRoot][otherb].likenc[s][j]*PMATnc[1][i][j];
-				}
-			}
-			if ((templike_nc[s][i]=templike_nc[s][i]*treeArr[whichRoot][parent].posteriornc[s][i])>max){
-				max=templike_nc[s][i];
-			}
-		}
+	//category 0 always has rate 1, so its cache entries are the plain branch lengths
+	PT = branchtransitionmatrixnc(ctx,otherb,0,treeArr[whichRoot][otherb].bl);
+	if (treeArr[whichRoot][otherb].up[0]==-1){
+		lk_tip(PT,&ALN_BASE(seqArr,otherb,0),seqArr->number_of_seqs,ctx->templike_nc,numbase);
+	}else{
+		lk_transform(PT,treeArr[whichRoot][otherb].likenc,ctx->templike_nc,numbase);
 	}
-	maxbl_nc(node,  parent, pi,precision,whichRoot, numbase, seqArr, root, numspec);
-	maketransitionmatrixnc(0, treeArr[whichRoot][node].bl,whichRoot);
+	lk_mul(treeArr[whichRoot][parent].posteriornc,ctx->templike_nc,numbase);
+	maxbl_nc(ctx, node, parent, pi, precision);
+	if (child1==-1){
+		return; //leaf posteriors are only ever rebuilt from their parent by getposterior_nc
+	}
+	PT = branchtransitionmatrixnc(ctx,node,0,treeArr[whichRoot][node].bl);
+	post = treeArr[whichRoot][node].posteriornc;
+	lk_transform(PT,ctx->templike_nc,post,numbase);
 	for (s=0; s<numbase; s++){
 		max=0.0;
 		for (i=0; i<4; i++){
-			treeArr[whichRoot][node].posteriornc[s][i]=0.0;
-			for (j=0; j<4; j++){
-				treeArr[whichRoot][node].posteriornc[s][i] = treeArr[whichRoot][node].posteriornc[s][i] + PMATnc[0][i][j]*templike_nc[s][j];
-			}
-			if (treeArr[whichRoot][node].posteriornc[s][i]>max){//more hysterical underflow protection
-				max=treeArr[whichRoot][node].posteriornc[s][i];
+			if (post[4*s+i]>max){//more hysterical underflow protection
+				max=post[4*s+i];
 			}
 		}
 		for (i=0; i<4; i++){
-			treeArr[whichRoot][node].posteriornc[s][i]=treeArr[whichRoot][node].posteriornc[s][i]/max;
+			post[4*s+i]=post[4*s+i]/max;
 		}
 	}
-	if (child1>-1){
-		child2 = treeArr[whichRoot][node].up[1];
-		recurse_estimatebranchlengths(child1, pi, precision, whichRoot, numbase, seqArr, root, numspec);
-		recurse_estimatebranchlengths(child2, pi, precision, whichRoot, numbase, seqArr, root, numspec);
-	}
+	child2 = treeArr[whichRoot][node].up[1];
+	recurse_estimatebranchlengths(ctx, child1, pi, precision);
+	recurse_estimatebranchlengths(ctx, child2, pi, precision);
 }
-void estimatebranchlengths(double par[10], int precision, int whichRoot, int numbase, int root, int numspec, int** seqArr){
-	int i, j, s, child1, child2;
+void estimatebranchlengths(likeContext* ctx, double par[10], int precision){
+	int i, s, child1, child2;
 	double stand, pi[4];
-	for (i=0; i<10; i++){
-		currentestimate[i]=par[i];
-	}
-	doNRinits(1);
+	struct node** treeArr = ctx->treeArr;
+	int whichRoot = ctx->whichRoot;
+	int numbase = ctx->numbase;
+	int root = ctx->root;
+	alignmentMatrix* seqArr = ctx->seqArr;
 	stand = 1.0+par[1]+par[2]+par[3];
 	pi[0]=par[1]/stand;
 	pi[1]=par[2]/stand;
@@ -3557,59 +3886,43 @@ void estimatebranchlengths(double par[10], int precision, int whichRoot, int num
 	pi[3]=1.0-pi[0]-pi[1]-pi[2];
 	child1 = treeArr[whichRoot][root].up[0];
 	child2 = treeArr[whichRoot][root].up[1];
-	templike_nc = malloc(numbase*(sizeof(double *)));
-	for (i=0; i<numbase; i++){
-		templike_nc[i]=malloc(4*(sizeof(double)));
-	}
 	if ((treeArr[whichRoot][child2].bl=treeArr[whichRoot][child2].bl+treeArr[whichRoot][child1].bl-MINBL)<MINBL){
 		treeArr[whichRoot][child2].bl=MINBL;
 	}
 	treeArr[whichRoot][child1].bl=MINBL;
-	getlike_gamma(par,whichRoot,numbase,root,numspec,seqArr); /*this is not necessary if the likelihood fucntion has already been called*/
-	maketransitionmatrixnc(0, treeArr[whichRoot][child2].bl+treeArr[whichRoot][child1].bl,whichRoot);
+	getlike_gamma(par,ctx); /*this is not necessary if the likelihood fucntion has already been called*/
+	maketransitionmatrixnc(ctx,0, treeArr[whichRoot][child2].bl+treeArr[whichRoot][child1].bl);
 	for (s=0; s<numbase; s++){
 		for (i=0; i<4; i++){
-			treeArr[whichRoot][root].posteriornc[s][i] = 1.0;/*tree[child1].likenc[s][i];*/
-			if (treeArr[whichRoot][child2].up[0]>-1){
-				treeArr[whichRoot][child1].posteriornc[s][i]=0.0;
-				for (j=0; j<4; j++){
-					treeArr[whichRoot][child1].posteriornc[s][i] += treeArr[whichRoot][child2].likenc[s][j]*PMATnc[0][i][j];
-				}
-			}else{
-				//treeArr[whichRoot][child1].posteriornc[s][i] = PMATnc[0][i][seqArr[whichRoot][child2-numspec+1][s]];
-				treeArr[whichRoot][child1].posteriornc[s][i] = PMATnc[0][i][seqArr[child2][s]];
-			}
-		}
-		if (s==0){
-			//printf("node %d initialization: %lf %lf %lf %lf\n",root,treeArr[whichRoot][root].posteriornc[s][0],treeArr[whichRoot][root].posteriornc[s][1],treeArr[whichRoot][root].posteriornc[s][2],treeArr[whichRoot][root].posteriornc[s][3]);
-			//printf("Initial child 1 like: %lf %lf %lf %lf\n",treeArr[whichRoot][child1].likenc[s][0],treeArr[whichRoot][child1].likenc[s][1],treeArr[whichRoot][child1].likenc[s][2],treeArr[whichRoot][child1].likenc[s][3]);
+			treeArr[whichRoot][root].posteriornc[4*s+i] = 1.0;/*tree[child1].likenc[s][i];*/
 		}
 	}
+	if (treeArr[whichRoot][child1].up[0]==-1){
+		//nothing below child1 reads its posterior
+	}else if (treeArr[whichRoot][child2].up[0]>-1){
+		lk_transform(ctx->PTnc[0],treeArr[whichRoot][child2].likenc,treeArr[whichRoot][child1].posteriornc,numbase);
+	}else{
+		//treeArr[whichRoot][child1].posteriornc[s][i] = ctx->PMATnc[0][i][seqArr[whichRoot][child2-numspec+1][s]];
+		lk_tip(ctx->PTnc[0],&ALN_BASE(seqArr,child2,0),seqArr->number_of_seqs,treeArr[whichRoot][child1].posteriornc,numbase);
+	}
 	if (treeArr[whichRoot][child1].up[0]>-1){
-		recurse_estimatebranchlengths(treeArr[whichRoot][child1].up[0], pi, precision, whichRoot, numbase, seqArr, root, numspec);
+		recurse_estimatebranchlengths(ctx, treeArr[whichRoot][child1].up[0], pi, precision);
 	}
 	if (treeArr[whichRoot][child1].up[1]>-1){
-		recurse_estimatebranchlengths(treeArr[whichRoot][child1].up[1], pi, precision, whichRoot, numbase, seqArr, root, numspec);
-	}
-	recurse_estimatebranchlengths(child2, pi, precision,whichRoot, numbase, seqArr, root, numspec);
-	for (i=0; i<numbase; i++){
-		free(templike_nc[i]);
+		recurse_estimatebranchlengths(ctx, treeArr[whichRoot][child1].up[1], pi, precision);
 	}
-	free(templike_nc);
-	freeNRinits(1);
+	recurse_estimatebranchlengths(ctx, child2, pi, precision);
 }
-double maximizelikelihoodnc_globals(double parameters[10], int precision, int whichRoot, int numbase, int** seqArr, int root, int numspec){
+double maximizelikelihoodnc(likeContext* ctx, double parameters[10], int precision){
 	//optimization function starts counting at 1 so arrays have dimensionality n+1
 	int i;
 	double L, lowbound[10], upbound[10];
-	doNRinits(10);
 	for (i=1; i<10; i++){
 		lowbound[i]=0.05;
 		upbound[i]=20.0;
 	}
 	lowbound[9]=0.3;
-	L=findmax_Arr(parameters, lowbound, upbound, 9, getlike_gamma, precision, whichRoot, numbase, root, numspec, seqArr);
-	freeNRinits(10);
+	L=findmax_Arr(parameters, lowbound, upbound, 9, getlike_gamma, precision, ctx);
 	return L;
 }
 void print_branch_lengths(node** treeArr, int node, int whichRoot){
@@ -3619,153 +3932,161 @@ void print_branch_lengths(node** treeArr, int node, int whichRoot){
 		print_branch_lengths(treeArr,treeArr[whichRoot][node].up[1],whichRoot);
 	}
 }
-void estimatenucparameters(int whichRoot, int numbase, int root, int numspec, int** seqArr){
+void estimatenucparameters(likeContext* ctx){
 	double L;
-	COUNT=COUNT2=0;
-	clearGlobals();
 	//double precision[1];
 	//precision[0]=0;
 	//treeArr[whichRoot][root].bl = 0.00001;
 	//print_branch_lengths(treeArr,root,whichRoot);
-	//printf("Initial likelihoodL value = %lf\n",-getlike_gamma(parameters,whichRoot,numbase,root,numspec,seqArr));
+	//printf("Initial likelihoodL value = %lf\n",-getlike_gamma(ctx->parameters,ctx));
 	//print_branch_lengths(treeArr,root,whichRoot);
-	estimatebranchlengths(parameters,0, whichRoot, numbase, root, numspec,seqArr);
-	L=maximizelikelihoodnc_globals(parameters,0,whichRoot,numbase,seqArr,root,numspec);
+	estimatebranchlengths(ctx,ctx->parameters,0);
+	L=maximizelikelihoodnc(ctx,ctx->parameters,0);
 	//printf("Current ML value = %lf\n",L);
-	estimatebranchlengths(parameters,0, whichRoot, numbase, root, numspec,seqArr);
-	L=maximizelikelihoodnc_globals(parameters,0,whichRoot,numbase,seqArr,root,numspec);
+	estimatebranchlengths(ctx,ctx->parameters,0);
+	L=maximizelikelihoodnc(ctx,ctx->parameters,0);
 	//print_branch_lengths(treeArr,root,whichRoot);
 	//printf("Current ML value = %lf\n",L);
-	estimatebranchlengths(parameters,1, whichRoot, numbase, root, numspec,seqArr);
-	L=maximizelikelihoodnc_globals(parameters,0,whichRoot,numbase,seqArr,root,numspec);
+	estimatebranchlengths(ctx,ctx->parameters,1);
+	L=maximizelikelihoodnc(ctx,ctx->parameters,0);
 	//printf("Current ML value = %lf\n",L);
-	estimatebranchlengths(parameters,2, whichRoot, numbase, root, numspec,seqArr);
-	L=maximizelikelihoodnc_globals(parameters,2,whichRoot,numbase,seqArr,root,numspec);
+	estimatebranchlengths(ctx,ctx->parameters,2);
+	L=maximizelikelihoodnc(ctx,ctx->parameters,2);
 	//printf("Current ML value = %lf\n",L);
-	estimatebranchlengths(parameters,2, whichRoot, numbase, root, numspec,seqArr);
-	estimatebranchlengths(parameters,2, whichRoot, numbase, root, numspec,seqArr);
-	//printf("Current ML value= %lf\n",-getlike_gamma(parameters,whichRoot,numbase,root,numspec,seqArr));
+	estimatebranchlengths(ctx,ctx->parameters,2);
+	estimatebranchlengths(ctx,ctx->parameters,2);
+	//printf("Current ML value= %lf\n",-getlike_gamma(ctx->parameters,ctx));
 }
-void makeposterior_nc(int node, int whichRoot, int numbase, int** seqArr){
-	int i,j, s, parent, otherb, child1, child2, b;
-	double bl, max;
-	child1 = treeArr[whichRoot][node].up[0];
-	child2 = treeArr[whichRoot][node].up[1];
-	parent = treeArr[whichRoot][node].down;
-	bl = treeArr[whichRoot][node].bl;
-	maketransitionmatrixnc(0, bl,whichRoot);
-	if ((otherb = treeArr[whichRoot][parent].up[0])==node){
-		otherb = treeArr[whichRoot][parent].up[1];
-	}
-	maketransitionmatrixnc(1, treeArr[whichRoot][otherb].bl,whichRoot);
-	for (s=0; s<numbase; s++){
-		if (treeArr[whichRoot][otherb].up[0]>-1){
-			for (i=0; i<4; i++){
-				templike_nc[s][i]=0;
-				for (j=0; j<4; j++){
-					templike_nc[s][i] += treeArr[whichRoot][otherb].likenc[s][j]*PMATnc[1][i][j];
-				}
-				templike_nc[s][i]=templike_nc[s][i]*treeArr[whichRoot][parent].posteriornc[s][i];
-			}
+void makeposterior_nc(likeContext* ctx, flatTree* ft){
+	//reverse postorder reaches every parent before its children; the root and leaves are handled by the caller
+	int i, k, s, node, parent, otherb;
+	double scale;
+	like_t *post, *PT;
+	struct node** treeArr = ctx->treeArr;
+	int whichRoot = ctx->whichRoot;
+	int numbase = ctx->numbase;
+	alignmentMatrix* seqArr = ctx->seqArr;
+	for(k=ft->number_in_postorder-1; k>=0; k--){
+		node = ft->postorder[k];
+		if (node==ft->root || ft->child0[node]==-1){
+			continue;
+		}
+		parent = ft->parent[node];
+		if ((otherb = ft->child0[parent])==node){
+			otherb = ft->child1[parent];
+		}
+		PT = branchtransitionmatrixnc(ctx,otherb,0,ft->bl[otherb]);
+		if (ft->child0[otherb]>-1){
+			lk_transform(PT,treeArr[whichRoot][otherb].likenc,ctx->templike_nc,numbase);
 		}else{
-			b=seqArr[otherb][s];
+			lk_tip(PT,&ALN_BASE(seqArr,ft->seqId[otherb],0),seqArr->number_of_seqs,ctx->templike_nc,numbase);
+		}
+		lk_mul(treeArr[whichRoot][parent].posteriornc,ctx->templike_nc,numbase);
+		post = treeArr[whichRoot][node].posteriornc;
+		lk_transform(branchtransitionmatrixnc(ctx,node,0,ft->bl[node]),ctx->templike_nc,post,numbase);
+		for (s=0; s<numbase; s++){
+			//more underflow protection; the scale has always been the last state's
+			//value, which is fine because getposterior_nc renormalizes each site
+			scale = post[4*s+3];
 			for (i=0; i<4; i++){
-				templike_nc[s][i] = PMATnc[1][i][b]*treeArr[whichRoot][parent].posteriornc[s][i];
+				post[4*s+i]=post[4*s+i]/scale;
 			}
 		}
+	}
+}
+void getrootposterior_nc(likeContext* ctx){
+	//root marginal only: the final conditional likelihoods at the root times the base
+	//frequencies, without the preorder pass or any other node's posterior
+	int i, s;
+	double sum, pi[4], stand;
+	like_t *post, *like;
+	struct node** treeArr = ctx->treeArr;
+	int whichRoot = ctx->whichRoot;
+	int root = ctx->root;
+	getlike_gamma(ctx->parameters,ctx); /*need to call likelihood again*/
+	stand = 1.0+ctx->parameters[1]+ctx->parameters[2]+ctx->parameters[3];
+	pi[0]=ctx->parameters[1]/stand;
+	pi[1]=ctx->parameters[2]/stand;
+	pi[2]=ctx->parameters[3]/stand;
+	pi[3]=1.0-pi[0]-pi[1]-pi[2];
+	post = treeArr[whichRoot][root].posteriornc;
+	like = treeArr[whichRoot][root].likenc;
+	for (s=0; s<ctx->numbase; s++){
+		sum = 0.0;
 		for (i=0; i<4; i++){
-			treeArr[whichRoot][node].posteriornc[s][i]=0.0;
-			max=0.0;
-			for (j=0; j<4; j++){
-				if ((treeArr[whichRoot][node].posteriornc[s][i] = treeArr[whichRoot][node].posteriornc[s][i] + PMATnc[0][i][j]*templike_nc[s][j])>max){
-					max=treeArr[whichRoot][node].posteriornc[s][i];//more underflow protection
-				}
-			}
+			sum = sum + (post[4*s+i]=like[4*s+i]*pi[i]);
 		}
 		for (i=0; i<4; i++){
-			treeArr[whichRoot][node].posteriornc[s][i]=treeArr[whichRoot][node].posteriornc[s][i]/max;
+			post[4*s+i] = post[4*s+i]/sum;
 		}
 	}
-		if (treeArr[whichRoot][child1].up[0]>-1){
-			makeposterior_nc(child1,whichRoot,numbase,seqArr);
-		}
-		if (treeArr[whichRoot][child2].up[0]>-1){
-			makeposterior_nc(child2,whichRoot,numbase,seqArr);
-		}
 }
-void getposterior_nc(int whichRoot, int numbase, int root, int numspec, int** seqArr){
-	int i, j, s, k, parent, b, notdonebefore;
-	double p, sum, pi[4], stand, **templike;
-	getlike_gamma(parameters,whichRoot,numbase,root,numspec,seqArr); /*need to call likelihood again*/
-	templike_nc = malloc(numbase*(sizeof(double *)));
-	for (i=0; i<numbase; i++){
-		templike_nc[i]=malloc(4*(sizeof(double)));
-	}
-	stand = 1.0+parameters[1]+parameters[2]+parameters[3];
-	pi[0]=parameters[1]/stand;
-	pi[1]=parameters[2]/stand;
-	pi[2]=parameters[3]/stand;
+void getposterior_nc(likeContext* ctx){
+	int i, j, s, k, parent, b;
+	double sum, pi[4], stand;
+	like_t *post, *like, *parentpost, *PT;
+	struct node** treeArr = ctx->treeArr;
+	int whichRoot = ctx->whichRoot;
+	int numbase = ctx->numbase;
+	int root = ctx->root;
+	int numspec = ctx->numspec;
+	alignmentMatrix* seqArr = ctx->seqArr;
+	assert(ctx->posterior_mode == POSTERIOR_ALL);
+	getlike_gamma(ctx->parameters,ctx); /*need to call likelihood again*/
+	stand = 1.0+ctx->parameters[1]+ctx->parameters[2]+ctx->parameters[3];
+	pi[0]=ctx->parameters[1]/stand;
+	pi[1]=ctx->parameters[2]/stand;
+	pi[2]=ctx->parameters[3]/stand;
 	pi[3]=1.0-pi[0]-pi[1]-pi[2];
 	for (s=0; s<numbase; s++){
 		for (i=0; i<4; i++){
-			treeArr[whichRoot][root].posteriornc[s][i] = 1.0;
+			treeArr[whichRoot][root].posteriornc[4*s+i] = 1.0;
 		}
 	}
-	if (treeArr[whichRoot][treeArr[whichRoot][root].up[0]].up[0]>-1){
-		makeposterior_nc(treeArr[whichRoot][root].up[0],whichRoot,numbase,seqArr);
-	}
-	if (treeArr[whichRoot][treeArr[whichRoot][root].up[1]].up[0]>-1){
-		makeposterior_nc(treeArr[whichRoot][root].up[1],whichRoot,numbase,seqArr);
-	}
+	makeposterior_nc(ctx,ctx->ft);
 	for (j=0; j<2*numspec-1; j++){
+		post = treeArr[whichRoot][j].posteriornc;
 		if (treeArr[whichRoot][j].up[0]>-1){
+			like = treeArr[whichRoot][j].likenc;
 			for (s=0; s<numbase; s++) {
 				sum = 0.0;
 				for (i=0; i<4; i++){
-					sum = sum + (treeArr[whichRoot][j].posteriornc[s][i]=treeArr[whichRoot][j].likenc[s][i]*treeArr[whichRoot][j].posteriornc[s][i]*pi[i]);
+					sum = sum + (post[4*s+i]=like[4*s+i]*post[4*s+i]*pi[i]);
 				}
 				for (i=0; i<4; i++){
-					treeArr[whichRoot][j].posteriornc[s][i] = treeArr[whichRoot][j].posteriornc[s][i]/sum;
+					post[4*s+i] = post[4*s+i]/sum;
 				}
 			}
 		}else{
 			for (s=0; s<numbase; s++) {
-				notdonebefore=1;
-				b=seqArr[j][s];
+				b=ALN_BASE(seqArr,j,s);
 				if (b==4){
-					if (notdonebefore==1) {
-						maketransitionmatrixnc(0, treeArr[whichRoot][j].bl,whichRoot);
-						notdonebefore=0;
-					}
+					PT = branchtransitionmatrixnc(ctx,j,0,treeArr[whichRoot][j].bl);
 					parent=treeArr[whichRoot][j].down;
+					parentpost=treeArr[whichRoot][parent].posteriornc;
 					sum = 0.0;
 					for (i=0; i<4; i++){
-						treeArr[whichRoot][j].posteriornc[s][i]=0.0;
+						post[4*s+i]=0.0;
 						for (k=0; k<4; k++){
-							treeArr[whichRoot][j].posteriornc[s][i] += treeArr[whichRoot][parent].posteriornc[s][k]*PMATnc[0][i][k];
+							post[4*s+i] += parentpost[4*s+k]*PT[4*k+i];
 						}
-						sum = sum + (treeArr[whichRoot][j].posteriornc[s][i]=treeArr[whichRoot][j].posteriornc[s][i]*pi[i]);
+						sum = sum + (post[4*s+i]=post[4*s+i]*pi[i]);
 					}
 					for (i=0; i<4; i++){
-						treeArr[whichRoot][j].posteriornc[s][i] = treeArr[whichRoot][j].posteriornc[s][i]/sum;
+						post[4*s+i] = post[4*s+i]/sum;
 					}
 				}else{
 					for (i=0; i<4; i++){
 						if (i==b){
-							treeArr[whichRoot][j].posteriornc[s][i]=1.0;
+							post[4*s+i]=1.0;
 						}else{
-							treeArr[whichRoot][j].posteriornc[s][i]=0.0;
+							post[4*s+i]=0.0;
 						}
 					}
 				}
 			}
 		}
 	}
-	for (i=0; i<numbase; i++){
-		free(templike_nc[i]);
-	}
-	free(templike_nc);
-
 }
 void initialize_assignment_mem(type_of_PP**** PP, int numberOfRoots,int* numspec, int* numbase){
 	int i, j, k;
@@ -3790,7 +4111,7 @@ void store_PPs(type_of_PP**** PP, int numberOfRoots,int* numspec, int* numbase){
 					//if ( treeArr[i][j].posteriornc[k][l] == -1 ){
 					//	PP[i][j][k][l] = -1;
 					//}else{
-						PP[i][j][k][l] = (type_of_PP)(1.0-treeArr[i][j].posteriornc[k][l]);//This need to change if we change type for this variable
+						PP[i][j][k][l] = (type_of_PP)(1.0-treeArr[i][j].posteriornc[4*k+l]);//This need to change if we change type for this variable
 					//}
 				}
 			}
@@ -3798,9 +4119,10 @@ void store_PPs(type_of_PP**** PP, int numberOfRoots,int* numspec, int* numbase){
 		}
 	}
 }
-int printRootSeqs(char** rootSeqs, node** treeArr, int numbase, int root, int whichRoot, int* gapped, int first_time, Options opt){
+int buildRootSeq(char** rootSeqs, node** treeArr, int numbase, int root, int whichRoot, int* gapped, int* siteToPattern){
+	//posteriors are kept per site pattern; siteToPattern expands them back to aligned columns
 	type_of_PP minimum;
-	int index,i,j,k;
+	int index,i,j,k,p;
 	int counter=0;
 	//for(i=0; i<numberOfRoots;i++){
 	//printf("NUMBASE: %d\n",numbase);
@@ -3808,11 +4130,12 @@ int printRootSeqs(char** rootSeqs, node** treeArr, int numbase, int root, int wh
 	for(j=0;j<numbase;j++){
 		//minimum=PP[i][rootArr[i]][j][0];
 		if ( gapped [j] != 1){
-		minimum=1.0-treeArr[whichRoot][root].posteriornc[j][0];
+		p=siteToPattern[j];
+		minimum=1.0-treeArr[whichRoot][root].posteriornc[4*p];
 		index=0;
 		for(k=0;k<4;k++){
-			if (minimum > 1.0-treeArr[whichRoot][root].posteriornc[j][k]){
-				minimum=1.0-treeArr[whichRoot][root].posteriornc[j][k];
+			if (minimum > 1.0-treeArr[whichRoot][root].posteriornc[4*p+k]){
+				minimum=1.0-treeArr[whichRoot][root].posteriornc[4*p+k];
 				index=k;
 			}
 				//if( PP[i][rootArr[i]][j][k] == -1){
@@ -3834,32 +4157,45 @@ int printRootSeqs(char** rootSeqs, node** treeArr, int numbase, int root, int wh
 	//}
 	//}
 	//for(i=0;i<numberOfRoots;i++){
+	//with no gapped column the terminator sits at numbase itself
 	int new_numbase=0;
-	for(j=0; j<numbase; j++){
+	for(j=0; j<=numbase; j++){
 		if ( rootSeqs[whichRoot][j] =='\0' ){
 			new_numbase = j;
 			break;
 		}
 	}
-	if (opt.root[0] != '\0' ){
-		FILE* root_sequences_file;
-		if ( first_time == 1){
-			if (( root_sequences_file = fopen(opt.root,"w")) == (FILE *) NULL ) fprintf(stderr,"FASTA file could not be opened.\n");
+	//}
+	return new_numbase;
+}
+void printRootSeqs(char** rootSeqs, int number_of_roots, int* clusterSize, int* numbase, int first_time, Options opt){
+	//written in cluster order once every root is known, so the file does not depend on which thread finished first
+	int i,j;
+	FILE* root_sequences_file;
+	if ( first_time == 1 ){
+		if (( root_sequences_file = fopen(opt.root,"w")) == (FILE *) NULL ){
+			fprintf(stderr,"FASTA file could not be opened.\n");
+			return;
 		}
-		if ( first_time == 0 ){
-			if (( root_sequences_file = fopen(opt.root,"a")) == (FILE *) NULL ) fprintf(stderr,"FASTA file could not be opened.\n");
+	}else{
+		if (( root_sequences_file = fopen(opt.root,"a")) == (FILE *) NULL ){
+			fprintf(stderr,"FASTA file could not be opened.\n");
+			return;
 		}
-		fprintf(root_sequences_file,">%d\n",whichRoot);
-		for(j=0;j<new_numbase;j++){
-			//if ( gapped[j] != 1 ){
-				fprintf(root_sequences_file,"%c",rootSeqs[whichRoot][j]);
-			//}
+	}
+	for(i=0; i<number_of_roots; i++){
+		if (clusterSize[i+1] > 3){
+			fprintf(root_sequences_file,">%d\n",i);
+			for(j=0;j<numbase[i];j++){
+				fprintf(root_sequences_file,"%c",rootSeqs[i][j]);
+			}
+			fprintf(root_sequences_file,"\n");
+		}else{
+			fprintf(root_sequences_file,">random%d\n",i);
+			fprintf(root_sequences_file,"%s\n",rootSeqs[i]);
 		}
-		fprintf(root_sequences_file,"\n");
-		fclose(root_sequences_file);
 	}
-	//}
-	return new_numbase;
+	fclose(root_sequences_file);
 }
 void swap(int* xp, int* yp){
 	int temp = *xp;
@@ -4066,70 +4402,26 @@ int readInXNumberOfLines(int numberOfLinesToRead, gzFile query_reads, int* assig
 	free(query);
 	return iter;
 }
-void calculateTotalDistanceFromRoot(int node, double distance,int whichTree){
-	int child1 = treeArr[whichTree][node].up[0];
-	int child2 = treeArr[whichTree][node].up[1];
+void calculateTotalDistanceFromRoot(int node, double distance,int whichTree, int number_of_nodes){
+	//parents come before children in preorder, so each node hands its total down to both children
+	int i, current, child1, child2;
+	int* order = (int *)malloc(number_of_nodes*sizeof(int));
+	int count = flattree_preorder(treeArr,whichTree,node,number_of_nodes,order);
 	treeArr[whichTree][node].distanceFromRoot = distance + treeArr[whichTree][node].bl;
-	if ( child1 != -1 && child2 != -1){
-		calculateTotalDistanceFromRoot(child1,distance + treeArr[whichTree][node].bl,whichTree);
-		calculateTotalDistanceFromRoot(child2,distance + treeArr[whichTree][node].bl,whichTree);
-	}
-}
-double calculateAverageDistanceBetweenClusters(node** tree, int number_of_leaves, int number_of_clusters, double** distMatForAVG){
-	int i,j,k,l;
-	int m=0;
-	int numPairs=0;
-	double totalDistance1=0;
-	unsigned long n = number_of_clusters;
-	//unsigned long number_of_combinations = factorial(n-1)/(factorial(2)*factorial(n-3));
-	unsigned long number_of_combinations = binomialCoeff(n,2);
-	//printf("number_of_combinations is %d\n",number_of_combinations);
-	//double* distances = (double*)malloc(number_of_combinations*sizeof(double));
-	//double distances[number_of_combinations];
-	//need to fix this
-	double distances[2*number_of_combinations];
-	for(i=1; i<number_of_clusters-1; i++){
-		for(j=i+1; j<number_of_clusters-1; j++){
-			totalDistance1=0;
-			numPairs=0;
-			for(k=0; k<number_of_leaves; k++){
-				for(l=0; l<number_of_leaves; l++){
-					if ( tree[0][k].clusterNumber == i && tree[0][l].clusterNumber == j ){
-						/*int lca = findLCA(tree,k,l);
-						double* distance = (double *)malloc(1*sizeof(double));
-						distance[0]=0;
-						calculateDistance(tree,k,lca,distance);
-						calculateDistance(tree,l,lca,distance);
-						totalDistance1 = totalDistance1 + distance[0];*/
-						/*int index1=0;
-						int index2=0;
-						int m=0;
-						for(m=0; m<number_of_leaves; m++){
-							if (strcmp(clusters[0][m],tree[0][k].name)==0){
-								index1=m;
-							}
-							if (strcmp(clusters[0][m],tree[0][l].name)==0){
-								index2=m;
-							}
-						}*/
-						totalDistance1 = totalDistance1 + distMatForAVG[l][k];
-						numPairs++;
-						//free(distance);
-					}
-				}
-			}
-			distances[m] = totalDistance1/numPairs;
-			m++;
+	for(i=0; i<count; i++){
+		current = order[i];
+		child1 = treeArr[whichTree][current].up[0];
+		child2 = treeArr[whichTree][current].up[1];
+		if ( child1 != -1 && child2 != -1){
+			treeArr[whichTree][child1].distanceFromRoot = treeArr[whichTree][current].distanceFromRoot + treeArr[whichTree][child1].bl;
+			treeArr[whichTree][child2].distanceFromRoot = treeArr[whichTree][current].distanceFromRoot + treeArr[whichTree][child2].bl;
 		}
-		//distances[i] = totalDistance1/numPairs;
 	}
-	double avg = 0;
-	for(i=0; i<m; i++){
-		//printf("AVG[%d]: %lf\n",i,distances[i]);
-		avg = avg + distances[i];
-	}
-	//free(distances);
-	return avg/m;
+	free(order);
+}
+double calculateAverageDistanceBetweenClusters(clusterDistTable* table, node** tree, int number_of_clusters){
+	//mean distance between every pair of clusters 1..number_of_clusters-2, averaged over the pairs
+	return clusterdist_average(table,tree,1,number_of_clusters-2);
 }
 void assignClusters(int number_of_clusters, node** tree, int node){
 	int child1 = tree[0][node].up[0];
@@ -4143,13 +4435,13 @@ void assignClusters(int number_of_clusters, node** tree, int node){
 		assignClusters(number_of_clusters,tree,child2);
 	}
 }
-void findGappedSites(int* gapped, int numbase, int numseqs, int** seqArr){
+void findGappedSites(int* gapped, int numbase, int numseqs, alignmentMatrix* seqArr){
 	int i,j;
 	int gap=0;
 	for(i=0; i<numbase; i++){
 		gap=0;
 		for(j=0; j<numseqs; j++){
-			if (seqArr[j][i]==4){
+			if (ALN_BASE(seqArr,j,i)==4){
 				gap++;
 			}
 		}
@@ -4158,6 +4450,303 @@ void findGappedSites(int* gapped, int numbase, int numseqs, int** seqArr){
 		}
 	}
 }
+static int compare_cluster_order(const void* a, const void* b){
+	const clusterOrder* x = (const clusterOrder *)a;
+	const clusterOrder* y = (const clusterOrder *)b;
+	if (x->size != y->size) return y->size - x->size;
+	return x->index - y->index;
+}
+void setempiricalfrequencies(likeContext* ctx){
+	//F81: base frequencies counted off the alignment, all exchangeabilities left at 1
+	int i, p, b;
+	double count[4] = {0.0, 0.0, 0.0, 0.0};
+	alignmentMatrix* seqArr = ctx->seqArr;
+	for (p=0; p<ctx->numbase; p++){
+		for (i=0; i<seqArr->number_of_seqs; i++){
+			if ((b=ALN_BASE(seqArr,i,p))<4){
+				count[b] += ctx->weight[p];
+			}
+		}
+	}
+	if (count[0]==0.0 || count[1]==0.0 || count[2]==0.0 || count[3]==0.0){
+		return;
+	}
+	for (i=0; i<3; i++){
+		ctx->parameters[i+1]=count[i]/count[3];
+	}
+}
+void consensusRootStates(int* states, sitePatterns* sp){
+	//majority base of each pattern, ties to the first base; gaps and ambiguities do not vote
+	int i, p, b;
+	int count[4];
+	alignmentMatrix* seqArr = &sp->patterns;
+	for (p=0; p<sp->number_of_patterns; p++){
+		count[0]=count[1]=count[2]=count[3]=0;
+		for (i=0; i<seqArr->number_of_seqs; i++){
+			if ((b=ALN_BASE(seqArr,i,p))<4){
+				count[b]++;
+			}
+		}
+		states[p]=0;
+		for (b=1; b<4; b++){
+			if (count[b] > count[states[p]]){
+				states[p]=b;
+			}
+		}
+	}
+}
+void parsimonyRootStates(int* states, sitePatterns* sp, flatTree* ft){
+	//Fitch's bottom-up pass; the root takes the first base in its state set
+	int k, p, node, b;
+	unsigned char inter;
+	alignmentMatrix* seqArr = &sp->patterns;
+	unsigned char* set = (unsigned char *)malloc(ft->number_of_nodes*sizeof(unsigned char));
+	for (p=0; p<sp->number_of_patterns; p++){
+		for (k=0; k<ft->number_in_postorder; k++){
+			node = ft->postorder[k];
+			if (ft->child0[node]==-1){
+				b = ALN_BASE(seqArr,ft->seqId[node],p);
+				set[node] = b<4 ? 1<<b : 0xF;
+			}else if ((inter = set[ft->child0[node]] & set[ft->child1[node]]) != 0){
+				set[node] = inter;
+			}else{
+				set[node] = set[ft->child0[node]] | set[ft->child1[node]];
+			}
+		}
+		for (b=0; b<4 && !(set[ft->root] & (1<<b)); b++);
+		states[p]=b;
+	}
+	free(set);
+}
+int buildRootSeqFromStates(char** rootSeqs, int numbase, int whichRoot, int* gapped, int* siteToPattern, int* states){
+	//same layout as buildRootSeq for methods that pick one base per pattern without posteriors
+	int j;
+	int counter=0;
+	const char bases[4] = {'A','C','G','T'};
+	for(j=0; j<numbase; j++){
+		if ( gapped[j] != 1){
+			rootSeqs[whichRoot][counter]=bases[states[siteToPattern[j]]];
+			counter++;
+		}
+	}
+	rootSeqs[whichRoot][counter]='\0';
+	return counter;
+}
+static double elapsedSeconds(struct timespec* start, struct timespec* end){
+	return ((double)end->tv_sec + 1.0e-9*end->tv_nsec) - ((double)start->tv_sec + 1.0e-9*start->tv_nsec);
+}
+static const char* rootMethodName(int root_method){
+	switch(root_method){
+		case ROOT_METHOD_FIXED_ML: return "fixed-ml";
+		case ROOT_METHOD_PARSIMONY: return "parsimony";
+		case ROOT_METHOD_CONSENSUS: return "consensus";
+		case ROOT_METHOD_MEDOID: return "medoid";
+	}
+	return "ml";
+}
+void *reconstructClusterRoots(void *ptr){
+	struct clusterReconStruct *rstr = (clusterReconStruct *) ptr;
+	int i,j,c,task;
+	struct timespec tstart, tend;
+	//one likelihood context and one kalign engine per worker, reused for each cluster it takes
+	likeContext* ctx = likecontext_new();
+	struct kalign_engine* engine = NULL;
+	if (rstr->root_method != ROOT_METHOD_MEDOID && alloc_kalign_engine(&engine) != 0){
+		fprintf(stderr,"Could not set up kalign\n");
+		exit(1);
+	}
+	rstr->align_time = rstr->infer_time = 0.0;
+	while(1){
+		pthread_mutex_lock(rstr->lock);
+		task = rstr->next[0];
+		rstr->next[0]++;
+		pthread_mutex_unlock(rstr->lock);
+		if (task >= rstr->number_of_tasks){
+			break;
+		}
+		c = rstr->order[task].index;
+		i = c-1;
+		if (rstr->root_method == ROOT_METHOD_MEDOID){
+			//the member closest to all others, from the cluster's distance matrix; nothing is aligned
+			clock_gettime(CLOCK_MONOTONIC, &tstart);
+			double** clusterDistMat = (double **)malloc((rstr->clusterSize[c]+1)*sizeof(double *));
+			for(j=0; j<rstr->clusterSize[c]+1; j++){
+				clusterDistMat[j] = (double *)calloc(rstr->clusterSize[c]+1,sizeof(double));
+			}
+			createDistMat_WFA(rstr->cluster_seqs[c],clusterIds[c],clusterDistMat,rstr->clusterSize[c],rstr->clusterSize[c] >= KALIGN_PARALLEL_MIN ? rstr->huge_threads : 1);
+			char* medoid = rstr->cluster_seqs[c][findMedoid(clusterDistMat,rstr->clusterSize[c])];
+			for(j=0; j<rstr->clusterSize[c]+1; j++){
+				free(clusterDistMat[j]);
+			}
+			free(clusterDistMat);
+			rstr->numbase[i] = strlen(medoid);
+			rootSeqs[i]=(char *)malloc((rstr->numbase[i]+1)*(sizeof(char)));
+			strcpy(rootSeqs[i],medoid);
+			free(rstr->treeArr[i]);
+			clock_gettime(CLOCK_MONOTONIC, &tend);
+			rstr->infer_time += elapsedSeconds(&tstart,&tend);
+			continue;
+		}
+		int kalign_threads = 1;
+		if (rstr->clusterSize[c] >= KALIGN_PARALLEL_MIN){
+			kalign_threads = rstr->huge_threads;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &tstart);
+		alignmentMatrix* seqArr = (alignmentMatrix *)malloc(sizeof(alignmentMatrix));
+		seqArr->number_of_seqs = rstr->clusterSize[c];
+		seqArr->cols = NULL;
+		if (kalign_threads > 1){
+			//the OpenMP team inherits this thread's affinity, so let it use every core
+			threadpool_unpin();
+		}
+		if (main_kalign(engine,rstr->clusterSize[c],clusters[c],rstr->cluster_seqs[c],&seqArr->cols,&rstr->numbase[i],kalign_threads) != 0){
+			fprintf(stderr,"Could not align cluster %d\n",c);
+			exit(1);
+		}
+		if (kalign_threads > 1){
+			threadpool_pin();
+		}
+		clock_gettime(CLOCK_MONOTONIC, &tend);
+		rstr->align_time += elapsedSeconds(&tstart,&tend);
+		clock_gettime(CLOCK_MONOTONIC, &tstart);
+		seqArr->numbase = rstr->numbase[i];
+		int numbase = rstr->numbase[i];
+		int* gapped = (int*)malloc(numbase*sizeof(int));
+		for(j=0; j<numbase; j++){
+			gapped[j]=0;
+		}
+		findGappedSites(gapped,numbase,rstr->clusterSize[c],seqArr);
+		//the likelihood only needs each distinct column once, weighted by how often it occurs
+		sitePatterns* sp = sitepatterns_new(seqArr);
+		free(seqArr->cols);
+		free(seqArr);
+		rootSeqs[i]=(char *)malloc((numbase+1)*(sizeof(char)));
+		for(j=0; j<numbase+1; j++){
+			rootSeqs[i][j]='\0';
+		}
+		if (rstr->root_method == ROOT_METHOD_ML || rstr->root_method == ROOT_METHOD_FIXED_ML){
+			if (rstr->root_method == ROOT_METHOD_FIXED_ML){
+				//the NJ lengths are used as they are, apart from the limits the optimizer would enforce
+				for(j=0; j<2*rstr->clusterSize[c]-1; j++){
+					if (j == rstr->rootArr[i]){
+						continue;
+					}
+					if (rstr->treeArr[i][j].bl < MINBL) rstr->treeArr[i][j].bl = MINBL;
+					if (rstr->treeArr[i][j].bl > MAXBL) rstr->treeArr[i][j].bl = MAXBL;
+				}
+			}
+			//printRootSeqs only reads the root, so no other node's posterior is kept
+			likecontext_bind(ctx,rstr->treeArr,i,rstr->rootArr[i],rstr->clusterSize[c],sp,POSTERIOR_ROOT);
+			if (rstr->root_method == ROOT_METHOD_ML){
+				estimatenucparameters(ctx);
+			}else{
+				setempiricalfrequencies(ctx);
+			}
+			getrootposterior_nc(ctx);
+			rstr->numbase[i]=buildRootSeq(rootSeqs,rstr->treeArr,numbase,rstr->rootArr[i],i,gapped,sp->siteToPattern);
+		}else{
+			int* states = (int *)malloc(sp->number_of_patterns*sizeof(int));
+			if (rstr->root_method == ROOT_METHOD_PARSIMONY){
+				flatTree* ft = flattree_new(rstr->treeArr,i,rstr->rootArr[i],2*rstr->clusterSize[c]-1);
+				parsimonyRootStates(states,sp,ft);
+				flattree_free(ft);
+			}else{
+				consensusRootStates(states,sp);
+			}
+			rstr->numbase[i]=buildRootSeqFromStates(rootSeqs,numbase,i,gapped,sp->siteToPattern,states);
+			free(states);
+		}
+		free(gapped);
+		sitepatterns_free(sp);
+		free(rstr->treeArr[i]);
+		clock_gettime(CLOCK_MONOTONIC, &tend);
+		rstr->infer_time += elapsedSeconds(&tstart,&tend);
+	}
+	rstr->pt_hits = ctx->pt_hits;
+	rstr->pt_misses = ctx->pt_misses;
+	rstr->cl_rebuilt = ctx->cl_rebuilt;
+	rstr->cl_reused = ctx->cl_reused;
+	likecontext_free(ctx);
+	free_kalign_engine(engine);
+	return NULL;
+}
+void reconstructRootsForClusters(node** treeArr, int number_of_clusters, int* clusterSize, char*** cluster_seqs, int* rootArr, int root_method, int* numbase, int threads){
+	//whole clusters are independent tasks handed out largest first; only clusters of
+	//KALIGN_PARALLEL_MIN or more sequences get more than one thread inside kalign
+	int i=0;
+	int k=0;
+	int tasks=0;
+	int huge=0;
+	clusterOrder* order = (clusterOrder *)malloc(number_of_clusters*sizeof(clusterOrder));
+	for(i=1; i<number_of_clusters; i++){
+		if (clusterSize[i] > 3){
+			order[tasks].size = clusterSize[i];
+			order[tasks].index = i;
+			tasks++;
+			if (clusterSize[i] >= KALIGN_PARALLEL_MIN){
+				huge++;
+			}
+		}
+	}
+	if (tasks == 0){
+		free(order);
+		return;
+	}
+	qsort(order,tasks,sizeof(clusterOrder),compare_cluster_order);
+	unsigned long pt_hits = 0;
+	unsigned long pt_misses = 0;
+	unsigned long cl_rebuilt = 0;
+	unsigned long cl_reused = 0;
+	double align_time = 0.0;
+	double infer_time = 0.0;
+	int next = 0;
+	pthread_mutex_t next_lock;
+	pthread_mutex_init(&next_lock,NULL);
+	//the huge clusters sort first and get a phase of their own, so their kalign teams
+	//split every core between them instead of competing with workers on small clusters
+	int phase;
+	for(phase=0; phase<2; phase++){
+		int phase_end = phase == 0 ? huge : tasks;
+		int workers = phase_end - next < threads ? phase_end - next : threads;
+		if (workers < 1){
+			continue;
+		}
+		int huge_threads = phase == 0 ? threads/workers : 1;
+		if (huge_threads < 1){
+			huge_threads = 1;
+		}
+		clusterReconStruct rstr[workers];
+		for(k=0; k<workers; k++){
+			rstr[k].treeArr = treeArr;
+			rstr[k].number_of_tasks = phase_end;
+			rstr[k].order = order;
+			rstr[k].clusterSize = clusterSize;
+			rstr[k].cluster_seqs = cluster_seqs;
+			rstr[k].rootArr = rootArr;
+			rstr[k].numbase = numbase;
+			rstr[k].root_method = root_method;
+			rstr[k].huge_threads = huge_threads;
+			rstr[k].next = &next;
+			rstr[k].lock = &next_lock;
+		}
+		threadpool_run(reconstructClusterRoots,rstr,sizeof(clusterReconStruct),workers);
+		for(k=0; k<workers; k++){
+			align_time += rstr[k].align_time;
+			infer_time += rstr[k].infer_time;
+			pt_hits += rstr[k].pt_hits;
+			pt_misses += rstr[k].pt_misses;
+			cl_rebuilt += rstr[k].cl_rebuilt;
+			cl_reused += rstr[k].cl_reused;
+		}
+		next = phase_end;
+	}
+	pthread_mutex_destroy(&next_lock);
+	free(order);
+	printf("Transition matrix cache: %lu hits, %lu misses\n",pt_hits,pt_misses);
+	printf("Partial likelihoods: %lu rebuilt, %lu reused\n",cl_rebuilt,cl_reused);
+	//summed over workers, so with several threads these exceed the wall time
+	printf("Root reconstruction (%s): %d clusters, %lf seconds aligning, %lf seconds inferring roots\n",rootMethodName(root_method),tasks,align_time,infer_time);
+}
 int main(int argc, char **argv){
 	Options opt;
 	opt.number_of_clusters = -1;
@@ -4172,6 +4761,11 @@ int main(int argc, char **argv){
 	opt.number_of_desc=10;
 	opt.numberOfLinesToRead=10000;
 	opt.average=-1.0;
+	opt.distance_cache_mb=DISTCACHE_DEFAULT_MB;
+	opt.tree_method=TREE_METHOD_NJ;
+	opt.root_method=ROOT_METHOD_ML;
+	opt.refresh_roots=0;
+	opt.max_msa_members=0;
 	strcpy(opt.output_directory,"");
 	memset(opt.output_file,'\0',2000);
 	memset(opt.root,'\0',1000);
@@ -4208,6 +4802,14 @@ int main(int argc, char **argv){
 	printf("Number of clusters: %d\n",fasta_specs[4]-1);
 	fclose(fasta_for_clustering);
 	printf("Number of threads: %d\n",opt.numthreads);
+	threadpool_start(opt.numthreads);
+	distanceCache = NULL;
+	if ( opt.distance_cache_mb > 0 ){
+		distanceCache = distcache_new((size_t)opt.distance_cache_mb);
+		if ( distanceCache != NULL ){
+			printf("Distance cache: %d entries (%d MB)\n",distanceCache->capacity,opt.distance_cache_mb);
+		}
+	}
 	int i,j;
 	//char** seqNames = (char **)malloc(fasta_specs[0]*sizeof(char *));
 	//char** sequences = (char **)malloc(fasta_specs[0]*sizeof(char *));
@@ -4240,9 +4842,14 @@ int main(int argc, char **argv){
 	clusters = (char***)malloc((fasta_specs[4]+1)*sizeof(char **));
 	//char*** cluster_seqs = (char***)malloc((fasta_specs[3]+1)*sizeof(char **));
 	char*** cluster_seqs = (char***)malloc((fasta_specs[4]+1)*sizeof(char **));
+	clusterIds = (int **)malloc((fasta_specs[4]+1)*sizeof(int *));
 	
 	for(i=0; i<fasta_specs[4]+1; i++){
 		clusters[i]=(char **)malloc(kseqs*sizeof(char *));
+		clusterIds[i]=(int *)malloc(kseqs*sizeof(int));
+		for(j=0; j<kseqs; j++){
+			clusterIds[i][j]=-1;
+		}
 		cluster_seqs[i]=(char **)malloc(kseqs*sizeof(char *));
 		for(j=0; j<kseqs; j++){
 			clusters[i][j]=(char *)malloc((fasta_specs[2]+1)*sizeof(char));
@@ -4282,6 +4889,7 @@ int main(int argc, char **argv){
 			//cluster_seqs[i][j]=(char *)malloc((fasta_specs[1]+1)*sizeof(char));
 			memset(cluster_seqs[i][j],'\0',fasta_specs[1]+1);
 			memset(clusters[i][j],'\0',fasta_specs[2]+1);
+			clusterIds[i][j]=-1;
 		}
 	}
 	}
@@ -4349,6 +4957,9 @@ int main(int argc, char **argv){
 	if (( fasta_for_clustering = fopen(opt.fasta,"r")) == (FILE *) NULL ) fprintf(stderr,"FASTA file could not be opened.\n");
 	saveChooseKSeq(fasta_for_clustering,chooseK,clusters,cluster_seqs,fasta_specs[1]+1,kseqs);
 	fclose(fasta_for_clustering);
+	for(i=0; i<kseqs; i++){
+		clusterIds[0][i]=chooseK[i];
+	}
 	//for(i=0; i<kseqs; i++){
 	//	strcpy(clusters[numberOfNodesToCut][i],seqNames[chooseK[i]]);
 	//	strcpy(cluster_seqs[numberOfNodesToCut][i],sequences[chooseK[i]]);
@@ -4375,7 +4986,7 @@ int main(int argc, char **argv){
 	printf("Creating distance matrix...\n");
 	clock_gettime(CLOCK_MONOTONIC, &tstart);
 	if ( opt.use_nw ==0 ){
-		createDistMat_WFA(cluster_seqs[0],distMat,kseqs,opt.numthreads);
+		createDistMat_WFA(cluster_seqs[0],clusterIds[0],distMat,kseqs,opt.numthreads);
 	}else{
 		createDistMat(cluster_seqs[0],distMat,kseqs,fasta_specs);
 	}
@@ -4424,14 +5035,14 @@ int main(int argc, char **argv){
 			tree[i][j].clusterNumber=0;
 		}
 	}
-	int root = NJ(tree,distMat,kseqs,0,0);
+	int root = buildGuideTree(tree,distMat,cluster_seqs[0],kseqs,0,0,opt.tree_method,opt.numthreads);
 	for(i=0; i<kseqs+1; i++){
 		free(distMat[i]);
 	}
 	free(distMat);
 	tree[0][root].bl=0;
-	get_number_descendants(tree,root,0);
-	assignDepth(tree,tree[0][root].up[0],tree[0][root].up[1],1,0);
+	get_number_descendants(tree,root,0,2*kseqs-1);
+	assignDepth(tree,tree[0][root].up[0],tree[0][root].up[1],1,0,2*kseqs-1);
 	//calculateTotalDistanceFromRoot(tree,root,0,0);
 	double* branchLengths = (double *)malloc((2*kseqs-1)*sizeof(double));
 	for(i=0; i<2*kseqs-1; i++){
@@ -4441,7 +5052,8 @@ int main(int argc, char **argv){
 	sortArray(branchLengths,indexArray,kseqs);
 	printf("Longest Branch: %lf node: %d\n",branchLengths[0],indexArray[0]);
 	free(branchLengths);
-	//numberOfNodesToCut = findMaxClade(tree,kseqs,distMatForAVG);
+	//kept up to date as cuts are chosen, so the average below needs no pass over every leaf pair
+	clusterDistTable* cutTable = clusterdist_new(opt.number_of_clusters,kseqs);
 	//if ( numberOfUnAssigned == fasta_specs[0] ){
 	for(i=0; i<2*kseqs-1; i++){
 		//if (tree[0][indexArray[i]].nd > 1 && numberOfNodesToCut < opt.number_of_clusters-1){
@@ -4457,6 +5069,9 @@ int main(int argc, char **argv){
 				numberOfNodesToCut--;
 				tree[0][indexArray[i]].nodeToCut=0;
 			}
+			if (tree[0][indexArray[i]].nodeToCut==1){
+				clusterdist_add_cut(cutTable,tree,distMatForAVG,indexArray[i],opt.numthreads);
+			}
 			//clearDescendants(tree,tree[0][indexArray[i]].up[0],0);
 			//clearDescendants(tree,tree[0][indexArray[i]].up[1],0);
 			//updateNumberOfDescendants(tree,indexArray[i],tree[0][indexArray[i]].nd,0);
@@ -4481,7 +5096,7 @@ int main(int argc, char **argv){
 						numberOfNodesToCut = tree[0][j].clusterNumber;
 					}
 				}
-				double thisTime = calculateAverageDistanceBetweenClusters(tree,kseqs,numberOfNodesToCut+2,distMatForAVG);
+				double thisTime = calculateAverageDistanceBetweenClusters(tree,kseqs,numberOfNodesToCut+2,distMatForAVG,opt.numthreads);
 				if ( thisTime <= lastTime ){
 					break;
 				}else{
@@ -4500,59 +5115,7 @@ int main(int argc, char **argv){
 	int how_many_cuts = numberOfNodesToCut;
 	printf("made %d cuts\n",numberOfNodesToCut);
 	free(indexArray);
-	//struct hashmap clusterhash;
-	//hashmap_init(&clusterhash, hashmap_hash_string, hashmap_compare_string, fasta_specs[0]);
-	int* parentcuts = (int *)malloc((2*kseqs-1)*sizeof(int));
-	for(i=0; i<2*kseqs-1; i++){
-		parentcuts[i]=-1;
-	}
-	//int** clusterarr = (int **)malloc(kseqs*sizeof(int *));
-	//for(i=0; i<kseqs; i++){
-	//	clusterarr[i] = (int *)malloc(kseqs*sizeof(int));
-	//	for(j=0; j<kseqs; j++){
-	//		clusterarr[i][j]=-1;
-	//	}
-	//}
-	findLeaves(tree,root,0,parentcuts,cluster_seqs,kseqs);
-	free(parentcuts);
-	//int* nodeArrays = (int *)malloc(100*sizeof(int));
-	//int key;
-	//hashmap_iter(&clusterhash);
-		//int i=0;
-		//for(i=0; i<100; i++){
-		//	printf("key %d: %d\n",key,nodeArrays[i]);
-		//}
-	//}
-	//int* firstNodeCut=(int *)malloc(1*sizeof(int));
-	//firstNodeCut[0]=-1;
-	//findFirstNodeCut(tree,root,0,firstNodeCut);
-	//printf("first node cut is %d\n",firstNodeCut[0]);
-	//if ( firstNodeCut[0] != -1){
-		//addFirstCluster(tree,root,firstNodeCut[0],0,parentcuts);
-	//}
-	//makeClustersFromNodeCuts(tree,root,0,1,kseqs);
-	int* foundPath = malloc(1*sizeof(int));
-	foundPath[0]=0;
-	int index;
-	for(i=1; i<fasta_specs[4]+1; i++){
-		if ( clusters[i][0][0] == '\0' ){
-			index=i;
-			break;
-		}
-	}
-	for(i=0; i<kseqs; i++){
-		foundPath[0]=0;
-		findPathToRoot(tree,i,0,foundPath);
-		//printf("found path node %d: %d\n",i,foundPath[0]);
-		if (foundPath[0]==0){
-			addFirstCluster(tree,i,0,parentcuts,kseqs-1,fasta_specs[4]+1,cluster_seqs,index);
-		}
-	}
-	//for(i=0; i<kseqs; i++){
-	//	free(clusterarr[i]);
-	//}
-	//free(clusterarr);
-	free(foundPath);
+	findLeaves(tree,root,0,cluster_seqs,kseqs,fasta_specs[4]);
 	//printtree(tree,0,kseqs);
 	//shiftColumns(kseqs);
 	//numberOfNodesToCut++;
@@ -4584,10 +5147,11 @@ int main(int argc, char **argv){
 	//}
 	double average_distance=0;
 	if ( numberOfNodesToCut > 2 && how_many_cuts > 1 ){
-		average_distance = calculateAverageDistanceBetweenClusters(tree,kseqs,numberOfNodesToCut,distMatForAVG);
+		average_distance = calculateAverageDistanceBetweenClusters(cutTable,tree,numberOfNodesToCut);
 	}else{
 		average_distance = 1;
 	}
+	clusterdist_free(cutTable);
 	printf("average is %lf\n",average_distance);
 	for(i=0; i<kseqs; i++){
 		free(distMatForAVG[i]);
@@ -4624,7 +5188,7 @@ int main(int argc, char **argv){
 	/*clock_gettime(CLOCK_MONOTONIC, &tstart);
 	printf("Calculating pairwise average...\n");
 	double average_distance = 0;
-	average_distance = calculateAverageDist_WFA(cluster_seqs,clusterSize,opt.numthreads,numberOfNodesToCut);
+	average_distance = calculateAverageDist_WFA(cluster_seqs,clusterIds,clusterSize,opt.numthreads,numberOfNodesToCut);
 	printf("Average distance: %lf\n",average_distance);*/
 	//printtree(tree,0,kseqs);
 	for(j=0; j<kseqs; j++){
@@ -4633,11 +5197,18 @@ int main(int argc, char **argv){
 	free(tree[0]);
 	free(tree);
 	int count=0;
+	//clusters over the cap build their tree, alignment and root from msaSize members
+	int* msaSize = (int *)malloc(numberOfNodesToCut*sizeof(int));
+	int** msaSwaps = (int **)malloc(numberOfNodesToCut*sizeof(int *));
+	int subsampled = subsampleClusters(numberOfNodesToCut,clusterSize,cluster_seqs,msaSize,msaSwaps,opt.max_msa_members,opt.numthreads);
+	if ( opt.max_msa_members > 0 ){
+		printf("MSA subsampling: %d clusters capped at %d members\n",subsampled,opt.max_msa_members);
+	}
 	treeArr = (node **)malloc((numberOfNodesToCut-1)*sizeof(node *));
 	for(i=0; i<numberOfNodesToCut-1; i++){
-		if (clusterSize[i+1] > 3){
-			treeArr[i]=malloc((2*clusterSize[i+1]-1)*sizeof(node));
-			for(j=0; j<clusterSize[i+1]; j++){
+		if (msaSize[i+1] > 3){
+			treeArr[i]=malloc((2*msaSize[i+1]-1)*sizeof(node));
+			for(j=0; j<msaSize[i+1]; j++){
 				treeArr[i][j].name = (char *)malloc((fasta_specs[2]+1)*sizeof(char));
 			//treeArr[i][j].likenc = malloc(FASTA_MAXLINE*sizeof(double *));
 			//treeArr[i][j].posteriornc = malloc(FASTA_MAXLINE*sizeof(double *));
@@ -4658,16 +5229,12 @@ int main(int argc, char **argv){
 		//}
 			}
 	}
-	for(i=0; i<4; i++){
-		PMATnc[0][i][4]=1.0;
-		PMATnc[0][i][4]=1.0;
-	}
 	//allocateMemForTreeArr(numberOfNodesToCut-1,clusterSize,treeArr,kseqs);
 	int* rootArr = (int *)malloc(numberOfNodesToCut*sizeof(int));
-	createTreesForClusters(treeArr,numberOfNodesToCut,clusterSize,cluster_seqs,rootArr,opt.numthreads);
+	createTreesForClusters(treeArr,numberOfNodesToCut,msaSize,cluster_seqs,rootArr,opt.root_method,opt.numthreads);
 	for(i=0; i<numberOfNodesToCut-1; i++){
-		if (clusterSize[i+1] > 3){
-			for(j=0; j<clusterSize[i+1]; j++){
+		if (msaSize[i+1] > 3){
+			for(j=0; j<msaSize[i+1]; j++){
 				free(treeArr[i][j].name);
 			}
 		}
@@ -4680,86 +5247,28 @@ int main(int argc, char **argv){
 	int k,l,m;
 	int *numbase = (int *)malloc((numberOfNodesToCut-1)*sizeof(int));
 	rootSeqs = (char **)malloc((numberOfNodesToCut-1)*(sizeof(char *)));
+	int first_time = 0;
+	if (numberOfUnAssigned == fasta_specs[0]){
+		first_time=1;
+	}
 	for(i=0; i<numberOfNodesToCut-1; i++){
-		//seqArr[i] = (int **)malloc(clusterSize[i+1]*sizeof(int *));
-		//for(j=0; j<clusterSize[i+1]; j++){
-		//	seqArr[i][j] = (int *)malloc((FASTA_MAXLINE)*sizeof(int));
-		//		for(k=0; k<(FASTA_MAXLINE); k++){
-		//			seqArr[i][j][k]=0;
-		//		}
-		//}
 		numbase[i] = 0;
-		int first_time = 0;
-		if (numberOfUnAssigned == fasta_specs[0] && i==0){
-			first_time=1;
-		}
-		if (clusterSize[i+1] > 3){
-			int** seqArr= (int **)malloc(clusterSize[i+1]*sizeof(int *));
-			//main_kalign(1,kalign_args,clusterSize[i+1],clusters[i+1],cluster_seqs[i+1],seqArr,numbase,i);
-			main_kalign(clusterSize[i+1],clusters[i+1],cluster_seqs[i+1],seqArr,numbase,i,opt.numthreads);
-			int* gapped = (int*)malloc(numbase[i]*sizeof(int));
-			for(j=0; j<numbase[i]; j++){
-				gapped[j]=0;
-			}
-			findGappedSites(gapped,numbase[i],clusterSize[i+1],seqArr);
-			for(j=0; j<2*clusterSize[i+1]-1; j++){
-				treeArr[i][j].likenc = malloc(numbase[i]*sizeof(double *));
-				treeArr[i][j].posteriornc = malloc(numbase[i]*sizeof(double *));
-				int n;
-				for(n=0; n<numbase[i]; n++){
-					treeArr[i][j].likenc[n] = malloc(4*sizeof(double));
-					treeArr[i][j].posteriornc[n] = malloc(4*sizeof(double));
-				}
-			}
-			estimatenucparameters(i,numbase[i],rootArr[i],clusterSize[i+1],seqArr);
-			getposterior_nc(i,numbase[i],rootArr[i],clusterSize[i+1],seqArr);
-			for(j=0; j<clusterSize[i+1]; j++){
-				free(seqArr[j]);
-			}
-			free(seqArr);
-			for(j=0; j<2*clusterSize[i+1]-1; j++){
-				if (j != rootArr[i]){
-					for(k=0; k<numbase[i]; k++){
-						free(treeArr[i][j].likenc[k]);
-						free(treeArr[i][j].posteriornc[k]);
-					}
-					free(treeArr[i][j].likenc);
-					free(treeArr[i][j].posteriornc);
-				}
-			}
-			rootSeqs[i]=(char *)malloc((numbase[i]+1)*(sizeof(char)));
-			for(j=0; j<numbase[i]+1; j++){
-				rootSeqs[i][j]='\0';
-			}
-			int new_numbase=printRootSeqs(rootSeqs,treeArr,numbase[i],rootArr[i],i,gapped,first_time,opt);
-			for(j=0; j<numbase[i]; j++){
-				free(treeArr[i][rootArr[i]].likenc[j]);
-				free(treeArr[i][rootArr[i]].posteriornc[j]);
-			}
-			free(treeArr[i][rootArr[i]].likenc);
-			free(treeArr[i][rootArr[i]].posteriornc);
-			free(treeArr[i]);
-			numbase[i] = new_numbase;
-		}else{
+		if (clusterSize[i+1] <= 3){
 			int random_number = generateRandom(clusterSize[i+1]-1);
 			//printf("random: %d clusterSize: %d\n",random_number,clusterSize[i+1]);
 			numbase[i] = strlen(cluster_seqs[i+1][random_number]);
 			rootSeqs[i]=(char *)malloc((numbase[i]+1)*(sizeof(char)));
 			strcpy(rootSeqs[i],cluster_seqs[i+1][random_number]);
-			if ( opt.root[0] != '\0' ){
-				FILE* root_sequences_file;
-				if ( first_time == 1 ){
-					if (( root_sequences_file = fopen(opt.root,"w")) == (FILE *) NULL ) fprintf(stderr,"FASTA file could not be opened.\n");
-				}
-				if ( first_time ==0 ){
-					if (( root_sequences_file = fopen(opt.root,"a")) == (FILE *) NULL ) fprintf(stderr,"FASTA file could not be opened.\n");
-				}
-				fprintf(root_sequences_file,">random%d\n",i);
-				fprintf(root_sequences_file,"%s\n",rootSeqs[i]);
-				fclose(root_sequences_file);
-			}
 		}
 	}
+	reconstructRootsForClusters(treeArr,numberOfNodesToCut,msaSize,cluster_seqs,rootArr,opt.root_method,numbase,opt.numthreads);
+	restoreClusterOrder(numberOfNodesToCut,cluster_seqs,msaSize,msaSwaps);
+	free(msaSize);
+	free(msaSwaps);
+	//refreshed roots are printed once this iteration's members have been assigned
+	if ( opt.root[0] != '\0' && numberOfNodesToCut > 1 && opt.refresh_roots == 0 ){
+		printRootSeqs(rootSeqs,numberOfNodesToCut-1,clusterSize,numbase,first_time,opt);
+	}
 	free(rootArr);
 	//free(kalign_args[0]);
 	//free(kalign_args[1]);
@@ -4954,7 +5463,19 @@ int main(int argc, char **argv){
 	//double average = calculateAvg[0]/calculateAvg[1];
 	//free(calculateAvg);
 	//printf("average pairwise: %lf\n",averageAvg);
-	if (numberOfUnAssigned == kseqs){ break;}
+	if ( distanceCache != NULL ){
+		unsigned long cache_hits, cache_misses, cache_evictions;
+		int cache_size;
+		distcache_stats(distanceCache,&cache_hits,&cache_misses,&cache_evictions,&cache_size);
+		printf("Distance cache: %lu hits, %lu misses, %lu evictions, %d entries\n",cache_hits,cache_misses,cache_evictions,cache_size);
+		distcache_reset_stats(distanceCache);
+	}
+	if (numberOfUnAssigned == kseqs){
+		if ( opt.root[0] != '\0' && numberOfNodesToCut > 1 && opt.refresh_roots == 1 ){
+			printRootSeqs(rootSeqs,numberOfNodesToCut-1,clusterSize,numbase,first_time,opt);
+		}
+		break;
+	}
 	clock_gettime(CLOCK_MONOTONIC, &tend);
 	printf("Took %lf seconds\n",((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) - ((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec));
 	if ( opt.numthreads > opt.numberOfLinesToRead/2 ){
@@ -4962,10 +5483,16 @@ int main(int argc, char **argv){
 	} else if ( opt.numthreads > numberOfUnAssigned ){
 		opt.numthreads = numberOfUnAssigned;
 	}
-	pthread_t threads[opt.numthreads];
 	mystruct mstr[opt.numthreads];
+	rootProfile* profile = NULL;
+	int refreshed_bases = 0;
+	if (opt.refresh_roots == 1){
+		//each root starts out counted once for every sequence it was reconstructed from
+		profile = rootprofile_new(rootSeqs,numberOfNodesToCut-1,&clusterSize[1]);
+	}
 	for(i=0; i<opt.numthreads; i++){
 		mstr[i].str = malloc(sizeof(struct resultsStruct));
+		mstr[i].profile = profile != NULL ? rootprofile_delta(profile) : NULL;
 		if (opt.average != -1.0){
 			mstr[i].average = opt.average;
 		}else{
@@ -5164,6 +5691,21 @@ int main(int argc, char **argv){
 			}
 			//j=j+numberToAssign;
 		}
+	//the threads' results for a chunk, merged back into read order before they are printed
+	int next_read=0;
+	int numMerged=0;
+	int numMergedSaved=0;
+	resultsStruct* mergedResults = (resultsStruct *)malloc(sizeof(resultsStruct));
+	mergedResults->index = (int *)malloc(numberToAssign*sizeof(int));
+	mergedResults->clusterNumber = (int *)malloc(numberToAssign*sizeof(int));
+	mergedResults->savedForNewClusters = (int *)malloc(numberToAssign*sizeof(int));
+	if (mergedResults->index == NULL || mergedResults->clusterNumber == NULL || mergedResults->savedForNewClusters == NULL){
+		fprintf(stderr,"Could not allocate assignment results\n");
+		exit(1);
+	}
+	mergedResults->number_of_clusters = mstr[0].str->number_of_clusters;
+	mystruct mergedMstr = mstr[0];
+	mergedMstr.str = mergedResults;
 	int iter=0;
 	int* skipped = malloc((fasta_specs[0])*sizeof(int));
 	for(i=0; i<fasta_specs[0]; i++){
@@ -5186,63 +5728,38 @@ int main(int argc, char **argv){
 		if ( i == numberToAssign ){
 			divideFile=i;
 		}
-		int endDivideFile = divideFile;
-		divideFile =divideFile/opt.numthreads;
-		j=0;
+		//every thread works through the whole chunk, claiming ASSIGN_GRAIN reads at a time
+		next_read=0;
 		for(i=0; i<opt.numthreads; i++){
-			start = j;
-			end=j+divideFile;
-			if (i==opt.numthreads-1){
-				end=endDivideFile;
-			}
 			mstr[i].skipped=skipped;
-			mstr[i].start=start;
-			mstr[i].end=end;
+			mstr[i].start=0;
+			mstr[i].end=divideFile;
 			mstr[i].iteration = iter;
-			for(k=0; k< end-start; k++){
-				mstr[i].str->clusterNumber[k]=-1;
-				mstr[i].str->index[k]=-1;
-				mstr[i].str->savedForNewClusters[k]=-1;
-			}
-			j=j+divideFile;
+			mstr[i].next_read = &next_read;
 		}
-		for(i=0; i<opt.numthreads; i++){
-			size_t default_stack_size;
-			pthread_attr_t stack_size_custom_attr;
-			pthread_attr_init(&stack_size_custom_attr);
-			pthread_attr_getstacksize(&stack_size_custom_attr,&default_stack_size);
-			if (default_stack_size < MIN_REQ_SSIZE){
-				pthread_attr_setstacksize(&stack_size_custom_attr,(size_t)MIN_REQ_SSIZE);
-			}
-			//pthread_create(&threads[i], NULL, runAssignToCluster, &mstr[i]);
-			pthread_create(&threads[i], &stack_size_custom_attr, runAssignToCluster, &mstr[i]);
+		threadpool_run(runAssignToCluster,mstr,sizeof(mystruct),opt.numthreads);
+		mergeAssignResults(mstr,opt.numthreads,mergedResults,&numMerged,&numMergedSaved);
+		if (opt.output_fasta==1){
+			printClusters(starting_number_of_clusters,mergedResults->number_of_clusters,opt,taxonomy,mergedMstr,numMerged,taxMap,opt.hasTaxFile,fasta_specs,numberToAssign);
 		}
-		for(i=0; i<opt.numthreads; i++){
-			pthread_join(threads[i], NULL);
+		if (opt.clstr_format==1){
+			saveCLSTR(starting_number_of_clusters,fasta_specs[0],mergedMstr,numMerged,clstr,clstr_lengths,fasta_specs[1],numberToAssign,fasta_specs);
 		}
-		for(i=0; i<opt.numthreads; i++){
-			if (opt.output_fasta==1){
-				printClusters(starting_number_of_clusters,mstr[i].str->number_of_clusters,opt,taxonomy,mstr[i],mstr[i].numAssigned,taxMap,opt.hasTaxFile,fasta_specs,numberToAssign);
-			}
-			if (opt.clstr_format==1){
-				saveCLSTR(starting_number_of_clusters,fasta_specs[0],mstr[i],mstr[i].numAssigned,clstr,clstr_lengths,fasta_specs[1],numberToAssign,fasta_specs);
-			}
-			for( l=0; l<mstr[i].str->numunassigned; l++){
-				if (mstr[i].str->savedForNewClusters[l]==-1){ break; }
-				int place=-1;
-				for( j=fasta_specs[0]-kseqs-1; j>=0; j--){
-					if (sequencesToClusterLater[j] == -1){
-						place=j;
-					}
+		for( l=0; l<numMergedSaved; l++){
+			int place=-1;
+			for( j=fasta_specs[0]-kseqs-1; j>=0; j--){
+				if (sequencesToClusterLater[j] == -1){
+					place=j;
 				}
-				sequencesToClusterLater[place]=mstr[i].str->savedForNewClusters[l];
 			}
-			//for( j=0; j<numberToAssign/opt.numthreads; j++){
-			//	mstr[i].str->clusterNumber[j]=-1;
-			//	mstr[i].str->index[j]=-1;
-			//	mstr[i].str->savedForNewClusters[j]=-1;
-			//}
-
+			sequencesToClusterLater[place]=mergedResults->savedForNewClusters[l];
+		}
+		if (profile != NULL){
+			//roots only change between chunks, while no thread is reading them
+			for(i=0; i<opt.numthreads; i++){
+				rootprofile_merge(profile,mstr[i].profile);
+			}
+			refreshed_bases += rootprofile_refresh(profile,rootSeqs);
 		}
 		for(i=0; i<numberToAssign; i++){
 			memset(readsStruct->sequence[i],'\0',fasta_specs[1]+1);
@@ -5258,6 +5775,20 @@ int main(int argc, char **argv){
 	if ( opt.hasTaxFile==1){
 		fclose(taxonomy_file);
 	}
+	free(mergedResults->index);
+	free(mergedResults->clusterNumber);
+	free(mergedResults->savedForNewClusters);
+	free(mergedResults);
+	if (profile != NULL){
+		printf("Root refresh: %d bases changed\n",refreshed_bases);
+		if ( opt.root[0] != '\0' && numberOfNodesToCut > 1 ){
+			printRootSeqs(rootSeqs,numberOfNodesToCut-1,clusterSize,numbase,first_time,opt);
+		}
+		for(i=0; i<opt.numthreads; i++){
+			rootprofile_free(mstr[i].profile);
+		}
+		rootprofile_free(profile);
+	}
 	for(l=0; l<fasta_specs[0]; l++){
 		assignedSeqs[l] = 1;
 	}
@@ -5451,10 +5982,16 @@ int main(int argc, char **argv){
 		//freeMemForAlign(DATA,fasta_specs[1],mult);
 	//freeMemForDistMat(clusterSize,largest_cluster,distMat2);
 	freeClusters(fasta_specs[4]+1,kseqs,cluster_seqs);
+	for(i=0; i<fasta_specs[4]+1; i++){
+		free(clusterIds[i]);
+	}
+	free(clusterIds);
+	distcache_free(distanceCache);
 	if (opt.hasTaxFile==1){
 		freeSequences(fasta_specs[0],taxonomy);
 	}
 	free(fasta_specs);
 	free(chooseK);
+	threadpool_stop();
 	//hashmap_destroy(&map);
 }
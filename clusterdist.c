@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "clusterdist.h"
+#include "threadpool.h"
+
+clusterDistTable* clusterdist_new(int number_of_slots, int number_of_leaves){
+	int i;
+	clusterDistTable* table = (clusterDistTable *)malloc(sizeof(clusterDistTable));
+	if (table == NULL){
+		fprintf(stderr,"Could not allocate cluster distance table\n");
+		exit(1);
+	}
+	if (number_of_slots < 1){
+		number_of_slots = 1;
+	}
+	table->number_of_slots = number_of_slots;
+	table->number_of_leaves = number_of_leaves;
+	table->number_of_nodes = number_of_leaves > 0 ? 2*number_of_leaves-1 : 0;
+	table->sum = (double *)calloc((size_t)number_of_slots*number_of_slots,sizeof(double));
+	table->count = (long *)calloc((size_t)number_of_slots*number_of_slots,sizeof(long));
+	table->slotOfLeaf = (int *)calloc(number_of_leaves+1,sizeof(int));
+	table->slotOfNode = (int *)malloc((table->number_of_nodes+1)*sizeof(int));
+	table->freeSlots = (int *)malloc(number_of_slots*sizeof(int));
+	table->moving = (char *)calloc(number_of_leaves+1,sizeof(char));
+	table->stack = (int *)malloc((table->number_of_nodes+1)*sizeof(int));
+	if (table->sum == NULL || table->count == NULL || table->slotOfLeaf == NULL || table->slotOfNode == NULL || table->freeSlots == NULL || table->moving == NULL || table->stack == NULL){
+		fprintf(stderr,"Could not allocate cluster distance table\n");
+		exit(1);
+	}
+	for(i=0; i<table->number_of_nodes; i++){
+		table->slotOfNode[i] = -1;
+	}
+	//slot 0 is never handed out; the others are taken lowest first
+	table->number_free = 0;
+	for(i=number_of_slots-1; i>0; i--){
+		table->freeSlots[table->number_free] = i;
+		table->number_free++;
+	}
+	return table;
+}
+void clusterdist_free(clusterDistTable* table){
+	if (table == NULL){
+		return;
+	}
+	free(table->sum);
+	free(table->count);
+	free(table->slotOfLeaf);
+	free(table->slotOfNode);
+	free(table->freeSlots);
+	free(table->moving);
+	free(table->stack);
+	free(table);
+}
+void *fillClusterDistRows(void *ptr){
+	//distances from an interleaved share of the moving leaves to every leaf that stays, per slot
+	struct clusterDistStruct *cstr = (clusterDistStruct *) ptr;
+	clusterDistTable* table = cstr->table;
+	int r,k,l,q;
+	for(r=cstr->thread; r<cstr->number_of_rows; r=r+cstr->threads){
+		k = cstr->rows[r];
+		for(l=0; l<table->number_of_leaves; l++){
+			if (table->moving[l]){
+				continue;
+			}
+			q = table->slotOfLeaf[l];
+			cstr->to[q] = cstr->to[q] + cstr->distMat[l][k];
+			cstr->from[q] = cstr->from[q] + cstr->distMat[k][l];
+			cstr->n[q]++;
+		}
+	}
+	return NULL;
+}
+//moves the leaves marked in table->moving (listed in rows) from slot old to slot new
+static void move_leaves(clusterDistTable* table, double** distMat, int* rows, int number_of_rows, int old, int new, int threads){
+	int i,k,q;
+	int S = table->number_of_slots;
+	if (threads < 1){
+		threads = 1;
+	}
+	if (threads > number_of_rows){
+		threads = number_of_rows > 0 ? number_of_rows : 1;
+	}
+	double* to = (double *)calloc((size_t)threads*S,sizeof(double));
+	double* from = (double *)calloc((size_t)threads*S,sizeof(double));
+	long* n = (long *)calloc((size_t)threads*S,sizeof(long));
+	if (to == NULL || from == NULL || n == NULL){
+		fprintf(stderr,"Could not allocate cluster distance table\n");
+		exit(1);
+	}
+	clusterDistStruct cstr[threads];
+	for(k=0; k<threads; k++){
+		cstr[k].distMat = distMat;
+		cstr[k].table = table;
+		cstr[k].rows = rows;
+		cstr[k].number_of_rows = number_of_rows;
+		cstr[k].thread = k;
+		cstr[k].threads = threads;
+		cstr[k].to = to+(size_t)k*S;
+		cstr[k].from = from+(size_t)k*S;
+		cstr[k].n = n+(size_t)k*S;
+	}
+	threadpool_run(fillClusterDistRows,cstr,sizeof(clusterDistStruct),threads);
+	//merged in thread order; pairs inside one slot are never counted
+	for(k=1; k<threads; k++){
+		for(q=0; q<S; q++){
+			to[q] = to[q] + cstr[k].to[q];
+			from[q] = from[q] + cstr[k].from[q];
+			n[q] = n[q] + cstr[k].n[q];
+		}
+	}
+	for(q=0; q<S; q++){
+		if (n[q] == 0){
+			continue;
+		}
+		if (q != old){
+			table->sum[old*S+q] = table->sum[old*S+q] - to[q];
+			table->sum[q*S+old] = table->sum[q*S+old] - from[q];
+			table->count[old*S+q] = table->count[old*S+q] - n[q];
+			table->count[q*S+old] = table->count[q*S+old] - n[q];
+		}
+		if (q != new){
+			table->sum[new*S+q] = table->sum[new*S+q] + to[q];
+			table->sum[q*S+new] = table->sum[q*S+new] + from[q];
+			table->count[new*S+q] = table->count[new*S+q] + n[q];
+			table->count[q*S+new] = table->count[q*S+new] + n[q];
+		}
+	}
+	for(i=0; i<number_of_rows; i++){
+		table->slotOfLeaf[rows[i]] = new;
+		table->moving[rows[i]] = 0;
+	}
+	free(to);
+	free(from);
+	free(n);
+}
+//slot of the nearest cut strictly above node, 0 if there is none
+static int enclosing_slot(clusterDistTable* table, node** tree, int node){
+	node = tree[0][node].down;
+	while (node != -1){
+		if (table->slotOfNode[node] != -1){
+			return table->slotOfNode[node];
+		}
+		node = tree[0][node].down;
+	}
+	return 0;
+}
+int clusterdist_add_cut(clusterDistTable* table, node** tree, double** distMat, int node, int threads){
+	//the root never counts as a cut, as in findLeaves
+	if (tree[0][node].down == -1 || table->slotOfNode[node] != -1){
+		return 0;
+	}
+	if (table->number_free == 0){
+		fprintf(stderr,"Cluster distance table has no slot left for another cut\n");
+		exit(1);
+	}
+	table->number_free--;
+	int slot = table->freeSlots[table->number_free];
+	int old = enclosing_slot(table,tree,node);
+	table->slotOfNode[node] = slot;
+	//the leaves below node that no deeper cut claims
+	int* rows = (int *)malloc((table->number_of_leaves+1)*sizeof(int));
+	int number_of_rows = 0;
+	int top = 0;
+	table->stack[top++] = node;
+	while (top > 0){
+		int current = table->stack[--top];
+		if (current != node && table->slotOfNode[current] != -1){
+			continue;
+		}
+		if (tree[0][current].up[0] == -1 && tree[0][current].up[1] == -1){
+			table->moving[current] = 1;
+			rows[number_of_rows] = current;
+			number_of_rows++;
+		}else{
+			table->stack[top++] = tree[0][current].up[1];
+			table->stack[top++] = tree[0][current].up[0];
+		}
+	}
+	move_leaves(table,distMat,rows,number_of_rows,old,slot,threads);
+	free(rows);
+	return 1;
+}
+void clusterdist_remove_cut(clusterDistTable* table, node** tree, double** distMat, int node, int threads){
+	int l;
+	int slot = table->slotOfNode[node];
+	if (slot == -1){
+		return;
+	}
+	int* rows = (int *)malloc((table->number_of_leaves+1)*sizeof(int));
+	int number_of_rows = 0;
+	for(l=0; l<table->number_of_leaves; l++){
+		if (table->slotOfLeaf[l] == slot){
+			table->moving[l] = 1;
+			rows[number_of_rows] = l;
+			number_of_rows++;
+		}
+	}
+	table->slotOfNode[node] = -1;
+	move_leaves(table,distMat,rows,number_of_rows,slot,enclosing_slot(table,tree,node),threads);
+	free(rows);
+	//the emptied slot is cleared exactly rather than left with rounding residue
+	int S = table->number_of_slots;
+	for(l=0; l<S; l++){
+		table->sum[slot*S+l] = table->sum[l*S+slot] = 0;
+		table->count[slot*S+l] = table->count[l*S+slot] = 0;
+	}
+	table->freeSlots[table->number_free] = slot;
+	table->number_free++;
+}
+//mean over the cluster pairs first <= a < b <= last of the mean distance between a and b,
+//with the cluster numbers findLeaves gave tree[0]'s leaves mapped back to their slots
+double clusterdist_average(clusterDistTable* table, node** tree, int first, int last){
+	int a,b,l;
+	int m=0;
+	int S = table->number_of_slots;
+	double avg=0;
+	if (last < first){
+		return avg/m;
+	}
+	int* slotOfCluster = (int *)malloc((last+1)*sizeof(int));
+	for(a=0; a<=last; a++){
+		slotOfCluster[a] = -1;
+	}
+	for(l=0; l<table->number_of_leaves; l++){
+		if (tree[0][l].clusterNumber >= first && tree[0][l].clusterNumber <= last){
+			slotOfCluster[tree[0][l].clusterNumber] = table->slotOfLeaf[l];
+		}
+	}
+	for(a=first; a<=last; a++){
+		for(b=a+1; b<=last; b++){
+			if (slotOfCluster[a] == -1 || slotOfCluster[b] == -1){
+				continue;
+			}
+			avg = avg + table->sum[slotOfCluster[a]*S+slotOfCluster[b]]/table->count[slotOfCluster[a]*S+slotOfCluster[b]];
+			m++;
+		}
+	}
+	free(slotOfCluster);
+	return avg/m;
+}
@@ -0,0 +1,50 @@
+#ifndef _CLUSTERDIST_H
+#define _CLUSTERDIST_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "global.h"
+
+/*
+ * Sum and count of leaf-to-leaf distances for every pair of clusters in
+ * tree[0], kept per slot rather than per cluster number.  Slot 0 holds the
+ * leaves under no cut and every cut takes a slot of its own when it is
+ * added, which it keeps however findLeaves numbers the clusters afterwards.
+ * Entry (s,t) holds distMat[l][k] summed over k in slot s and l in slot t,
+ * so both directions of the matrix are at hand.  Adding or removing a cut
+ * only revisits the rows of the leaves that change slot.
+ */
+typedef struct clusterDistTable{
+	int number_of_slots;
+	int number_of_leaves;
+	int number_of_nodes;
+	double* sum;
+	long* count;
+	int* slotOfLeaf;
+	int* slotOfNode; /*-1 unless the node is a cut*/
+	int* freeSlots;
+	int number_free;
+	char* moving;
+	int* stack;
+}clusterDistTable;
+
+typedef struct clusterDistStruct{
+	double** distMat;
+	clusterDistTable* table;
+	int* rows;
+	int number_of_rows;
+	int thread;
+	int threads;
+	double* to;
+	double* from;
+	long* n;
+}clusterDistStruct;
+
+clusterDistTable* clusterdist_new(int number_of_slots, int number_of_leaves);
+void clusterdist_free(clusterDistTable* table);
+int clusterdist_add_cut(clusterDistTable* table, node** tree, double** distMat, int node, int threads);
+void clusterdist_remove_cut(clusterDistTable* table, node** tree, double** distMat, int node, int threads);
+double clusterdist_average(clusterDistTable* table, node** tree, int first, int last);
+
+#endif /* _CLUSTERDIST_H */
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <string.h>
+#include "distcache.h"
+
+//ordered: the ends-free alignment behind a distance depends on which sequence is the pattern
+static uint64_t distcache_key(int idA, int idB){
+	return ((uint64_t)(uint32_t)idA << 32) | (uint32_t)idB;
+}
+static uint64_t distcache_hash(uint64_t key){
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return key;
+}
+distCache* distcache_new(size_t memory_mb){
+	int i,j;
+	size_t per_entry = sizeof(distCacheEntry) + sizeof(int);
+	size_t total = (memory_mb*1024*1024)/per_entry;
+	int capacity = (int)(total/DISTCACHE_STRIPES);
+	if (capacity < 1){
+		return NULL;
+	}
+	distCache* cache = (distCache *)malloc(sizeof(distCache));
+	if (cache == NULL){
+		fprintf(stderr,"Could not allocate distance cache\n");
+		exit(1);
+	}
+	cache->capacity = capacity*DISTCACHE_STRIPES;
+	for(i=0; i<DISTCACHE_STRIPES; i++){
+		distCacheStripe* stripe = &cache->stripes[i];
+		pthread_mutex_init(&stripe->lock,NULL);
+		stripe->capacity = capacity;
+		stripe->number_of_buckets = capacity;
+		stripe->size = 0;
+		stripe->hand = 0;
+		stripe->hits = 0;
+		stripe->misses = 0;
+		stripe->evictions = 0;
+		stripe->buckets = (int *)malloc(stripe->number_of_buckets*sizeof(int));
+		stripe->entries = (distCacheEntry *)malloc(capacity*sizeof(distCacheEntry));
+		if (stripe->buckets == NULL || stripe->entries == NULL){
+			fprintf(stderr,"Could not allocate distance cache\n");
+			exit(1);
+		}
+		for(j=0; j<stripe->number_of_buckets; j++){
+			stripe->buckets[j] = -1;
+		}
+		memset(stripe->entries,0,capacity*sizeof(distCacheEntry));
+	}
+	return cache;
+}
+void distcache_free(distCache* cache){
+	int i;
+	if (cache == NULL){
+		return;
+	}
+	for(i=0; i<DISTCACHE_STRIPES; i++){
+		pthread_mutex_destroy(&cache->stripes[i].lock);
+		free(cache->stripes[i].buckets);
+		free(cache->stripes[i].entries);
+	}
+	free(cache);
+}
+int distcache_get(distCache* cache, int idA, int idB, double* distance){
+	if (cache == NULL || idA < 0 || idB < 0){
+		return 0;
+	}
+	uint64_t key = distcache_key(idA,idB);
+	uint64_t hash = distcache_hash(key);
+	distCacheStripe* stripe = &cache->stripes[hash % DISTCACHE_STRIPES];
+	int bucket = (int)((hash / DISTCACHE_STRIPES) % stripe->number_of_buckets);
+	int found = 0;
+	pthread_mutex_lock(&stripe->lock);
+	int e = stripe->buckets[bucket];
+	while (e != -1){
+		if (stripe->entries[e].key == key){
+			stripe->entries[e].referenced = 1;
+			distance[0] = stripe->entries[e].distance;
+			found = 1;
+			break;
+		}
+		e = stripe->entries[e].next;
+	}
+	if (found == 1){
+		stripe->hits++;
+	}else{
+		stripe->misses++;
+	}
+	pthread_mutex_unlock(&stripe->lock);
+	return found;
+}
+//unlinks entry e from the chain it hangs off of
+static void distcache_unlink(distCacheStripe* stripe, int e){
+	uint64_t hash = distcache_hash(stripe->entries[e].key);
+	int bucket = (int)((hash / DISTCACHE_STRIPES) % stripe->number_of_buckets);
+	int prev = -1;
+	int cur = stripe->buckets[bucket];
+	while (cur != -1 && cur != e){
+		prev = cur;
+		cur = stripe->entries[cur].next;
+	}
+	if (cur == -1){
+		return;
+	}
+	if (prev == -1){
+		stripe->buckets[bucket] = stripe->entries[e].next;
+	}else{
+		stripe->entries[prev].next = stripe->entries[e].next;
+	}
+}
+void distcache_put(distCache* cache, int idA, int idB, double distance){
+	if (cache == NULL || idA < 0 || idB < 0){
+		return;
+	}
+	uint64_t key = distcache_key(idA,idB);
+	uint64_t hash = distcache_hash(key);
+	distCacheStripe* stripe = &cache->stripes[hash % DISTCACHE_STRIPES];
+	int bucket = (int)((hash / DISTCACHE_STRIPES) % stripe->number_of_buckets);
+	int slot;
+	pthread_mutex_lock(&stripe->lock);
+	int e = stripe->buckets[bucket];
+	while (e != -1){
+		if (stripe->entries[e].key == key){
+			stripe->entries[e].distance = distance;
+			stripe->entries[e].referenced = 1;
+			pthread_mutex_unlock(&stripe->lock);
+			return;
+		}
+		e = stripe->entries[e].next;
+	}
+	if (stripe->size < stripe->capacity){
+		slot = stripe->size;
+		stripe->size++;
+	}else{
+		//clock eviction: give every referenced entry a second chance
+		while (stripe->entries[stripe->hand].referenced == 1){
+			stripe->entries[stripe->hand].referenced = 0;
+			stripe->hand = (stripe->hand + 1) % stripe->capacity;
+		}
+		slot = stripe->hand;
+		stripe->hand = (stripe->hand + 1) % stripe->capacity;
+		distcache_unlink(stripe,slot);
+		stripe->evictions++;
+	}
+	stripe->entries[slot].key = key;
+	stripe->entries[slot].distance = distance;
+	stripe->entries[slot].referenced = 0;
+	stripe->entries[slot].next = stripe->buckets[bucket];
+	stripe->buckets[bucket] = slot;
+	pthread_mutex_unlock(&stripe->lock);
+}
+void distcache_stats(distCache* cache, unsigned long* hits, unsigned long* misses, unsigned long* evictions, int* size){
+	int i;
+	hits[0] = 0;
+	misses[0] = 0;
+	evictions[0] = 0;
+	size[0] = 0;
+	if (cache == NULL){
+		return;
+	}
+	for(i=0; i<DISTCACHE_STRIPES; i++){
+		pthread_mutex_lock(&cache->stripes[i].lock);
+		hits[0] = hits[0] + cache->stripes[i].hits;
+		misses[0] = misses[0] + cache->stripes[i].misses;
+		evictions[0] = evictions[0] + cache->stripes[i].evictions;
+		size[0] = size[0] + cache->stripes[i].size;
+		pthread_mutex_unlock(&cache->stripes[i].lock);
+	}
+}
+void distcache_reset_stats(distCache* cache){
+	int i;
+	if (cache == NULL){
+		return;
+	}
+	for(i=0; i<DISTCACHE_STRIPES; i++){
+		pthread_mutex_lock(&cache->stripes[i].lock);
+		cache->stripes[i].hits = 0;
+		cache->stripes[i].misses = 0;
+		cache->stripes[i].evictions = 0;
+		pthread_mutex_unlock(&cache->stripes[i].lock);
+	}
+}
@@ -0,0 +1,52 @@
+#ifndef _DISTCACHE_H
+#define _DISTCACHE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define DISTCACHE_STRIPES 64
+#define DISTCACHE_DEFAULT_MB 256
+
+/*
+ * Pairwise distance cache shared by all threads.  Entries are keyed by the
+ * ordered pair of sequence indices (position in the input FASTA): idA is the
+ * pattern and idB the text of the alignment.  The ends-free WFA distance is
+ * not symmetric, so (a,b) and (b,a) are separate entries.  Each stripe is an
+ * independent chained hash table with its own lock, fixed entry pool and
+ * clock hand, so the cache never grows past the memory budget given to
+ * distcache_new.
+ */
+typedef struct distCacheEntry{
+	uint64_t key;
+	double distance;
+	int next;
+	unsigned char referenced;
+}distCacheEntry;
+
+typedef struct distCacheStripe{
+	pthread_mutex_t lock;
+	int* buckets;
+	distCacheEntry* entries;
+	int number_of_buckets;
+	int capacity;
+	int size;
+	int hand;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+}distCacheStripe;
+
+typedef struct distCache{
+	distCacheStripe stripes[DISTCACHE_STRIPES];
+	int capacity;
+}distCache;
+
+distCache* distcache_new(size_t memory_mb);
+void distcache_free(distCache* cache);
+int distcache_get(distCache* cache, int idA, int idB, double* distance);
+void distcache_put(distCache* cache, int idA, int idB, double distance);
+void distcache_stats(distCache* cache, unsigned long* hits, unsigned long* misses, unsigned long* evictions, int* size);
+void distcache_reset_stats(distCache* cache);
+
+#endif /* _DISTCACHE_H */
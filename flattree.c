@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flattree.h"
+
+//preorder of the subtree under root, first child before second. Returns the number of nodes written to order.
+int flattree_preorder(node** tree, int whichTree, int root, int number_of_nodes, int* order){
+	int node, top, count=0;
+	int* stack = (int *)malloc((number_of_nodes+1)*sizeof(int));
+	if (stack == NULL){
+		fprintf(stderr,"Could not allocate traversal stack\n");
+		exit(1);
+	}
+	top=0;
+	stack[0]=root;
+	while(top >= 0){
+		node = stack[top];
+		top--;
+		order[count]=node;
+		count++;
+		if (tree[whichTree][node].up[0] != -1){
+			stack[++top] = tree[whichTree][node].up[1];
+			stack[++top] = tree[whichTree][node].up[0];
+		}
+	}
+	free(stack);
+	return count;
+}
+//postorder of the subtree under root, first child before second. Built as the reverse of a second-child-first preorder.
+int flattree_postorder(node** tree, int whichTree, int root, int number_of_nodes, int* order){
+	int i, node, top, tmp, count=0;
+	int* stack = (int *)malloc((number_of_nodes+1)*sizeof(int));
+	if (stack == NULL){
+		fprintf(stderr,"Could not allocate traversal stack\n");
+		exit(1);
+	}
+	top=0;
+	stack[0]=root;
+	while(top >= 0){
+		node = stack[top];
+		top--;
+		order[count]=node;
+		count++;
+		if (tree[whichTree][node].up[0] != -1){
+			stack[++top] = tree[whichTree][node].up[0];
+			stack[++top] = tree[whichTree][node].up[1];
+		}
+	}
+	free(stack);
+	for(i=0; i<count/2; i++){
+		tmp = order[i];
+		order[i] = order[count-1-i];
+		order[count-1-i] = tmp;
+	}
+	return count;
+}
+flatTree* flattree_new(node** tree, int whichTree, int root, int number_of_nodes){
+	int i;
+	flatTree* ft = (flatTree *)malloc(sizeof(flatTree));
+	if (ft == NULL){
+		fprintf(stderr,"Could not allocate flat tree\n");
+		exit(1);
+	}
+	ft->number_of_nodes = number_of_nodes;
+	ft->root = root;
+	ft->parent = (int *)malloc(number_of_nodes*sizeof(int));
+	ft->child0 = (int *)malloc(number_of_nodes*sizeof(int));
+	ft->child1 = (int *)malloc(number_of_nodes*sizeof(int));
+	ft->seqId = (int *)malloc(number_of_nodes*sizeof(int));
+	ft->bl = (double *)malloc(number_of_nodes*sizeof(double));
+	ft->postorder = (int *)malloc(number_of_nodes*sizeof(int));
+	if (ft->parent == NULL || ft->child0 == NULL || ft->child1 == NULL || ft->seqId == NULL || ft->bl == NULL || ft->postorder == NULL){
+		fprintf(stderr,"Could not allocate flat tree\n");
+		exit(1);
+	}
+	for(i=0; i<number_of_nodes; i++){
+		ft->parent[i] = tree[whichTree][i].down;
+		ft->child0[i] = tree[whichTree][i].up[0];
+		ft->child1[i] = tree[whichTree][i].up[1];
+		ft->bl[i] = tree[whichTree][i].bl;
+		//leaves are numbered by their row in the cluster's sequence array
+		ft->seqId[i] = tree[whichTree][i].up[0] == -1 ? i : -1;
+	}
+	ft->number_in_postorder = flattree_postorder(tree,whichTree,root,number_of_nodes,ft->postorder);
+	return ft;
+}
+//refresh the branch lengths of a snapshot whose topology is still current
+void flattree_update_bl(flatTree* ft, node** tree, int whichTree){
+	int i;
+	for(i=0; i<ft->number_of_nodes; i++){
+		ft->bl[i] = tree[whichTree][i].bl;
+	}
+}
+void flattree_free(flatTree* ft){
+	if (ft == NULL){
+		return;
+	}
+	free(ft->parent);
+	free(ft->child0);
+	free(ft->child1);
+	free(ft->seqId);
+	free(ft->bl);
+	free(ft->postorder);
+	free(ft);
+}
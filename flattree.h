@@ -0,0 +1,34 @@
+#ifndef _FLATTREE_H
+#define _FLATTREE_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "global.h"
+
+/*
+ * Structure-of-arrays snapshot of one tree in a node array.  Topology and
+ * branch lengths live in flat int/double arrays indexed by node number,
+ * leaves carry the index of their sequence instead of a name, and the
+ * postorder (children before parents, first child before second) is
+ * computed once without recursion so traversals over very deep trees
+ * neither touch the node structs nor depend on the thread stack size.
+ */
+typedef struct flatTree{
+	int number_of_nodes;
+	int root;
+	int number_in_postorder;
+	int* parent;
+	int* child0;
+	int* child1;
+	int* seqId;
+	double* bl;
+	int* postorder;
+}flatTree;
+
+flatTree* flattree_new(node** tree, int whichTree, int root, int number_of_nodes);
+void flattree_free(flatTree* ft);
+void flattree_update_bl(flatTree* ft, node** tree, int whichTree);
+int flattree_postorder(node** tree, int whichTree, int root, int number_of_nodes, int* order);
+int flattree_preorder(node** tree, int whichTree, int root, int number_of_nodes, int* order);
+
+#endif /* _FLATTREE_H */
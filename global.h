@@ -3,8 +3,11 @@
  */
 #include "needleman_wunsch.h"
 #include "hashmap.h"
+#include "distcache.h"
 #ifndef _GLOBAL_
 #define _GLOBAL_
+#include <stdint.h>
+#include "likekernels.h"
 
 #define FASTA_MAXLINE 600000
 #define MAXNAME 30
@@ -21,8 +24,27 @@
 #define STATESPACE 20 /*number of categories in approximation of gamma distribution for Ne. Must be at least 4 because some of the memory is used for the nucleotide model*/
 #define NUMCAT 1/*number of categories in the discretization of the gamma for the nucleotide substituion model*/
 #define MAXNUMBEROFINDINSPECIES 500 /*maximum number of individuals belonging to a species*/
-#define type_of_PP double
+#define type_of_PP like_t
+#define TREE_METHOD_NJ 0
+#define TREE_METHOD_UPGMA 1
+#define TREE_METHOD_KMEANS 2
+#define ROOT_METHOD_ML 0 /*optimized model and branch lengths, posterior at the root*/
+#define ROOT_METHOD_FIXED_ML 1 /*NJ branch lengths under F81, no optimization*/
+#define ROOT_METHOD_PARSIMONY 2 /*Fitch state set at the root*/
+#define ROOT_METHOD_CONSENSUS 3 /*majority base of each alignment column*/
+#define ROOT_METHOD_MEDOID 4 /*member closest to all others*/
+#define KALIGN_PARALLEL_MIN 500 /*clusters smaller than this are aligned on a single thread*/
+#define ASSIGN_GRAIN 8 /*reads an assignment thread claims at a time*/
 //#define MIN_REQ_SSIZE 83886080
+/* aligned cluster from kalign, one contiguous column-major block: the base of
+   sequence seq at site is cols[site*number_of_seqs+seq], 0-3 = A,C,G,T and
+   4 = gap/unknown */
+typedef struct alignmentMatrix{
+	int number_of_seqs;
+	int numbase;
+	uint8_t* cols;
+}alignmentMatrix;
+#define ALN_BASE(aln,seq,site) ((aln)->cols[(size_t)(site)*(aln)->number_of_seqs+(seq)])
 typedef struct node{
 	int down;
 	int up[2];
@@ -33,8 +55,8 @@ typedef struct node{
 	int depth;
 	double distanceFromRoot;
 	double distance;
-	double** likenc;
-	double** posteriornc;
+	like_t* likenc; //site-major, 4 states per site, borrowed from the likelihood context's arena
+	like_t* posteriornc;
 	int clusterNumber;
 }node;
 
@@ -58,6 +80,11 @@ typedef struct Options{
 	int number_of_desc;
 	double average;
 	char root[1000];
+	int distance_cache_mb;
+	int tree_method;
+	int root_method;
+	int refresh_roots;
+	int max_msa_members;
 }Options;
 
 typedef struct nw_alignment{
@@ -107,6 +134,9 @@ typedef struct mystruct{
 	int use_nw;
 	int *skipped;
 	int iteration;
+	struct rootProfile* profile; //this thread's share of the root profile counts, or NULL
+	int* next_read; //next unclaimed read of the chunk, shared by all assignment threads
+	int numSaved;
 }mystruct;
 
 typedef struct distStruct{
@@ -115,18 +145,141 @@ typedef struct distStruct{
 	int endi;
 	int endj;	
 	char** seq;
+	int* ids;
+	double** mat;
 	//affine_wavefronts_t* affine_wavefronts;
 	//char* const pattern_alg;
 	//char* const text_alg;
 	//mm_allocator_t* const mm_allocator;
 }distStruct;
 
+typedef struct farthestStruct{
+	char** seq;
+	int* ids;
+	int pick; //member just added to the sample
+	int start;
+	int end;
+	double* minDist; //distance to the nearest sampled member, -1 once sampled
+}farthestStruct;
+
+typedef struct clusterTreeStruct{
+	node** treeArr;
+	int number_of_clusters;
+	int* clusterSize;
+	char*** cluster_seqs;
+	int* rootArr;
+	int root_method;
+	int threads;
+	int* next;
+	pthread_mutex_t* lock;
+}clusterTreeStruct;
+
+typedef struct clusterOrder{
+	int size;
+	int index;
+}clusterOrder;
+
+typedef struct clusterReconStruct{
+	node** treeArr;
+	int number_of_tasks;
+	clusterOrder* order;
+	int* clusterSize;
+	char*** cluster_seqs;
+	int* rootArr;
+	int* numbase;
+	int root_method;
+	int huge_threads;
+	int* next;
+	pthread_mutex_t* lock;
+	unsigned long pt_hits, pt_misses;
+	unsigned long cl_rebuilt, cl_reused;
+	double align_time, infer_time;
+}clusterReconStruct;
+
+#define NR_MAXPAR 10 /*largest number of parameters handed to findmax_Arr*/
+#define POSTERIOR_ROOT 0 /*only the root marginal is reconstructed*/
+#define POSTERIOR_ALL 1 /*marginals for every node, leaves included*/
+/* working storage of the quasi-Newton optimizer in opt.c */
+typedef struct nrState{
+	double *dg,*g,*hdg,*pnew,*xi,**hessin;
+	double space[200];
+	double ITMAX;
+	double TOLX;
+	double TOLX2;
+	double STPMX;
+	int npar, CENTRALMODE, PRECISIONLEVEL;
+	double oldf0;
+}nrState;
+
+/* what the conditional likelihoods of an internal node were last built from;
+   they are still valid while the model, rate category and both child branches
+   are the same and neither child was rebuilt. A node holds the partials of one
+   rate category only, so with NUMCAT > 1 each category overwrites the last and
+   reuse only pays off while NUMCAT is 1 */
+typedef struct partialState{
+	unsigned int version;
+	int cat;
+	double t[2];
+}partialState;
+
+/* everything the likelihood, branch length and posterior code reads and
+   writes while reconstructing the root of one cluster. A context is bound
+   to a cluster with likecontext_bind; its per-site buffers only ever grow,
+   so one context per thread serves every cluster that thread handles.
+   numbase and seqArr describe the distinct site patterns of the alignment;
+   weight[s] is how many aligned columns pattern s stands for */
+typedef struct likeContext{
+	node** treeArr;
+	int whichRoot;
+	int numbase;
+	int number_of_sites;
+	int root;
+	int numspec;
+	int posterior_mode; //POSTERIOR_ROOT or POSTERIOR_ALL, fixed by likecontext_bind
+	alignmentMatrix* seqArr;
+	int* weight;
+	double LRVECnc[4][4], RRVECnc[4][4], RRVALnc[4], PMATnc[2][4][5];
+	like_t PTnc[2][20]; //PMATnc transposed, 5 rows of 4, for the likelihood kernels
+	double model_key[9]; //pi and exchangeabilities the eigensystem was built from
+	int model_valid;
+	unsigned int model_version; //changes whenever the eigensystem does
+	like_t* ptcache; //transposed P(t) of each branch and rate category, 20 values per entry
+	double* ptcache_t; //branch length times rate each entry was built for
+	unsigned int* ptcache_version; //model_version each entry was built under
+	int alloc_ptcache;
+	unsigned long pt_hits, pt_misses;
+	double parameters[10];
+	int COUNT2;//counting the number of tiems the likelihood function is called.
+	int COUNT; //this one counts how many times the likelihood function has been called
+	double statevector[NUMCAT];
+	double* scalenc; //per node and site, log of the scaling applied to the node's subtree
+	partialState* partials;
+	char* rebuilt; //nodes whose partials changed in the current makeconnc pass
+	int alloc_partials;
+	unsigned long cl_rebuilt, cl_reused;
+	struct flatTree* ft; //topology of the bound tree, branch lengths refreshed per evaluation
+	like_t* templike_nc;
+	double* work;
+	uint8_t* tiprow; //bases of the leaf below the branch being optimized, gathered into one row
+	double** locloglike;
+	int alloc_numbase;
+	void* arena; //likenc/posteriornc of the bound tree's nodes and templike_nc, then work and scalenc
+	size_t alloc_arena; //bytes
+	nrState nr;
+}likeContext;
+
+typedef struct branchEntry{
+	double bl;
+	int index;
+}branchEntry;
+
 typedef struct distStruct_Avg{
 	int starti;
 	int startj;
 	int endi;
 	int endj;
 	char*** seq;
+	int** ids;
 	int indexA;
 	int indexB;
 	int indexA_start;
@@ -171,15 +324,11 @@ typedef struct readsToAssign{
 }readsToAssign;
 
 extern char*** clusters;
+extern int** clusterIds;
+extern distCache* distanceCache;
 extern struct hashmap map;
-extern double LRVECnc[4][4], RRVECnc[4][4], RRVALnc[4], PMATnc[2][4][5];
 extern double LRVEC[STATESPACE][STATESPACE], RRVEC[STATESPACE][STATESPACE], RRVAL[STATESPACE], PMAT1[STATESPACE][STATESPACE], PMAT2[STATESPACE][STATESPACE];
-extern double parameters[10];
-extern int COUNT2;//counting the number of tiems the likelihood function is called.
-extern int COUNT; //this one counts how many times the likelihood function has been called
-extern double *statevector, *UFCnc, *localpi, **templike_nc;
 extern double Logfactorial[MAXNUMBEROFINDINSPECIES];
-extern double parameters[10];
 extern node** treeArr;
 extern readsToAssign* readsStruct;
 #endif
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "guidetree.h"
+#include "nj.h"
+
+/*
+ * UPGMA and bisecting k-means trees come from the bundled kalign code, which
+ * only gives back a topology: internal node clusterSize+k joins left[k] and
+ * right[k], children are always numbered below their parent and the root is
+ * the last node, the same layout NJ produces.  Branch lengths are then set
+ * from the distance matrix as in average linkage: each internal node sits at
+ * half the mean distance between the leaves under its two children, and a
+ * branch spans the difference in height to its parent.
+ */
+
+int kalign_tree_kmeans(int number_of_seqs, char** names_of_sequences, char** sequences_in_cluster, int num_threads, int* left, int* right);
+int build_tree_upgma_topology(float** dm, int numseq, int* left, int* right);
+
+static void collectLeaves(node** tree, int node, int whichTree, int* leafOrder, int* pos, int* first, int* count){
+	first[node] = pos[0];
+	if (tree[whichTree][node].up[0] == -1){
+		leafOrder[pos[0]] = node;
+		pos[0]++;
+	}else{
+		collectLeaves(tree,tree[whichTree][node].up[0],whichTree,leafOrder,pos,first,count);
+		collectLeaves(tree,tree[whichTree][node].up[1],whichTree,leafOrder,pos,first,count);
+	}
+	count[node] = pos[0] - first[node];
+}
+static void setAverageLinkageBranchLengths(node** tree, double** distMat, int clusterSize, int whichTree, int root){
+	int i, j, k, a, b, child0, child1, pos;
+	double total;
+	int number_of_nodes = 2*clusterSize-1;
+	int* leafOrder = (int *)malloc(clusterSize*sizeof(int));
+	int* first = (int *)malloc(number_of_nodes*sizeof(int));
+	int* count = (int *)malloc(number_of_nodes*sizeof(int));
+	double* height = (double *)malloc(number_of_nodes*sizeof(double));
+	pos=0;
+	collectLeaves(tree,root,whichTree,leafOrder,&pos,first,count);
+	for(i=0; i<clusterSize; i++){
+		height[i]=0;
+	}
+	for(i=clusterSize; i<number_of_nodes; i++){
+		child0 = tree[whichTree][i].up[0];
+		child1 = tree[whichTree][i].up[1];
+		total=0;
+		for(j=first[child0]; j<first[child0]+count[child0]; j++){
+			for(k=first[child1]; k<first[child1]+count[child1]; k++){
+				//only the upper triangle is filled in
+				a = leafOrder[j] < leafOrder[k] ? leafOrder[j] : leafOrder[k];
+				b = leafOrder[j] < leafOrder[k] ? leafOrder[k] : leafOrder[j];
+				total = total + distMat[a][b];
+			}
+		}
+		height[i] = total/(2.0*(double)count[child0]*(double)count[child1]);
+		tree[whichTree][child1].distance = 2.0*height[i];
+	}
+	for(i=0; i<number_of_nodes; i++){
+		if (i == root){
+			continue;
+		}
+		// HERE WE DISALLOW NEGATIVE BRANCHLENGTHS, AS IN NJ
+		tree[whichTree][i].bl = height[tree[whichTree][i].down] - height[i];
+		if (tree[whichTree][i].bl < MINBL){
+			tree[whichTree][i].bl = MINBL;
+		}
+	}
+	free(leafOrder);
+	free(first);
+	free(count);
+	free(height);
+}
+int buildGuideTree(node** tree, double** distMat, char** seqsInCluster, int clusterSize, int whichTree, int whichTree2, int method, int threads){
+	int i, j, a, b, root;
+	if (method == TREE_METHOD_NJ){
+		return NJ(tree,distMat,clusterSize,whichTree,whichTree2,threads);
+	}
+	int* left = (int *)malloc((clusterSize-1)*sizeof(int));
+	int* right = (int *)malloc((clusterSize-1)*sizeof(int));
+	if (method == TREE_METHOD_UPGMA){
+		float** dm = (float **)malloc(clusterSize*sizeof(float *));
+		for(i=0; i<clusterSize; i++){
+			dm[i] = (float *)malloc(clusterSize*sizeof(float));
+		}
+		for(i=0; i<clusterSize; i++){
+			dm[i][i] = 0.0F;
+			for(j=i+1; j<clusterSize; j++){
+				dm[i][j] = (float)distMat[i][j];
+				dm[j][i] = dm[i][j];
+			}
+		}
+		if (build_tree_upgma_topology(dm,clusterSize,left,right) != 0){
+			fprintf(stderr,"Could not build UPGMA tree\n");
+			exit(1);
+		}
+		for(i=0; i<clusterSize; i++){
+			free(dm[i]);
+		}
+		free(dm);
+	}else{
+		if (kalign_tree_kmeans(clusterSize,clusters[whichTree2],seqsInCluster,threads,left,right) != 0){
+			fprintf(stderr,"Could not build bisecting k-means tree\n");
+			exit(1);
+		}
+	}
+	for(i=0; i<clusterSize; i++){
+		tree[whichTree][i].up[0]=tree[whichTree][i].up[1]=-1;
+		strcpy(tree[whichTree][i].name,clusters[whichTree2][i]);
+	}
+	for(i=0; i<clusterSize-1; i++){
+		a = left[i] < right[i] ? left[i] : right[i];
+		b = left[i] < right[i] ? right[i] : left[i];
+		tree[whichTree][clusterSize+i].up[0]=a;
+		tree[whichTree][clusterSize+i].up[1]=b;
+		tree[whichTree][a].down=clusterSize+i;
+		tree[whichTree][b].down=clusterSize+i;
+	}
+	root = 2*clusterSize-2;
+	tree[whichTree][root].down=-1;
+	tree[whichTree][root].bl=-1.0;
+	setAverageLinkageBranchLengths(tree,distMat,clusterSize,whichTree,root);
+	free(left);
+	free(right);
+	return root;
+}
@@ -0,0 +1,10 @@
+#ifndef _GUIDETREE_H
+#define _GUIDETREE_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "global.h"
+
+int buildGuideTree(node** tree, double** distMat, char** seqsInCluster, int clusterSize, int whichTree, int whichTree2, int method, int threads);
+
+#endif /* _GUIDETREE_H */
@@ -20,7 +20,7 @@
 #include "aln_run.h"
 
 static void recursive_aln_openMP(struct msa* msa, struct aln_tasks*t, struct aln_param* ap, uint8_t* active, int c);
-static void recursive_aln_serial(struct msa* msa, struct aln_tasks*t, struct aln_param* ap, uint8_t* active, int c);
+static void recursive_aln_serial(struct msa* msa, struct aln_tasks*t, struct aln_mem* ml, uint8_t* active, int c);
 
 static int do_align(struct msa* msa,struct aln_tasks* t,struct aln_mem* m, int task_id);
 static int do_align_serial(struct msa* msa,struct aln_tasks* t,struct aln_mem* m, int task_id);
@@ -355,7 +355,9 @@ ERROR:
 /* #endif */
 
 
-int create_msa_tree(struct msa* msa, struct aln_param* ap,struct aln_tasks* t, int n_threads)
+/* m holds the dynamic programming buffers for the serial path; they grow
+   with resize_aln_mem and stay with the caller for the next alignment. */
+int create_msa_tree(struct msa* msa, struct aln_param* ap,struct aln_tasks* t, struct aln_mem* m, int n_threads)
 {
         int i;
         uint8_t* active = NULL;
@@ -371,13 +373,15 @@ int create_msa_tree(struct msa* msa, struct aln_param* ap,struct aln_tasks* t, i
         }
 #ifdef HAVE_OPENMP
 
+        m->ap = ap;
         if(n_threads == 1){
-                recursive_aln_serial(msa, t, ap, active, t->n_tasks-1);
+                recursive_aln_serial(msa, t, m, active, t->n_tasks-1);
         }else{
                 recursive_aln_openMP(msa, t, ap, active, t->n_tasks-1);
         }
 #else
-        recursive_aln_serial(msa, t, ap, active, t->n_tasks-1);
+        m->ap = ap;
+        recursive_aln_serial(msa, t, m, active, t->n_tasks-1);
 #endif
         MFREE(active);
         return OK;
@@ -447,7 +451,7 @@ void recursive_aln_openMP(struct msa* msa, struct aln_tasks*t, struct aln_param*
 
 
 
-void recursive_aln_serial(struct msa* msa, struct aln_tasks*t,struct aln_param* ap, uint8_t* active, int c)
+void recursive_aln_serial(struct msa* msa, struct aln_tasks*t,struct aln_mem* ml, uint8_t* active, int c)
 {
         struct task* local_t = NULL;
         local_t = t->list[c];
@@ -457,14 +461,14 @@ void recursive_aln_serial(struct msa* msa, struct aln_tasks*t,struct aln_param*
         /* LOG_MSG("Work: %d", local_t->n); */
         if(!active[local_t->a]){
                 if(local_t->a >= msa->numseq){ /* I have an internal node  */
-                        recursive_aln_serial(msa, t, ap, active, local_t->a - msa->numseq);
+                        recursive_aln_serial(msa, t, ml, active, local_t->a - msa->numseq);
                 }
                 /* I have a lead node - do nothing */
         }
 
         if(!active[local_t->b]){
                 if(local_t->b >= msa->numseq){ /* I have an internal node */
-                        recursive_aln_serial(msa, t, ap, active, local_t->b - msa->numseq);
+                        recursive_aln_serial(msa, t, ml, active, local_t->b - msa->numseq);
                 }
                 /* I have a lead node - do nothing */
         }
@@ -473,16 +477,10 @@ void recursive_aln_serial(struct msa* msa, struct aln_tasks*t,struct aln_param*
         /* if(active[local_t->a] && active[local_t->b]){ */
         /* fprintf(stdout,"%3d %3d -> %3d (p: %d)\n", t->list[c]->a, t->list[c]->b, t->list[c]->c, t->list[c]->p);
  */
-        struct aln_mem* ml = NULL;
-
-        alloc_aln_mem(&ml, 256);
-
-        ml->ap = ap;
         ml->mode = ALN_MODE_FULL;
 
         do_align_serial(msa,t,ml,c);
         active[local_t->c] = 1;
-        free_aln_mem(ml);
 }
 
 
@@ -8,11 +8,12 @@
 #endif
 
 struct aln_tasks;
+struct aln_mem;
 
 /* EXTERN int create_msa(struct msa* msa, struct aln_param* ap,struct aln_tasks* t); */
 
 /* EXTERN int create_msa_serial_tree(struct msa* msa, struct aln_param* ap,struct aln_tasks* t); */
-EXTERN int create_msa_tree(struct msa* msa, struct aln_param* ap,struct aln_tasks* t, int n_threads);
+EXTERN int create_msa_tree(struct msa* msa, struct aln_param* ap,struct aln_tasks* t, struct aln_mem* m, int n_threads);
 EXTERN int create_chaos_msa_serial(struct msa* msa, struct aln_param* ap,struct aln_tasks* t);
 EXTERN int create_msa_serial(struct msa* msa, struct aln_param* ap,struct aln_tasks* t);
 
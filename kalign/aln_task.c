@@ -94,6 +94,37 @@ ERROR:
         return FAIL;
 }
 
+/* Readies tasks for another alignment of numseq sequences. The arrays
+   are kept when they are already big enough; the profile left over from
+   the previous alignment (do_align never frees the root's) is freed. */
+int reuse_tasks(struct aln_tasks** tasks,int numseq)
+{
+        struct aln_tasks* t = *tasks;
+        int np;
+        int i;
+
+        if(t && t->n_alloc_tasks < numseq){
+                free_tasks(t);
+                t = NULL;
+        }
+        if(!t){
+                RUN(alloc_tasks(&t, numseq));
+                *tasks = t;
+                return OK;
+        }
+        np =  (t->n_alloc_tasks << 1) - 1;
+        for(i = 0; i < np;i++){
+                if(t->profile[i]){
+                        MFREE(t->profile[i]);
+                }
+        }
+        t->n_tasks = 0;
+        return OK;
+ERROR:
+        *tasks = NULL;
+        return FAIL;
+}
+
 void free_tasks(struct aln_tasks* t)
 {
         if(t){
@@ -109,7 +140,13 @@ void free_tasks(struct aln_tasks* t)
                 /*                 MFREE(t->map[i]); */
                 /*         } */
                 /* } */
-
+                if(t->profile){
+                        for(i = 0; i < np;i++){
+                                if(t->profile[i]){
+                                        MFREE(t->profile[i]);
+                                }
+                        }
+                }
 
                 MFREE(t->list);
                 /* MFREE(t->map); */
@@ -29,6 +29,7 @@ struct aln_tasks{
 
 EXTERN int sort_tasks(struct aln_tasks* t , int order);
 EXTERN int alloc_tasks(struct aln_tasks** tasks,int numseq);
+EXTERN int reuse_tasks(struct aln_tasks** tasks,int numseq);
 EXTERN void free_tasks(struct aln_tasks* tasks);
 
 #undef ALN_TASK_IMPORT
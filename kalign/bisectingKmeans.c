@@ -66,6 +66,7 @@ static struct node* alloc_node(void);
 
 static int label_internal(struct node*n, int label);
 static void create_tasks(struct node*n, struct aln_tasks* t);
+static void store_topology(struct node*n, int numseq, int* left, int* right);
 
 
 static struct node* bisecting_kmeans_serial(struct msa* msa, struct node* n, float** dm,int* samples,int numseq, int num_anchors,int num_samples);
@@ -155,6 +156,83 @@ ERROR:
 
 
 
+/* Builds the bisecting k-means tree and hands back its topology instead of
+   alignment tasks: internal node numseq+k joins left[k] and right[k]. */
+int build_tree_kmeans_topology(struct msa* msa, int nthreads, int* left, int* right)
+{
+        struct node* root = NULL;
+        float** dm = NULL;
+        int* samples = NULL;
+        int* anchors = NULL;
+        int num_anchors;
+        int numseq;
+
+        int i;
+
+        ASSERT(msa != NULL, "No alignment.");
+
+        numseq = msa->numseq;
+
+        RUNP(anchors = pick_anchor(msa, &num_anchors));
+
+        RUNP(dm = d_estimation(msa, anchors, num_anchors,0));
+
+        MFREE(anchors);
+
+        MMALLOC(samples, sizeof(int)* numseq);
+        for(i = 0; i < numseq;i++){
+                samples[i] = i;
+        }
+
+        if(nthreads == 1){
+                root = bisecting_kmeans_serial(msa,root, dm, samples, numseq, num_anchors, numseq);
+        }else{
+                root = bisecting_kmeans_parallel(msa,root, dm, samples, numseq, num_anchors, numseq);
+        }
+        RUNP(root);
+
+        label_internal(root, numseq);
+
+        store_topology(root, numseq, left, right);
+
+        MFREE(root);
+        for(i =0 ; i < numseq;i++){
+                _mm_free(dm[i]);
+        }
+        MFREE(dm);
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Same as above for a UPGMA tree on a full distance matrix (dm is
+   overwritten). */
+int build_tree_upgma_topology(float** dm, int numseq, int* left, int* right)
+{
+        struct node* root = NULL;
+        int* samples = NULL;
+
+        int i;
+
+        MMALLOC(samples, sizeof(int)* numseq);
+        for(i = 0; i < numseq;i++){
+                samples[i] = i;
+        }
+
+        RUNP(root = upgma(dm,samples, numseq));
+
+        label_internal(root, numseq);
+
+        store_topology(root, numseq, left, right);
+
+        MFREE(root);
+        MFREE(samples);
+        return OK;
+ERROR:
+        MFREE(samples);
+        return FAIL;
+}
+
 struct node* bisecting_kmeans_parallel(struct msa* msa, struct node* n, float** dm,int* samples,int numseq, int num_anchors,int num_samples)
 {
         struct kmeans_result* res_tmp = NULL;
@@ -665,6 +743,22 @@ int label_internal(struct node*n, int label)
 
 }
 
+void store_topology(struct node*n, int numseq, int* left, int* right)
+{
+        if(n->left && n->right){
+                left[n->id - numseq] = n->left->id;
+                right[n->id - numseq] = n->right->id;
+        }
+        if(n->left){
+                store_topology(n->left, numseq, left, right);
+                MFREE(n->left);
+        }
+        if(n->right){
+                store_topology(n->right, numseq, left, right);
+                MFREE(n->right);
+        }
+}
+
 void create_tasks(struct node*n, struct aln_tasks* t)
 {
 
@@ -28,6 +28,8 @@
 struct aln_tasks;
 
 int build_tree_kmeans(struct msa* msa, struct aln_param* ap,struct  aln_tasks** task_list);
+int build_tree_kmeans_topology(struct msa* msa, int nthreads, int* left, int* right);
+int build_tree_upgma_topology(float** dm, int numseq, int* left, int* right);
 
 //int build_tree_kmeans(struct msa* msa, struct aln_param* ap);
 
@@ -46,6 +46,7 @@
 
 #include "aln_run.h"
 #include "aln_task.h"
+#include "aln_mem.h"
 #include "config.h"
 
 #define OPT_SET 1
@@ -66,7 +67,23 @@
 #define OPT_CLEAN 15
 #define OPT_UNALIGN 16
 
-static int run_kalign(struct parameters* param, int number_of_seqs, char** names_of_sequences, char** sequences_in_cluster, int** seqArr, int* numbase,int whichRoot);
+/* Everything an alignment needs besides the sequences themselves. One
+   engine belongs to one calling thread and is reused for every cluster it
+   aligns: the task arrays and the serial dynamic programming buffers only
+   grow, and the OpenMP settings are only touched when the thread count
+   changes. */
+struct kalign_engine{
+        struct parameters* param;
+        struct aln_param* ap;
+        struct aln_tasks* tasks;
+        struct aln_mem* mem;
+        int nthreads;           /* thread count the OpenMP settings were last made for */
+};
+
+int alloc_kalign_engine(struct kalign_engine** engine);
+void free_kalign_engine(struct kalign_engine* e);
+
+static int run_kalign(struct kalign_engine* e, int number_of_seqs, char** names_of_sequences, char** sequences_in_cluster, uint8_t** columns, int* aln_len);
 static int check_for_sequences(struct msa* msa);
 
 static int print_kalign_header(void);
@@ -175,8 +192,21 @@ int print_AVX_warning(void)
 
 
 //int main_kalign(int argc, char *argv[], int number_of_seqs, char** names_of_sequences, char** sequences_in_cluster, int*** seqArr, int* numbase, int whichRoot)
-int main_kalign(int number_of_seqs, char** names_of_sequences, char** sequences_in_cluster, int** seqArr, int* numbase, int whichRoot, int num_threads)
+/* Aligns the cluster in memory and returns the alignment as a column-major
+   block of base codes (see write_msa_columns); the caller frees *columns. */
+int main_kalign(struct kalign_engine* engine, int number_of_seqs, char** names_of_sequences, char** sequences_in_cluster, uint8_t** columns, int* aln_len, int num_threads)
 {
+        engine->param->nthreads = num_threads;
+        RUN(run_kalign(engine,number_of_seqs,names_of_sequences,sequences_in_cluster,columns,aln_len));
+        return EXIT_SUCCESS;
+ERROR:
+        return EXIT_FAILURE;
+}
+
+/* The parameter setup main_kalign used to repeat for every cluster. */
+int alloc_kalign_engine(struct kalign_engine** engine)
+{
+        struct kalign_engine* e = NULL;
         int version = 0;
         int c;
         int showw = 0;
@@ -296,7 +326,6 @@ int main_kalign(int number_of_seqs, char** names_of_sequences, char** sequences_
                         abort ();
                 }
         }*/
-	param->nthreads = num_threads;
 	//param->outfile = argv[1];
 	//in = argv[0];
 
@@ -443,48 +472,83 @@ int main_kalign(int number_of_seqs, char** names_of_sequences, char** sequences_
                 }
         }
 	//param->infile[0] = argv[0];
-        
-	RUN(run_kalign(param,number_of_seqs,names_of_sequences,sequences_in_cluster,seqArr,numbase,whichRoot));
 
-        if(devtest){
-                for(c = 0; c < param->num_infiles;c++){
-                        MFREE(param->infile[c]);
+        MMALLOC(e, sizeof(struct kalign_engine));
+        e->param = param;
+        e->ap = NULL;
+        e->tasks = NULL;
+        e->mem = NULL;
+        e->nthreads = 0;
+        RUN(alloc_aln_mem(&e->mem, 256));
+        *engine = e;
+        return OK;
+ERROR:
+        if(e){
+                free_kalign_engine(e);
+        }else{
+                free_parameters(param);
+        }
+        return FAIL;
+}
+
+void free_kalign_engine(struct kalign_engine* e)
+{
+        if(e){
+                if(e->mem){
+                        free_aln_mem(e->mem);
+                }
+                if(e->tasks){
+                        free_tasks(e->tasks);
                 }
+                if(e->ap){
+                        free_ap(e->ap);
+                }
+                free_parameters(e->param);
+                MFREE(e);
         }
+}
 
-        free_parameters(param);
-        return EXIT_SUCCESS;
+/* Guide tree only: reads the sequences and returns the bisecting k-means
+   topology (see build_tree_kmeans_topology) without aligning anything. */
+int kalign_tree_kmeans(int number_of_seqs, char** names_of_sequences, char** sequences_in_cluster, int num_threads, int* left, int* right)
+{
+        struct msa* msa = NULL;
+        int i;
+
+#ifdef HAVE_OPENMP
+        omp_set_nested(1);
+        omp_set_num_threads(num_threads);
+        i = floor(log((double) num_threads) / log(2.0)) + 4;
+        i = MACRO_MIN(i, 10);
+        omp_set_max_active_levels(i);
+#endif
+        RUN(read_sequences(&msa,number_of_seqs,names_of_sequences,sequences_in_cluster));
+        RUN(build_tree_kmeans_topology(msa,num_threads,left,right));
+        free_msa(msa);
+        return OK;
 ERROR:
-        free_parameters(param);
-        return EXIT_FAILURE;
+        if(msa){
+                free_msa(msa);
+        }
+        return FAIL;
 }
 
-int run_kalign(struct parameters* param, int number_of_seqs, char** names_of_sequences, char** sequences_in_cluster, int** seqArr, int* numbase, int whichRoot)
+int run_kalign(struct kalign_engine* e, int number_of_seqs, char** names_of_sequences, char** sequences_in_cluster, uint8_t** columns, int* aln_len)
 {
+        struct parameters* param = e->param;
         struct msa* msa = NULL;
-        struct msa* tmp_msa = NULL;
-        struct aln_param* ap = NULL;
-        struct aln_tasks* tasks = NULL;
 
         int i;
 
 #ifdef HAVE_OPENMP
-        omp_set_nested(1);
-        omp_set_num_threads(param->nthreads);
+        if(param->nthreads != e->nthreads){
+                omp_set_nested(1);
+                omp_set_num_threads(param->nthreads);
+                e->nthreads = param->nthreads;
+        }
 #endif
 
-        if(param->num_infiles == 1){
-                RUN(read_input(param->infile[0],&msa,number_of_seqs,names_of_sequences,sequences_in_cluster));
-        }else{
-                for(i = 0; i < param->num_infiles;i++){
-                        RUN(read_input(param->infile[i],&tmp_msa,number_of_seqs,names_of_sequences,sequences_in_cluster));
-                        if(tmp_msa){
-                                RUN(merge_msa(&msa, tmp_msa));
-                                free_msa(tmp_msa);
-                                tmp_msa = NULL;
-                        }
-                }
-        }
+        RUN(read_sequences(&msa,number_of_seqs,names_of_sequences,sequences_in_cluster));
         /* check if we have sequences  */
         //RUN(check_for_sequences(msa));
 
@@ -516,7 +580,7 @@ int run_kalign(struct parameters* param, int number_of_seqs, char** names_of_seq
                         ERROR_MSG("Input sequences are not aligned - cannot write to MSA format: %s", param->format);
                 }
 
-                RUN(write_msa(msa, param->outfile, param->out_format,seqArr,numbase,whichRoot,number_of_seqs));
+                RUN(write_msa_columns(msa, columns, aln_len));
 
                 free_msa(msa);
                 return OK;
@@ -526,13 +590,14 @@ int run_kalign(struct parameters* param, int number_of_seqs, char** names_of_seq
                 RUN(dealign_msa(msa));
         }*/
 
-        /* allocate aln parameters  */
-        RUN(init_ap(&ap,param,number_of_seqs,msa->L ));
+        /* allocate aln parameters; an engine's are set up again in place */
+        RUN(init_ap(&e->ap,param,number_of_seqs,msa->L ));
+        e->ap->nthreads = param->nthreads;
 
         if(param->dump_internal){
                 double* s;
                 int s_len;
-                RUN(get_internal_data(msa,ap,&s, &s_len));
+                RUN(get_internal_data(msa,e->ap,&s, &s_len));
                 for(i = 0; i < s_len;i++){
                         fprintf(stdout,"%0.2f ", s[i]);
                 }
@@ -542,18 +607,21 @@ int run_kalign(struct parameters* param, int number_of_seqs, char** names_of_seq
                 return OK;
         }
 
-        /* Allocate tasks  */
-        RUN(alloc_tasks(&tasks, number_of_seqs));
+        /* Allocate tasks, or reuse the engine's */
+        RUN(reuse_tasks(&e->tasks, number_of_seqs));
 
         /* Start bi-secting K-means sequence clustering */
         if(!param->chaos){
 #ifdef HAVE_OPENMP
-                i = floor(log((double) param->nthreads) / log(2.0)) + 4;
-                i = MACRO_MIN(i, 10);
-                /* LOG_MSG("Set %d level (%d)", i, param->nthreads); */
-                omp_set_max_active_levels(i);
+                /* the serial paths never nest, so one thread needs no levels */
+                if(param->nthreads > 1){
+                        i = floor(log((double) param->nthreads) / log(2.0)) + 4;
+                        i = MACRO_MIN(i, 10);
+                        /* LOG_MSG("Set %d level (%d)", i, param->nthreads); */
+                        omp_set_max_active_levels(i);
+                }
 #endif
-                RUN(build_tree_kmeans(msa,ap,&tasks));
+                RUN(build_tree_kmeans(msa,e->ap,&e->tasks));
         }
         /* by default all protein sequences are converted into a reduced alphabet
            when read from file. Here we turn them back into the default representation. */
@@ -562,7 +630,7 @@ int run_kalign(struct parameters* param, int number_of_seqs, char** names_of_seq
                 RUN(convert_msa_to_internal(msa, ALPHA_ambigiousPROTEIN));
         }
         /* allocate aln parameters  */
-        RUN(init_ap(&ap,param,msa->numseq,msa->L ));
+        RUN(init_ap(&e->ap,param,msa->numseq,msa->L ));
 
         /* Start alignment stuff */
         DECLARE_TIMER(t1);
@@ -571,17 +639,19 @@ int run_kalign(struct parameters* param, int number_of_seqs, char** names_of_seq
 
         /* testing  */
 #ifdef HAVE_OPENMP
-        i = floor(log((double) param->nthreads) / log(2.0)) + 2;
-        i = MACRO_MIN(i, 10);
-        /* LOG_MSG("Set %d level (%d)", i, param->nthreads); */
-        omp_set_max_active_levels(i);
+        if(param->nthreads > 1){
+                i = floor(log((double) param->nthreads) / log(2.0)) + 2;
+                i = MACRO_MIN(i, 10);
+                /* LOG_MSG("Set %d level (%d)", i, param->nthreads); */
+                omp_set_max_active_levels(i);
+        }
 #endif
         if(param->chaos){
 
-                RUN(create_chaos_msa_openMP(msa, ap,tasks));
+                RUN(create_chaos_msa_openMP(msa, e->ap,e->tasks));
 
         }else{
-                RUN(create_msa_tree(msa, ap, tasks,param->nthreads));
+                RUN(create_msa_tree(msa, e->ap, e->tasks, e->mem, param->nthreads));
         }
         /* RUN(create_msa_openMP(msa,ap, tasks)); */
 
@@ -605,18 +675,13 @@ int run_kalign(struct parameters* param, int number_of_seqs, char** names_of_seq
         /* set to aligned */
         msa->aligned = ALN_STATUS_ALIGNED;
 
-        /* clean up map */
-        free_tasks(tasks);
-
-        /* We are done. */
-        RUN(write_msa(msa, param->outfile, param->out_format,seqArr,numbase,whichRoot,number_of_seqs));
+        /* We are done; the tasks and parameters stay with the engine. */
+        RUN(write_msa_columns(msa, columns, aln_len));
 
         free_msa(msa);
-        free_ap(ap);
         DESTROY_TIMER(t1);
         return OK;
 ERROR:
-        free_msa(tmp_msa);
         free_msa(msa);
         return FAIL;
 }
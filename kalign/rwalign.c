@@ -80,6 +80,7 @@ int resize_msa(struct msa* msa);
 
 
 struct msa_seq* alloc_msa_seq(void);
+struct msa_seq* alloc_msa_seq_len(int alloc_len);
 int resize_msa_seq(struct msa_seq* seq);
 void free_msa_seq(struct msa_seq* seq);
 
@@ -257,6 +258,111 @@ ERROR:
         return FAIL;
 }
 
+/* Builds the msa straight from the caller's sequence arrays. Only
+   number_of_seqs entries are created and each one is allocated once at the
+   length of its sequence, instead of the 512 x 512 default pool that
+   read_fasta grows a character at a time. */
+int read_sequences(struct msa** msa, int number_of_seqs, char** names_of_sequences, char** sequences_in_cluster)
+{
+        struct msa* m = NULL;
+        struct msa_seq* seq_ptr = NULL;
+        char* line = NULL;
+        int line_len;
+        int i,nl;
+
+        MMALLOC(m, sizeof(struct msa));
+        m->sequences = NULL;
+        m->alloc_numseq = number_of_seqs;
+        m->numseq = 0;
+        m->num_profiles = 0;
+        m->L = ALPHA_UNDEFINED;
+        m->aligned = 0;
+        m->plen = NULL;
+        m->sip = NULL;
+        m->nsip = NULL;
+        for(i = 0; i < 128; i++){
+                m->letter_freq[i] = 0;
+        }
+        MMALLOC(m->sequences, sizeof(struct msa_seq*) * m->alloc_numseq);
+        for(i = 0; i < m->alloc_numseq;i++){
+                m->sequences[i] = NULL;
+        }
+        for(nl = 0; nl < number_of_seqs; nl++){
+                line = sequences_in_cluster[nl];
+                line_len = strlen(line);
+                RUNP(seq_ptr = alloc_msa_seq_len(line_len+1));
+                m->sequences[nl] = seq_ptr;
+                m->numseq++;
+                snprintf(seq_ptr->name ,MSA_NAME_LEN ,"%s",names_of_sequences[nl]);
+                for(i = 0;i < line_len;i++){
+                        m->letter_freq[(int)line[i]]++;
+                        if(isalpha((int)line[i])){
+                                seq_ptr->seq[seq_ptr->len] = line[i];
+                                seq_ptr->len++;
+                        }else if(ispunct((int)line[i])){
+                                seq_ptr->gaps[seq_ptr->len]++;
+                        }
+                }
+                seq_ptr->seq[seq_ptr->len] = 0;
+        }
+
+        RUN(detect_alphabet(m));
+        RUN(detect_aligned(m));
+        RUN(set_sip_nsip(m));
+        *msa = m;
+        return OK;
+ERROR:
+        free_msa(m);
+        return FAIL;
+}
+
+/* Hands the alignment back as one column-major block: the base of sequence
+   i at aligned column c is columns[c*numseq+i], coded 0-3 for A,C,G,T and 4
+   for gaps, N and any other ambiguity code. */
+int write_msa_columns(struct msa* msa, uint8_t** columns, int* aln_len)
+{
+        struct msa_seq* seq_ptr = NULL;
+        uint8_t* c = NULL;
+        uint8_t code[256];
+        size_t numseq;
+        int i,j,pos,len;
+
+        ASSERT(msa!= NULL, "No alignment");
+        memset(code, 4, 256);
+        code['A'] = code['a'] = 0;
+        code['C'] = code['c'] = 1;
+        code['G'] = code['g'] = 2;
+        code['T'] = code['t'] = 3;
+        code['U'] = code['u'] = 3;
+
+        numseq = msa->numseq;
+        len = 0;
+        for(i = 0; i < msa->numseq;i++){
+                seq_ptr = msa->sequences[i];
+                pos = seq_ptr->len;
+                for(j = 0; j <= seq_ptr->len;j++){
+                        pos += seq_ptr->gaps[j];
+                }
+                len = MACRO_MAX(len, pos);
+        }
+        MMALLOC(c, sizeof(uint8_t) * MACRO_MAX(len,1) * numseq);
+        memset(c, 4, sizeof(uint8_t) * MACRO_MAX(len,1) * numseq);
+        for(i = 0; i < msa->numseq;i++){
+                seq_ptr = msa->sequences[i];
+                pos = 0;
+                for(j = 0; j < seq_ptr->len;j++){
+                        pos += seq_ptr->gaps[j];
+                        c[(size_t)pos * numseq + i] = code[(uint8_t) seq_ptr->seq[j]];
+                        pos++;
+                }
+        }
+        *columns = c;
+        *aln_len = len;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
 int write_msa(struct msa* msa, char* outfile, int type, int** seqArr, int *numbase, int whichRoot,int clusterSize)
 {
 
@@ -1703,6 +1809,11 @@ void free_msa(struct msa* msa)
 
 
 struct msa_seq* alloc_msa_seq(void)
+{
+        return alloc_msa_seq_len(512);
+}
+
+struct msa_seq* alloc_msa_seq_len(int alloc_len)
 {
         struct msa_seq* seq = NULL;
         int i;
@@ -1712,7 +1823,7 @@ struct msa_seq* alloc_msa_seq(void)
         seq->s = NULL;
         seq->gaps = NULL;
         seq->len = 0;
-        seq->alloc_len = 512;
+        seq->alloc_len = alloc_len;
 
         MMALLOC(seq->name, sizeof(char)* MSA_NAME_LEN);
 
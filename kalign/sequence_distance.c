@@ -93,6 +93,24 @@ float** d_estimation(struct msa* msa, int* samples, int num_samples,int pair)
 
                         //fprintf(stdout,"\n");
                 }
+#ifndef HAVE_AVX2
+                /* Without AVX2 calc_distance returns a k-mer similarity
+                   score, larger for closer sequences. upgma joins the
+                   smallest entries first so turn it into a distance. */
+                for(i = 0; i < num_samples;i++){
+                        for(j = i+1;j < num_samples;j++){
+                                dist = 0.5F * (dm[i][i] + dm[j][j]) - dm[i][j];
+                                if(dist < 0.0F){
+                                        dist = 0.0F;
+                                }
+                                dm[i][j] = dist;
+                                dm[j][i] = dist;
+                        }
+                }
+                for(i = 0; i < num_samples;i++){
+                        dm[i][i] = 0.0F;
+                }
+#endif
         }else{
                 int a;
                 int numseq = msa->numseq;
@@ -173,6 +191,10 @@ float calc_distance(uint8_t* seq_a, uint8_t* seq_b, int len_a,int len_b, int L)
         int i;
         float dist;
         unsigned int hv;
+        /* too short to hash: the position loops below would never end */
+        if(len_a < 6 || len_b < 6){
+                return 0.0F;
+        }
         for (i = 0;i < 1024;i++){
                 hash[i] = 0;
         }
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "likekernels.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+void* lk_alloc(size_t size){
+	void* p = NULL;
+	if (size == 0){
+		size = LK_ALIGN;
+	}
+	if (posix_memalign(&p,LK_ALIGN,size) != 0){
+		fprintf(stderr,"Could not allocate likelihood buffer\n");
+		exit(1);
+	}
+	return p;
+}
+//one site of each kernel; the vector loops leave any sites that do not fill a vector to these
+static inline void lk_transform_site(const like_t* PT, const like_t* v, like_t* out){
+	int i;
+	for(i=0; i<4; i++){
+		out[i] = PT[i]*v[0] + PT[4+i]*v[1] + PT[8+i]*v[2] + PT[12+i]*v[3];
+	}
+}
+static inline void lk_transform_mul_site(const like_t* PT, const like_t* v, like_t* out){
+	int i;
+	for(i=0; i<4; i++){
+		out[i] = out[i]*(PT[i]*v[0] + PT[4+i]*v[1] + PT[8+i]*v[2] + PT[12+i]*v[3]);
+	}
+}
+#ifdef __AVX2__
+#ifdef LIKE_FLOAT
+//two sites per vector, one in each 128-bit lane
+#define LK_SITES 2
+typedef __m256 lk_vec;
+#define lk_load _mm256_loadu_ps
+#define lk_store _mm256_storeu_ps
+#define lk_vmul _mm256_mul_ps
+static inline lk_vec lk_matvec(const like_t* PT, const like_t* v){
+	//separate multiply and add keep the rounding of the scalar loop; the in-lane
+	//permutes broadcast each site's own state j across its lane
+	__m256 x = _mm256_loadu_ps(v);
+	__m256 acc = _mm256_mul_ps(_mm256_broadcast_ps((const __m128 *)PT),_mm256_permute_ps(x,0x00));
+	acc = _mm256_add_ps(acc,_mm256_mul_ps(_mm256_broadcast_ps((const __m128 *)(PT+4)),_mm256_permute_ps(x,0x55)));
+	acc = _mm256_add_ps(acc,_mm256_mul_ps(_mm256_broadcast_ps((const __m128 *)(PT+8)),_mm256_permute_ps(x,0xAA)));
+	acc = _mm256_add_ps(acc,_mm256_mul_ps(_mm256_broadcast_ps((const __m128 *)(PT+12)),_mm256_permute_ps(x,0xFF)));
+	return acc;
+}
+static inline lk_vec lk_tiprows(const like_t* PT, const uint8_t* bases, int stride, int s){
+	__m256 lo = _mm256_castps128_ps256(_mm_loadu_ps(PT+4*bases[(size_t)s*stride]));
+	return _mm256_insertf128_ps(lo,_mm_loadu_ps(PT+4*bases[(size_t)(s+1)*stride]),1);
+}
+#else
+#define LK_SITES 1
+typedef __m256d lk_vec;
+#define lk_load _mm256_loadu_pd
+#define lk_store _mm256_storeu_pd
+#define lk_vmul _mm256_mul_pd
+static inline lk_vec lk_matvec(const like_t* PT, const like_t* v){
+	//separate multiply and add keep the rounding of the scalar loop
+	__m256d acc = _mm256_mul_pd(_mm256_loadu_pd(PT),_mm256_set1_pd(v[0]));
+	acc = _mm256_add_pd(acc,_mm256_mul_pd(_mm256_loadu_pd(PT+4),_mm256_set1_pd(v[1])));
+	acc = _mm256_add_pd(acc,_mm256_mul_pd(_mm256_loadu_pd(PT+8),_mm256_set1_pd(v[2])));
+	acc = _mm256_add_pd(acc,_mm256_mul_pd(_mm256_loadu_pd(PT+12),_mm256_set1_pd(v[3])));
+	return acc;
+}
+static inline lk_vec lk_tiprows(const like_t* PT, const uint8_t* bases, int stride, int s){
+	return _mm256_loadu_pd(PT+4*bases[(size_t)s*stride]);
+}
+#endif
+#endif
+void lk_transform(const like_t* PT, const like_t* in, like_t* out, int n){
+	int s=0;
+#ifdef __AVX2__
+	for(; s+LK_SITES<=n; s+=LK_SITES){
+		lk_store(out+4*s,lk_matvec(PT,in+4*s));
+	}
+#endif
+	for(; s<n; s++){
+		lk_transform_site(PT,in+4*s,out+4*s);
+	}
+}
+void lk_transform_mul(const like_t* PT, const like_t* in, like_t* out, int n){
+	int s=0;
+#ifdef __AVX2__
+	for(; s+LK_SITES<=n; s+=LK_SITES){
+		lk_store(out+4*s,lk_vmul(lk_load(out+4*s),lk_matvec(PT,in+4*s)));
+	}
+#endif
+	for(; s<n; s++){
+		lk_transform_mul_site(PT,in+4*s,out+4*s);
+	}
+}
+void lk_tip(const like_t* PT, const uint8_t* bases, int stride, like_t* out, int n){
+	int s=0, i;
+	const like_t* row;
+#ifdef __AVX2__
+	for(; s+LK_SITES<=n; s+=LK_SITES){
+		lk_store(out+4*s,lk_tiprows(PT,bases,stride,s));
+	}
+#endif
+	for(; s<n; s++){
+		row = PT+4*bases[(size_t)s*stride];
+		for(i=0; i<4; i++){
+			out[4*s+i] = row[i];
+		}
+	}
+}
+void lk_tip_mul(const like_t* PT, const uint8_t* bases, int stride, like_t* out, int n){
+	int s=0, i;
+	const like_t* row;
+#ifdef __AVX2__
+	for(; s+LK_SITES<=n; s+=LK_SITES){
+		lk_store(out+4*s,lk_vmul(lk_load(out+4*s),lk_tiprows(PT,bases,stride,s)));
+	}
+#endif
+	for(; s<n; s++){
+		row = PT+4*bases[(size_t)s*stride];
+		for(i=0; i<4; i++){
+			out[4*s+i] = out[4*s+i]*row[i];
+		}
+	}
+}
+void lk_mul(const like_t* a, like_t* out, int n){
+	int i=0;
+#ifdef __AVX2__
+	for(; i+4*LK_SITES<=4*n; i+=4*LK_SITES){
+		lk_store(out+i,lk_vmul(lk_load(out+i),lk_load(a+i)));
+	}
+#endif
+	for(; i<4*n; i++){
+		out[i] = out[i]*a[i];
+	}
+}
@@ -0,0 +1,47 @@
+#ifndef _LIKEKERNELS_H
+#define _LIKEKERNELS_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+ * Per-site 4-state kernels for the pruning and posterior passes.  Buffers
+ * are site-major with the four states of a site next to each other, and
+ * come from lk_alloc so they start on a cache line.  PT is a transition
+ * matrix stored transposed as 5 rows of 4, PT[4*j+i] = P(i->j), with a
+ * fifth row of ones for missing data, so a tip's partials are simply the
+ * row PT+4*base.
+ * Built with AVX2 enabled (make avx2) the kernels use 256-bit vectors; the
+ * scalar versions add the terms in the same order and give the same bits.
+ */
+#define LK_ALIGN 64
+
+/*
+ * Precision of the conditional likelihoods, posteriors and transition
+ * matrices the kernels work on.  Built with LIKE_FLOAT defined (make single)
+ * they are float, which halves their memory and puts two sites in each AVX2
+ * vector.  In the float build every internal node's partials are rescaled by
+ * their largest state, with the log kept in a double scaler; the double build
+ * only rescales nodes with an internal second child, as it always has.  Sums
+ * over sites, the per-site scalers and the eigensystem stay double, so only
+ * the per-site products lose precision.
+ */
+#ifdef LIKE_FLOAT
+typedef float like_t;
+#else
+typedef double like_t;
+#endif
+
+void* lk_alloc(size_t size);
+//out[s] = P in[s]
+void lk_transform(const like_t* PT, const like_t* in, like_t* out, int n);
+//out[s] = out[s] * P in[s]
+void lk_transform_mul(const like_t* PT, const like_t* in, like_t* out, int n);
+//out[s] = P[.][base of site s]; bases is a column-major alignment row read with the given stride
+void lk_tip(const like_t* PT, const uint8_t* bases, int stride, like_t* out, int n);
+//out[s] = out[s] * P[.][base of site s]
+void lk_tip_mul(const like_t* PT, const uint8_t* bases, int stride, like_t* out, int n);
+//out[s] = out[s] * a[s]
+void lk_mul(const like_t* a, like_t* out, int n);
+
+#endif /* _LIKEKERNELS_H */
@@ -179,7 +179,7 @@ double CDFfunGamma(double x, double par[2])
   return IncompleteGamma(par[1]*x,par[0],LnGamma(par[0]));
 }
 
-void definegammaquantiles(int k, double par[2])
+void definegammaquantiles(int k, double par[2], double statevector[])
 {
   int i;
   double mean=0.0;
@@ -21,7 +21,7 @@ double IncompleteGamma (double x, double alpha, double ln_gamma_alpha);
 double PointNormal (double prob);
 double PointChi2 (double prob, double v);
 double CDFfunGamma(double x, double par[2]);
-void definegammaquantiles(int k, double par[2]);
+void definegammaquantiles(int k, double par[2], double statevector[]);
 void initlogfactorial();
 int eigen(int job, double A[], int n, double rr[], double ri[], double vr[], double vi[], double w[]);
 void balance(double mat[], int n, int *low, int *hi, double scale[]);
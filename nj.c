@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "nj.h"
+#include "threadpool.h"
+
+/*
+ * Neighbor-joining in the style of RapidNJ.  Every active cluster keeps a
+ * row of the other clusters sorted by distance, so the search for the
+ * minimum Q value can stop as soon as d(i,j) - (r[i] + max r) exceeds the
+ * best Q found so far.  Row sums are updated incrementally after each join
+ * and the matrix is never compacted: the joined node takes the slot of its
+ * first child and the second slot is marked dead.  Entries for dead
+ * clusters are skipped lazily and purged whenever the number of active
+ * clusters halves.
+ *
+ * Clusters are identified by their node number in the tree.  Leaves keep
+ * their input index and internal nodes are numbered in the order they are
+ * created, which is the same order the old compacting implementation kept
+ * its rows in.  Q values that agree to within the tie tolerance are treated
+ * as equal (incremental row sums do not round exactly like sums recomputed
+ * from scratch, and with four clusters left Q(a,b) and Q(c,d) are always
+ * mathematically equal) and the lowest (i,j) pair among them wins.
+ *
+ * For large matrices the search is split over threads, each scanning an
+ * interleaved subset of the rows.  Every thread keeps all pairs within the
+ * tolerance of its own minimum and the pairs are merged afterwards, so the
+ * joined pair does not depend on the number of threads.
+ */
+
+typedef struct njEntry{
+	double d;
+	int id;
+}njEntry;
+
+typedef struct njCandidate{
+	double q;
+	int lo;
+	int hi;
+}njCandidate;
+
+typedef struct njState{
+	double** distMat;
+	int numslots;
+	int* slotId;
+	int* idSlot;
+	double* r;
+	int** rows;
+	int* rowLen;
+	double rmax;
+	double tolerance;
+	int nthreads;
+}njState;
+
+typedef struct njSearch{
+	njState* state;
+	int tid;
+	double minval;
+	njCandidate* cand;
+	int count;
+	int capacity;
+}njSearch;
+
+static int compare_nj_entry(const void* a, const void* b){
+	const njEntry* x = (const njEntry *)a;
+	const njEntry* y = (const njEntry *)b;
+	if (x->d < y->d) return -1;
+	if (x->d > y->d) return 1;
+	return x->id - y->id;
+}
+static void build_sorted_row(double** distMat, int slot, int* slotId, int numslots, int* row, int* rowLen, njEntry* scratch){
+	int k;
+	int len=0;
+	for(k=0; k<numslots; k++){
+		if (k != slot && slotId[k] != -1){
+			scratch[len].d = distMat[slot][k];
+			scratch[len].id = slotId[k];
+			len++;
+		}
+	}
+	qsort(scratch,len,sizeof(njEntry),compare_nj_entry);
+	for(k=0; k<len; k++){
+		row[k] = scratch[k].id;
+	}
+	rowLen[0] = len;
+}
+static void purge_dead_entries(int** rows, int* rowLen, int* slotId, int* idSlot, int numslots){
+	int s,e,w;
+	for(s=0; s<numslots; s++){
+		if (slotId[s] == -1){
+			continue;
+		}
+		w=0;
+		for(e=0; e<rowLen[s]; e++){
+			if (idSlot[rows[s][e]] != -1){
+				rows[s][w] = rows[s][e];
+				w++;
+			}
+		}
+		rowLen[s] = w;
+	}
+}
+//keeps every pair whose Q is within the tolerance of the smallest Q seen so far
+static void add_candidate(njSearch* search, double q, int lo, int hi){
+	int c,w;
+	double tolerance = search->state->tolerance;
+	if (q < search->minval){
+		search->minval = q;
+		w=0;
+		for(c=0; c<search->count; c++){
+			if (search->cand[c].q <= q + tolerance){
+				search->cand[w] = search->cand[c];
+				w++;
+			}
+		}
+		search->count = w;
+	}
+	if (search->count == search->capacity){
+		search->capacity = 2*search->capacity;
+		search->cand = (njCandidate *)realloc(search->cand,search->capacity*sizeof(njCandidate));
+		if (search->cand == NULL){
+			fprintf(stderr,"Could not allocate memory in 'NJ'\n");
+			exit(1);
+		}
+	}
+	search->cand[search->count].q = q;
+	search->cand[search->count].lo = lo;
+	search->cand[search->count].hi = hi;
+	search->count++;
+}
+static void search_rows(njSearch* search){
+	njState* st = search->state;
+	int s,e,t,id,lo,hi;
+	double D;
+	search->minval = DISTMAX;
+	search->count = 0;
+	for(s=search->tid; s<st->numslots; s=s+st->nthreads){
+		if (st->slotId[s] == -1){
+			continue;
+		}
+		for(e=0; e<st->rowLen[s]; e++){
+			id = st->rows[s][e];
+			t = st->idSlot[id];
+			if (t == -1){
+				continue;
+			}
+			if (st->distMat[s][t] - (st->r[s]+st->rmax) > search->minval + st->tolerance){
+				break;
+			}
+			D = st->distMat[s][t] - (st->r[s]+st->r[t]);
+			if (D <= search->minval + st->tolerance){
+				lo = st->slotId[s] < id ? st->slotId[s] : id;
+				hi = st->slotId[s] < id ? id : st->slotId[s];
+				add_candidate(search,D,lo,hi);
+			}
+		}
+	}
+}
+static void *nj_search_task(void *ptr){
+	search_rows((njSearch *)ptr);
+	return NULL;
+}
+int NJ(node** tree, double** distMat, int clusterSize, int whichTree, int whichTree2, int threads){
+	int i, j, n, s, c, k, newnode, child1, child2;
+	int sa, sb, best_lo, best_hi, last_purge;
+	double minval, u1, dab, dnew;
+	int numslots = clusterSize;
+	int nthreads = threads;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > 0 && nthreads > cpus){
+		nthreads = (int)cpus;
+	}
+	if (nthreads < 1 || clusterSize < NJ_PARALLEL_MIN){
+		nthreads = 1;
+	}
+	njState st;
+	int* slotId = (int *)malloc(numslots*sizeof(int));
+	int* idSlot = (int *)malloc((2*clusterSize-1)*sizeof(int));
+	double* sum = (double *)malloc(numslots*sizeof(double));
+	double* r = (double *)malloc(numslots*sizeof(double));
+	int** rows = (int **)malloc(numslots*sizeof(int *));
+	int* rowLen = (int *)malloc(numslots*sizeof(int));
+	njEntry* scratch = (njEntry *)malloc(numslots*sizeof(njEntry));
+	njSearch* search = (njSearch *)malloc(nthreads*sizeof(njSearch));
+	for(i=0; i<numslots; i++){
+		slotId[i]=i;
+		idSlot[i]=i;
+		tree[whichTree][i].up[0]=tree[whichTree][i].up[1]=-1;
+	}
+	for(i=numslots; i<2*clusterSize-1; i++){
+		idSlot[i]=-1;
+	}
+	//only the upper triangle is trusted, mirror it so rows can be read directly
+	for(i=0; i<numslots; i++){
+		distMat[i][i]=0;
+		for(j=i+1; j<numslots; j++){
+			distMat[j][i]=distMat[i][j];
+		}
+	}
+	for(i=0; i<numslots; i++){
+		sum[i]=0;
+		for(j=0; j<numslots; j++){
+			if (j != i){
+				sum[i] = sum[i] + distMat[i][j];
+			}
+		}
+		rows[i] = (int *)malloc(numslots*sizeof(int));
+		build_sorted_row(distMat,i,slotId,numslots,rows[i],&rowLen[i],scratch);
+	}
+	st.distMat = distMat;
+	st.numslots = numslots;
+	st.slotId = slotId;
+	st.idSlot = idSlot;
+	st.r = r;
+	st.rows = rows;
+	st.rowLen = rowLen;
+	st.nthreads = nthreads;
+	for(k=0; k<nthreads; k++){
+		search[k].state = &st;
+		search[k].tid = k;
+		search[k].capacity = 16;
+		search[k].count = 0;
+		search[k].cand = (njCandidate *)malloc(search[k].capacity*sizeof(njCandidate));
+	}
+	n=clusterSize;
+	last_purge=n;
+	newnode=-1;
+	do{
+		st.rmax = -HUGE_VAL;
+		for(s=0; s<numslots; s++){
+			if (slotId[s] != -1){
+				r[s] = sum[s]/(double)(n-2);
+				if (r[s] > st.rmax){
+					st.rmax = r[s];
+				}
+			}
+		}
+		st.tolerance = NJ_TIE_TOLERANCE*(2.0*fabs(st.rmax)+1.0);
+		threadpool_run(nj_search_task,search,sizeof(njSearch),nthreads);
+		minval = DISTMAX;
+		for(k=0; k<nthreads; k++){
+			if (search[k].minval < minval){
+				minval = search[k].minval;
+			}
+		}
+		if (minval==DISTMAX) {
+			printf("error in 'NJ' (%lf, %i)",minval,n); exit(-1);
+		}
+		best_lo = -1;
+		best_hi = -1;
+		for(k=0; k<nthreads; k++){
+			for(c=0; c<search[k].count; c++){
+				njCandidate* cand = &search[k].cand[c];
+				if (cand->q > minval + st.tolerance){
+					continue;
+				}
+				if (best_lo == -1 || cand->lo < best_lo || (cand->lo == best_lo && cand->hi < best_hi)){
+					best_lo = cand->lo;
+					best_hi = cand->hi;
+				}
+			}
+		}
+		sa = idSlot[best_lo];
+		sb = idSlot[best_hi];
+		newnode=2*clusterSize-n;
+		child1 = best_lo;
+		child2 = best_hi;
+		tree[whichTree][newnode].up[0]=child1;
+		tree[whichTree][newnode].up[1]=child2;
+		tree[whichTree][child1].down=newnode;
+		tree[whichTree][child2].down=newnode;
+		if (tree[whichTree][child1].up[0]==-1){
+			strcpy(tree[whichTree][child1].name,clusters[whichTree2][child1]);
+		}
+		if (tree[whichTree][child2].up[0]==-1){
+			strcpy(tree[whichTree][child2].name,clusters[whichTree2][child2]);
+		}
+		dab = distMat[sa][sb];
+		// HERE WE DISALLOW NEGATIVE BRANCHLENGTHS!  IS THIS THE BEST THING TO DO?
+		tree[whichTree][child2].distance = dab;
+		if ((u1 = (dab +r[sa]-r[sb])/2.0) < MINBL){
+			tree[whichTree][child1].bl = MINBL;
+		}else{
+			tree[whichTree][child1].bl = u1;
+		}
+		if ((tree[whichTree][child2].bl = dab-u1) < MINBL){
+			tree[whichTree][child2].bl = MINBL;
+			tree[whichTree][child2].distance = dab;
+		}
+		//the new node reuses the slot of its first child
+		sum[sa]=0;
+		for(s=0; s<numslots; s++){
+			if (s != sa && s != sb && slotId[s] != -1){
+				dnew = (distMat[sa][s]+distMat[sb][s] - dab)/2.0;
+				sum[s] = sum[s] - distMat[sa][s] - distMat[sb][s] + dnew;
+				sum[sa] = sum[sa] + dnew;
+				distMat[sa][s] = dnew;
+				distMat[s][sa] = dnew;
+			}
+		}
+		idSlot[child1] = -1;
+		idSlot[child2] = -1;
+		slotId[sb] = -1;
+		rowLen[sb] = 0;
+		slotId[sa] = newnode;
+		idSlot[newnode] = sa;
+		build_sorted_row(distMat,sa,slotId,numslots,rows[sa],&rowLen[sa],scratch);
+		n--;
+		if (n <= last_purge/2){
+			purge_dead_entries(rows,rowLen,slotId,idSlot,numslots);
+			last_purge = n;
+		}
+	} while (n>2);
+	if (clusterSize>2){
+		sa=-1;
+		sb=-1;
+		for(s=0; s<numslots; s++){
+			if (slotId[s] != -1){
+				if (sa == -1){
+					sa = s;
+				}else{
+					sb = s;
+				}
+			}
+		}
+		if (slotId[sb] < slotId[sa]){
+			s = sa;
+			sa = sb;
+			sb = s;
+		}
+		newnode=2*clusterSize-2;
+		child1 = slotId[sa];
+		child2 = slotId[sb];
+		tree[whichTree][newnode].up[0]=child1;
+		tree[whichTree][newnode].up[1]=child2;
+		tree[whichTree][newnode].down=-1;
+		tree[whichTree][newnode].bl=-1.0;
+		tree[whichTree][child1].down=newnode;
+		tree[whichTree][child2].down=newnode;
+		if (tree[whichTree][child1].up[0]==-1 ){
+			strcpy(tree[whichTree][child1].name,clusters[whichTree2][child1]);
+		}
+		if (tree[whichTree][child2].up[0]==-1 ){
+			strcpy(tree[whichTree][child2].name,clusters[whichTree2][child2]);
+		}
+		dab = distMat[sa][sb];
+		if (dab > MINBL*2.0)  // HERE WE DISALLOW NEGATIVE BRANCHLENGTHS!  IS THIS THE BEST THING TO DO?
+			tree[whichTree][child1].bl = tree[whichTree][child2].bl = dab/2.0;
+		else tree[whichTree][child1].bl = tree[whichTree][child2].bl = MINBL;
+	}
+	for(i=0; i<numslots; i++){
+		free(rows[i]);
+	}
+	free(rows);
+	free(rowLen);
+	for(k=0; k<nthreads; k++){
+		free(search[k].cand);
+	}
+	free(search);
+	free(scratch);
+	free(slotId);
+	free(idSlot);
+	free(sum);
+	free(r);
+	return(newnode);
+}
@@ -0,0 +1,15 @@
+#ifndef _NJ_H
+#define _NJ_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "global.h"
+
+#define NJ_TIE_TOLERANCE 1e-10
+//below this many sequences the Q search is not worth splitting over threads
+#define NJ_PARALLEL_MIN 512
+
+int NJ(node** tree, double** distMat, int clusterSize, int whichTree, int whichTree2, int threads);
+
+#endif /* _NJ_H */
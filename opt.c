@@ -6,20 +6,12 @@
 #define FREE_ARG char*
 #define ALF 1.0e-4
 #define EPS 3.0e-8
-#define FMAX(a,b) (maxarg1=(a),maxarg2=(b),(maxarg1) > (maxarg2) ?\
-        (maxarg1) : (maxarg2))
-#define SQR(a) ((sqrarg=(a)) == 0.0 ? 0.0 : sqrarg*sqrarg)
-
-double ITMAX;
-double TOLX;
-double TOLX2;
-double STPMX;
-double *dg,*g,*hdg,*pnew,*xi,**hessin; 
-int npar, CENTRALMODE, PRECISIONLEVEL;
-FILE *tempfile;
-static double maxarg1,maxarg2;
-static double sqrarg;
-double oldf0;
+/*functions rather than the usual statement-expression macros so that no
+  scratch variable is shared between threads optimizing different clusters*/
+static inline double nr_fmax(double a, double b){ return a > b ? a : b; }
+static inline double nr_sqr(double a){ return a == 0.0 ? 0.0 : a*a; }
+#define FMAX(a,b) nr_fmax((a),(b))
+#define SQR(a) nr_sqr(a)
 
 void nrerror(char error_text[])
 /* Numerical Recipes standard error handler */
@@ -148,7 +140,7 @@ void free_dmatrix(double **m, long nrl, long ncl)
 	}
 }*/
 int lnsrch_Arr(int n, double xold[], double fold, double g[], double p[], double x[],
-	double *f, double stpmax, int *check, double (*func)(double [] , int, int, int, int, int***), double lowbound[], double upbound[], int whichRoot,int numbase, int root, int numspec, int*** seqArr)
+	double *f, double stpmax, int *check, double (*func)(double [], likeContext*), double lowbound[], double upbound[], likeContext* ctx)
 {
 	int i;
 	double a,alam,alam2,alamin,b,disc,f2,fold2,rhs1,rhs2,slope,sum,temp,
@@ -171,7 +163,7 @@ int lnsrch_Arr(int n, double xold[], double fold, double g[], double p[], double
 	}
         if (test==0.0)
                 return 1;
-	alamin=TOLX2/test;
+	alamin=ctx->nr.TOLX2/test;
 	alam=1.0;
 	for (;;) {
 		for (i=1;i<=n;i++)
@@ -184,7 +176,7 @@ int lnsrch_Arr(int n, double xold[], double fold, double g[], double p[], double
 			x[i] = new1;
 			/*printf("x[i]: %f,newin[i]: %f,xold[i]: %f,alam: %f,p[i]: %f\n",x[i],newin[i],xold[i],alam,p[i]);*/
 			}
-		*f=(*func)(x,whichRoot,numbase,root,numspec,seqArr);
+		*f=(*func)(x,ctx);
 		if (alam < alamin) {
 			for (i=1;i<=n;i++) x[i]=xold[i];
 			*check=1;
@@ -215,26 +207,26 @@ int lnsrch_Arr(int n, double xold[], double fold, double g[], double p[], double
 	}
 }
 
-void doNRinits(int n)
+void doNRinits(nrState* nr, int n)
 
 	{
-	dg=dvector(1,n);
-	g=dvector(1,n);
-	hdg=dvector(1,n);
-	hessin=dmatrix(1,n,1,n);
-	pnew=dvector(1,n);
-	xi=dvector(1,n);
+	nr->dg=dvector(1,n);
+	nr->g=dvector(1,n);
+	nr->hdg=dvector(1,n);
+	nr->hessin=dmatrix(1,n,1,n);
+	nr->pnew=dvector(1,n);
+	nr->xi=dvector(1,n);
 	}
 
-void freeNRinits(int n)
+void freeNRinits(nrState* nr, int n)
 
 {
-    free_dvector(dg, 1);
-    free_dvector(g,1);
-    free_dvector(hdg,1);
-    free_dmatrix(hessin,1,1);
-    free_dvector(pnew,1);
-    free_dvector(xi,1);
+    free_dvector(nr->dg, 1);
+    free_dvector(nr->g,1);
+    free_dvector(nr->hdg,1);
+    free_dmatrix(nr->hessin,1,1);
+    free_dvector(nr->pnew,1);
+    free_dvector(nr->xi,1);
 }
 
 	
@@ -318,26 +310,25 @@ void freeNRinits(int n)
 	//FREEALL
 }*/
 void dfpmin_Arr(double p[], int n, double gtol, int *iter, double *fret,
-	double(*func)(double [],int, int, int,int,int***), void (*dfunc)(double [], double [],double [], double [], double(*fu)(double [], int,int,int,int,int***), int, int, int, int, int***), double lowbound[], double upbound[], int whichRoot, int numbase, int root, int numspec, int*** seqArr)
+	double(*func)(double [], likeContext*), void (*dfunc)(double [], double [],double [], double [], double(*fu)(double [], likeContext*), likeContext*), double lowbound[], double upbound[], likeContext* ctx)
 {
-	int lnsrch_Arr(int n, double xold[], double fold, double g[], double p[], double x[],
-		 double *f, double stpmax, int *check, double (*func)(double [],int,int,int,int,int***), double lowbound[], double upbound[],int whichRoot, int numbase, int root, int numspec, int*** seqArr);
 	int check,i,its,j;
 	double den,fac,fad,fae,fp,stpmax,sum=0.0,sumdg,sumxi,temp,test;
+	double *dg=ctx->nr.dg, *g=ctx->nr.g, *hdg=ctx->nr.hdg, *pnew=ctx->nr.pnew, *xi=ctx->nr.xi, **hessin=ctx->nr.hessin;
 
-	fp=(*func)(p,whichRoot,numbase,root,numspec,seqArr);
-	(*dfunc)(p,g, lowbound, upbound, func,whichRoot,numbase,root,numspec,seqArr);
+	fp=(*func)(p,ctx);
+	(*dfunc)(p,g, lowbound, upbound, func,ctx);
 	for (i=1;i<=n;i++) {
 		for (j=1;j<=n;j++) hessin[i][j]=0.0;
 		hessin[i][i]=1.0;
 		xi[i] = -g[i];
 		sum += p[i]*p[i];
 	}
-	stpmax=STPMX*FMAX(sqrt(sum),(double)n);
-	for (its=1;its<=ITMAX;its++) {
+	stpmax=ctx->nr.STPMX*FMAX(sqrt(sum),(double)n);
+	for (its=1;its<=ctx->nr.ITMAX;its++) {
 		*iter=its;
 		/*printf ("A: "); for (i=1;i<=n;i++) printf("%f ",g[i]); printf("\n");*/
-		if (lnsrch_Arr(n,p,fp,g,xi,pnew,fret,stpmax,&check,func,lowbound,upbound,whichRoot,numbase,root,numspec,seqArr) == -1) /*MY CODE*/
+		if (lnsrch_Arr(n,p,fp,g,xi,pnew,fret,stpmax,&check,func,lowbound,upbound,ctx) == -1) /*MY CODE*/
 			return;		fp = *fret;
 		for (i=1;i<=n;i++) {
 			xi[i]=pnew[i]-p[i];
@@ -348,12 +339,12 @@ void dfpmin_Arr(double p[], int n, double gtol, int *iter, double *fret,
 			temp=fabs(xi[i])/FMAX(fabs(p[i]),1.0);
 			if (temp > test) test=temp;
 		}
-		if (test < TOLX) {
+		if (test < ctx->nr.TOLX) {
 			/*FREEALL*/
 			return;
 		}
 		for (i=1;i<=n;i++) dg[i]=g[i];
-		(*dfunc)(p,g,lowbound,upbound, func, whichRoot, numbase, root, numspec,  seqArr);
+		(*dfunc)(p,g,lowbound,upbound, func, ctx);
 	/*	printf ("C: "); for (i=1;i<=n;i++) printf("%f ",g[i]); printf("\n");*/
 		test=0.0;
 		den=FMAX(*fret,1.0);
@@ -446,7 +437,7 @@ void dfpmin_Arr(double p[], int n, double gtol, int *iter, double *fret,
    }
 }*/
 void Yanggradient_Arr (int n, double x[], double f0, double g[],
-    double (*fun)(double x[] ,int, int, int, int, int***), double space[], int central, double lowbound[], double upbound[],int whichRoot,int numbase, int root, int numspec, int*** seqArr)
+    double (*fun)(double x[], likeContext*), double space[], int central, double lowbound[], double upbound[], likeContext* ctx)
 {
 
 	/*f0=fun(x) is given for Central=0*/
@@ -460,11 +451,11 @@ void Yanggradient_Arr (int n, double x[], double f0, double g[],
 	 eh=pow(eh01*(fabs(x[i])+1), 0.67);
 	 x0[i]-=eh; x1[i]+=eh;
 	if (x0[i]<lowbound[i])
-		{x1[i]+=eh; g[i] = ((*fun)(x1,whichRoot,numbase,root,numspec,seqArr)-f0)/(eh*2.0);}
+		{x1[i]+=eh; g[i] = ((*fun)(x1,ctx)-f0)/(eh*2.0);}
 	else if (x1[i]>upbound[i])
-		{x0[i]-=eh; g[i] = (f0-(*fun)(x0,whichRoot,numbase,root,numspec,seqArr))/(eh*2.0);}
+		{x0[i]-=eh; g[i] = (f0-(*fun)(x0,ctx))/(eh*2.0);}
 	else
-	 	g[i] = ((*fun)(x1,whichRoot,numbase,root,numspec,seqArr) - (*fun)(x0,whichRoot,numbase,root,numspec,seqArr))/(eh*2.0);
+	 	g[i] = ((*fun)(x1,ctx) - (*fun)(x0,ctx))/(eh*2.0);
 	if (x[i] <= lowbound[i] && g[i] > 0.0)
 		g[i] = 0.0;
 	else if (x[i] >= upbound[i] && g[i] < 0.0)
@@ -479,12 +470,12 @@ void Yanggradient_Arr (int n, double x[], double f0, double g[],
 	if (x1[i]+eh>upbound[i])
 		{
 	 	x1[i]-=eh;
-	 	g[i] = (f0-(*fun)(x1,whichRoot,numbase,root,numspec,seqArr))/eh;
+	 	g[i] = (f0-(*fun)(x1,ctx))/eh;
 	 	}
 	else
 		{
 	 	x1[i]+=eh;
-	 	g[i] = ((*fun)(x1,whichRoot,numbase,root,numspec,seqArr)-f0)/eh;
+	 	g[i] = ((*fun)(x1,ctx)-f0)/eh;
 	 	}
 	if (x[i] <= lowbound[i] && g[i] > 0.0)
 		g[i] = 0.0;
@@ -531,23 +522,23 @@ void Yanggradient_Arr (int n, double x[], double f0, double g[],
 	oldf0 = f0;
 //	printf(" Like (grad): %f\n",-oldf0);
 	}*/
-void getgradient_Arr(double invec[], double outvec[], double lowbound[], double upbound[], double(*func)(double [], int, int, int, int, int***), int whichRoot, int numbase, int root, int numspec, int*** seqArr)
+void getgradient_Arr(double invec[], double outvec[], double lowbound[], double upbound[], double(*func)(double [], likeContext*), likeContext* ctx)
 
 	{
 	int i;
-	static double space[200];
+	nrState* nr = &ctx->nr;
 	double f0, arbitrarysum = 0.0;
 
-	f0 = func(invec,whichRoot,numbase,root,numspec,seqArr);
-    if (CENTRALMODE > 0 && PRECISIONLEVEL >1)
-		Yanggradient_Arr(npar, invec, f0, outvec, func, space, 1, lowbound, upbound, whichRoot,numbase,root,numspec,seqArr);
+	f0 = func(invec,ctx);
+    if (nr->CENTRALMODE > 0 && nr->PRECISIONLEVEL >1)
+		Yanggradient_Arr(nr->npar, invec, f0, outvec, func, nr->space, 1, lowbound, upbound, ctx);
 	else 
-		Yanggradient_Arr(npar, invec, f0, outvec, func, space, 0, lowbound, upbound, whichRoot,numbase,root,numspec,seqArr);
+		Yanggradient_Arr(nr->npar, invec, f0, outvec, func, nr->space, 0, lowbound, upbound, ctx);
 //	printf("GRADIENT:\n");
 	 /*if (NULL==(tempfile=fopen("tempfile","w"))){
   		puts ("Kan ikke aabne tempfile!");
    		exit(-1);}*/
-	for(i=1; i<=npar; i++)
+	for(i=1; i<=nr->npar; i++)
 		{
 	/*	fprintf(tempfile,"%f ",invec[i]);  */
 //		printf(" %5f",outvec[i]);
@@ -556,16 +547,16 @@ void getgradient_Arr(double invec[], double outvec[], double lowbound[], double
 		/*else printf("*");*/
 		}
   /* 	fclose(tempfile);*/
-	if (CENTRALMODE == 0 && fabs(oldf0-f0) < 0.1)
+	if (nr->CENTRALMODE == 0 && fabs(nr->oldf0-f0) < 0.1)
 		{
-		CENTRALMODE = 1;
+		nr->CENTRALMODE = 1;
 		/*printf("Changing to central method\n");*/
 		}
-	else if (CENTRALMODE > 0 && fabs(oldf0-f0) > 1.0)
-		CENTRALMODE = 0;
-	else if (arbitrarysum < 0.01*npar)
-		CENTRALMODE = 2;
-	oldf0 = f0;
+	else if (nr->CENTRALMODE > 0 && fabs(nr->oldf0-f0) > 1.0)
+		nr->CENTRALMODE = 0;
+	else if (arbitrarysum < 0.01*nr->npar)
+		nr->CENTRALMODE = 2;
+	nr->oldf0 = f0;
 //	printf(" Like (grad): %f\n",-oldf0);
 	}
 /*Call nrinits before calling this the first time.  Precision level can be 0, 1 or 2*/
@@ -614,38 +605,39 @@ void getgradient_Arr(double invec[], double outvec[], double lowbound[], double
 	//}while (CENTRALMODE < 2 && PRECISIONLEVEL == 2);
 	return -fret;
 	}*/
-double findmax_Arr(double newinvecter[], double lowbound[], double upbound[], int n, double (*fun)(double x[], int, int, int, int, int***), int precisionlevel, int whichRoot, int numbase, int root, int numspec, int*** seqArr)
+double findmax_Arr(double newinvecter[], double lowbound[], double upbound[], int n, double (*fun)(double x[], likeContext*), int precisionlevel, likeContext* ctx)
 
 	{
 
 	double gtol, fret;
 	int i, iter;
+	nrState* nr = &ctx->nr;
 	
-	oldf0 = 0.0;
-	npar = n;
-    PRECISIONLEVEL = precisionlevel;
+	nr->oldf0 = 0.0;
+	nr->npar = n;
+    nr->PRECISIONLEVEL = precisionlevel;
         
-        if (PRECISIONLEVEL == 2)
+        if (nr->PRECISIONLEVEL == 2)
             {
             gtol = 0.0000000001;
-            ITMAX = 500;
-            TOLX = 4*EPS;
-            TOLX2  = 1.0e-7;
-            STPMX = 200.0;
+            nr->ITMAX = 500;
+            nr->TOLX = 4*EPS;
+            nr->TOLX2  = 1.0e-7;
+            nr->STPMX = 200.0;
             }
-        else if (PRECISIONLEVEL == 1){
+        else if (nr->PRECISIONLEVEL == 1){
             gtol = 0.0001;
-            ITMAX = 100;
-            TOLX = 10*EPS;
-            TOLX2  = 1.0e-5;
-            STPMX = 50.0;
+            nr->ITMAX = 100;
+            nr->TOLX = 10*EPS;
+            nr->TOLX2  = 1.0e-5;
+            nr->STPMX = 50.0;
             }
         else {
             gtol = 0.01;
-            ITMAX = 50;
-            TOLX = 100*EPS;
-            TOLX2  = 1.0e-3;
-            STPMX = 10.0;
+            nr->ITMAX = 50;
+            nr->TOLX = 100*EPS;
+            nr->TOLX2  = 1.0e-3;
+            nr->STPMX = 10.0;
             }
 		for (i=1; i<=n; i++){
             if (newinvecter[i]==lowbound[i])
@@ -655,7 +647,7 @@ double findmax_Arr(double newinvecter[], double lowbound[], double upbound[], in
         }
         
 	//do    {
-	dfpmin_Arr(newinvecter, npar, gtol, &iter, &fret, fun, getgradient_Arr, lowbound, upbound, whichRoot,numbase,root,numspec,seqArr);
+	dfpmin_Arr(newinvecter, nr->npar, gtol, &iter, &fret, fun, getgradient_Arr, lowbound, upbound, ctx);
 	//}while (CENTRALMODE < 2 && PRECISIONLEVEL == 2);
 	//printf("in findmax fret: %lf\n",-fret);
 	return -fret;
@@ -17,6 +17,11 @@ static struct option long_options[]=
 	{"number_of_descendants", required_argument, 0, 'p'},
 	{"root_seqs", required_argument, 0, 'q'},
 	{"set_average", required_argument, 0, 'a'},
+	{"distance_cache", required_argument, 0, 'm'},
+	{"tree_method", required_argument, 0, 'g'},
+	{"root_method", required_argument, 0, 'e'},
+	{"refresh_roots", no_argument, 0, 'j'},
+	{"max_msa_members", required_argument, 0, 'x'},
 	{0,0,0,0}
 };
 
@@ -36,6 +41,11 @@ char usage[] = "\nancestralclust [OPTIONS]\n\
 	-p, --number_of_descendants		number of descendants to require to cut branch [default: 10]\n\
 	-q, --root_seqs				file to print root sequences\n\
 	-a, --set_average			set the average branch length [double > 0, default: calculates averge]\n\
+	-m, --distance_cache			memory in MB for the pairwise distance cache shared across iterations [default: 256, 0 disables]\n\
+	-g, --tree_method			tree for the initial sequences [nj, upgma or kmeans, default: nj; every method still computes all pairwise seed distances]\n\
+	-e, --root_method			how cluster roots are inferred [ml, fixed-ml, parsimony, consensus or medoid, default: ml]\n\
+	-j, --refresh_roots			re-call each root's bases from the members assigned to it as assignment goes on\n\
+	-x, --max_msa_members			build each cluster's tree, alignment and root from at most this many diverse members [> 3, default: 0, no cap]\n\
 	\n";
 
 void print_help_statement(){
@@ -51,7 +61,7 @@ void parse_options(int argc, char **argv, Options *opt){
 		exit(0);
 	}
 	while(1){
-		c=getopt_long(argc,argv,"hfun:b:d:i:t:c:o:l:p:r:q:a:",long_options, &option_index);
+		c=getopt_long(argc,argv,"hfujn:b:d:i:t:c:o:l:p:r:q:a:m:g:e:x:",long_options, &option_index);
 		if (c==-1) break;
 		switch(c){
 			case 'h':
@@ -123,6 +133,50 @@ void parse_options(int argc, char **argv, Options *opt){
 				success = sscanf(optarg, "%s", opt->root);
 				if (!success)
 					fprintf(stderr, "Invalid root file\n");
+				break;
+			case 'm':
+				success = sscanf(optarg, "%d", &(opt->distance_cache_mb));
+				if (!success)
+					fprintf(stderr, "Could not read distance cache size\n");
+				break;
+			case 'g':
+				if (strcmp(optarg,"nj")==0){
+					opt->tree_method=TREE_METHOD_NJ;
+				}else if (strcmp(optarg,"upgma")==0){
+					opt->tree_method=TREE_METHOD_UPGMA;
+				}else if (strcmp(optarg,"kmeans")==0){
+					opt->tree_method=TREE_METHOD_KMEANS;
+				}else{
+					fprintf(stderr, "Invalid tree method %s [nj, upgma or kmeans]\n",optarg);
+					exit(1);
+				}
+				break;
+			case 'j':
+				opt->refresh_roots=1;
+				break;
+			case 'x':
+				success = sscanf(optarg, "%d", &(opt->max_msa_members));
+				if (!success || (opt->max_msa_members != 0 && opt->max_msa_members < 4)){
+					fprintf(stderr, "Invalid maximum number of MSA members %s [0 or > 3]\n",optarg);
+					exit(1);
+				}
+				break;
+			case 'e':
+				if (strcmp(optarg,"ml")==0){
+					opt->root_method=ROOT_METHOD_ML;
+				}else if (strcmp(optarg,"fixed-ml")==0){
+					opt->root_method=ROOT_METHOD_FIXED_ML;
+				}else if (strcmp(optarg,"parsimony")==0){
+					opt->root_method=ROOT_METHOD_PARSIMONY;
+				}else if (strcmp(optarg,"consensus")==0){
+					opt->root_method=ROOT_METHOD_CONSENSUS;
+				}else if (strcmp(optarg,"medoid")==0){
+					opt->root_method=ROOT_METHOD_MEDOID;
+				}else{
+					fprintf(stderr, "Invalid root method %s [ml, fixed-ml, parsimony, consensus or medoid]\n",optarg);
+					exit(1);
+				}
+				break;
 		}
 	}
 }
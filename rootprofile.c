@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rootprofile.h"
+
+static int base_index(char c){
+	switch(c){
+		case 'A': case 'a': return 0;
+		case 'C': case 'c': return 1;
+		case 'G': case 'g': return 2;
+		case 'T': case 't': return 3;
+	}
+	return -1;
+}
+static rootProfile* rootprofile_alloc(int number_of_roots, int* length){
+	int i;
+	rootProfile* rp = (rootProfile *)malloc(sizeof(rootProfile));
+	if (rp == NULL){
+		fprintf(stderr,"Could not allocate root profile\n");
+		exit(1);
+	}
+	rp->number_of_roots = number_of_roots;
+	rp->length = (int *)malloc(number_of_roots*sizeof(int));
+	rp->counts = (int **)malloc(number_of_roots*sizeof(int *));
+	rp->added = (int *)calloc(number_of_roots,sizeof(int));
+	if (rp->length == NULL || rp->counts == NULL || rp->added == NULL){
+		fprintf(stderr,"Could not allocate root profile\n");
+		exit(1);
+	}
+	for(i=0; i<number_of_roots; i++){
+		rp->length[i] = length[i];
+		rp->counts[i] = (int *)calloc(4*(size_t)length[i]+4,sizeof(int));
+		if (rp->counts[i] == NULL){
+			fprintf(stderr,"Could not allocate root profile\n");
+			exit(1);
+		}
+	}
+	return rp;
+}
+//prior[i] is how many sequences root i stands for; its own bases start with that many votes
+rootProfile* rootprofile_new(char** rootSeqs, int number_of_roots, int* prior){
+	int i, j, b;
+	int* length = (int *)malloc((number_of_roots+1)*sizeof(int));
+	for(i=0; i<number_of_roots; i++){
+		length[i] = strlen(rootSeqs[i]);
+	}
+	rootProfile* rp = rootprofile_alloc(number_of_roots,length);
+	free(length);
+	for(i=0; i<number_of_roots; i++){
+		for(j=0; j<rp->length[i]; j++){
+			if ((b=base_index(rootSeqs[i][j])) != -1){
+				rp->counts[i][4*j+b] = prior[i];
+			}
+		}
+	}
+	return rp;
+}
+rootProfile* rootprofile_delta(rootProfile* rp){
+	return rootprofile_alloc(rp->number_of_roots,rp->length);
+}
+void rootprofile_free(rootProfile* rp){
+	int i;
+	if (rp == NULL){
+		return;
+	}
+	for(i=0; i<rp->number_of_roots; i++){
+		free(rp->counts[i]);
+	}
+	free(rp->counts);
+	free(rp->length);
+	free(rp->added);
+	free(rp);
+}
+void rootprofile_add(rootProfile* rp, int whichRoot, const char* ops, int number_of_ops, const char* seq){
+	int k, b, pos=0, text=0;
+	int* counts = rp->counts[whichRoot];
+	for(k=0; k<number_of_ops && pos<rp->length[whichRoot]; k++){
+		switch(ops[k]){
+			case 'M':
+			case 'X':
+				if ((b=base_index(seq[text])) != -1){
+					counts[4*pos+b]++;
+				}
+				pos++;
+				text++;
+				break;
+			case 'I':
+				text++;
+				break;
+			case 'D':
+				pos++;
+				break;
+			default:
+				break;
+		}
+	}
+	rp->added[whichRoot]++;
+}
+//adds delta into rp and leaves delta empty for the next chunk
+void rootprofile_merge(rootProfile* rp, rootProfile* delta){
+	int i, j;
+	for(i=0; i<rp->number_of_roots; i++){
+		if (delta->added[i] == 0){
+			continue;
+		}
+		for(j=0; j<4*rp->length[i]; j++){
+			rp->counts[i][j] += delta->counts[i][j];
+			delta->counts[i][j] = 0;
+		}
+		rp->added[i] += delta->added[i];
+		delta->added[i] = 0;
+	}
+}
+//re-calls the roots that gained members, keeping the current base on ties; returns how many bases changed
+int rootprofile_refresh(rootProfile* rp, char** rootSeqs){
+	const char bases[4] = {'A','C','G','T'};
+	int i, j, b, best, changed=0;
+	int* counts;
+	for(i=0; i<rp->number_of_roots; i++){
+		if (rp->added[i] == 0){
+			continue;
+		}
+		counts = rp->counts[i];
+		for(j=0; j<rp->length[i]; j++){
+			best = base_index(rootSeqs[i][j]);
+			for(b=0; b<4; b++){
+				if (best == -1 || counts[4*j+b] > counts[4*j+best]){
+					best = b;
+				}
+			}
+			if (counts[4*j+best] > 0 && base_index(rootSeqs[i][j]) != best){
+				rootSeqs[i][j] = bases[best];
+				changed++;
+			}
+		}
+		rp->added[i] = 0;
+	}
+	return changed;
+}
+void rootcigar_set(rootCigar* cigar, const char* ops, int number_of_ops){
+	if (number_of_ops > cigar->alloc){
+		free(cigar->ops);
+		cigar->alloc = number_of_ops;
+		cigar->ops = (char *)malloc(cigar->alloc*sizeof(char));
+		if (cigar->ops == NULL){
+			fprintf(stderr,"Could not allocate root alignment\n");
+			exit(1);
+		}
+	}
+	memcpy(cigar->ops,ops,number_of_ops*sizeof(char));
+	cigar->number_of_ops = number_of_ops;
+}
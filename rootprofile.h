@@ -0,0 +1,44 @@
+#ifndef _ROOTPROFILE_H
+#define _ROOTPROFILE_H
+
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * Base counts at every position of each cluster root.  The profile starts
+ * with the reconstructed root itself counted once for each sequence the
+ * root was inferred from.  Members assigned later add the bases their
+ * pairwise alignment to the root puts on each root position.  A refresh
+ * then re-calls the majority base, only for roots that gained members.
+ * Root lengths never change: bases a member inserts between root
+ * positions are not counted.  Assignment threads each fill a delta profile
+ * of the same shape, which is merged once the threads are joined.
+ */
+typedef struct rootProfile{
+	int number_of_roots;
+	int* length;
+	int** counts; //4 per root position
+	int* added; //members counted since the last refresh
+}rootProfile;
+
+/*
+ * The operations of one member-to-root alignment, kept while a member is
+ * compared with every root so the closest root's alignment can be counted
+ * without aligning again.  The buffer only grows.
+ */
+typedef struct rootCigar{
+	char* ops;
+	int number_of_ops;
+	int alloc;
+}rootCigar;
+
+rootProfile* rootprofile_new(char** rootSeqs, int number_of_roots, int* prior);
+rootProfile* rootprofile_delta(rootProfile* rp);
+void rootprofile_free(rootProfile* rp);
+//ops are the alignment's M/X/I/D operations with the root as pattern and seq as text
+void rootprofile_add(rootProfile* rp, int whichRoot, const char* ops, int number_of_ops, const char* seq);
+void rootprofile_merge(rootProfile* rp, rootProfile* delta);
+int rootprofile_refresh(rootProfile* rp, char** rootSeqs);
+void rootcigar_set(rootCigar* cigar, const char* ops, int number_of_ops);
+
+#endif /* _ROOTPROFILE_H */
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "sitepatterns.h"
+
+//FNV-1a over one column of the column-major alignment
+static uint64_t hash_column(const uint8_t* col, int number_of_seqs){
+	int i;
+	uint64_t h = 1469598103934665603ULL;
+	for(i=0; i<number_of_seqs; i++){
+		h ^= col[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+sitePatterns* sitepatterns_new(alignmentMatrix* aln){
+	int i, site, slot, p;
+	int nseq = aln->number_of_seqs;
+	int numbase = aln->numbase;
+	int table_size = 1;
+	uint64_t h;
+	const uint8_t* col;
+	sitePatterns* sp = (sitePatterns *)malloc(sizeof(sitePatterns));
+	if (sp == NULL){
+		fprintf(stderr,"Could not allocate site patterns\n");
+		exit(1);
+	}
+	while(table_size < 2*numbase){
+		table_size *= 2;
+	}
+	int* table = (int *)malloc(table_size*sizeof(int));
+	sp->weight = (int *)malloc((numbase > 0 ? numbase : 1)*sizeof(int));
+	sp->siteToPattern = (int *)malloc((numbase > 0 ? numbase : 1)*sizeof(int));
+	sp->patterns.number_of_seqs = nseq;
+	sp->patterns.cols = (uint8_t *)malloc(((size_t)(numbase > 0 ? numbase : 1))*nseq*sizeof(uint8_t));
+	if (table == NULL || sp->weight == NULL || sp->siteToPattern == NULL || sp->patterns.cols == NULL){
+		fprintf(stderr,"Could not allocate site patterns\n");
+		exit(1);
+	}
+	for(i=0; i<table_size; i++){
+		table[i] = -1;
+	}
+	sp->number_of_sites = numbase;
+	p = 0;
+	for(site=0; site<numbase; site++){
+		col = aln->cols+(size_t)site*nseq;
+		h = hash_column(col,nseq);
+		slot = (int)(h & (uint64_t)(table_size-1));
+		//linear probing; a slot holds the pattern number of the first column that landed there
+		while(table[slot] != -1 && memcmp(sp->patterns.cols+(size_t)table[slot]*nseq,col,nseq) != 0){
+			slot = (slot+1) & (table_size-1);
+		}
+		if (table[slot] == -1){
+			table[slot] = p;
+			memcpy(sp->patterns.cols+(size_t)p*nseq,col,nseq);
+			sp->weight[p] = 0;
+			p++;
+		}
+		sp->weight[table[slot]]++;
+		sp->siteToPattern[site] = table[slot];
+	}
+	free(table);
+	sp->number_of_patterns = p;
+	sp->patterns.numbase = p;
+	return sp;
+}
+void sitepatterns_free(sitePatterns* sp){
+	if (sp == NULL){
+		return;
+	}
+	free(sp->patterns.cols);
+	free(sp->weight);
+	free(sp->siteToPattern);
+	free(sp);
+}
@@ -0,0 +1,26 @@
+#ifndef _SITEPATTERNS_H
+#define _SITEPATTERNS_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "global.h"
+
+/*
+ * An alignment with identical columns collapsed.  patterns holds one column
+ * per distinct site pattern, in order of first appearance, weight[p] counts
+ * how many aligned columns share pattern p, and siteToPattern maps every
+ * original column back to its pattern so per-pattern results can be
+ * expanded to the full alignment length.
+ */
+typedef struct sitePatterns{
+	int number_of_sites;
+	int number_of_patterns;
+	alignmentMatrix patterns;
+	int* weight;
+	int* siteToPattern;
+}sitePatterns;
+
+sitePatterns* sitepatterns_new(alignmentMatrix* aln);
+void sitepatterns_free(sitePatterns* sp);
+
+#endif /* _SITEPATTERNS_H */
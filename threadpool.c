@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "threadpool.h"
+#include "global.h"
+
+typedef struct poolBatch{
+	void* (*fn)(void *);
+	char* args;
+	size_t arg_size;
+	int n;
+	int claimed; //tasks handed out so far
+	int pending; //tasks not yet finished
+	struct poolBatch* link;
+}poolBatch;
+
+typedef struct threadPool{
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t finished;
+	poolBatch* head; //batches with tasks left to claim, oldest first
+	poolBatch* tail;
+	int stop;
+	int workers;
+	pthread_t* threads;
+	int* cpus; //core each worker is pinned to, -1 when not pinned
+#ifdef __linux__
+	cpu_set_t mask; //affinity the process started with
+#endif
+}threadPool;
+
+static threadPool* pool = NULL;
+static __thread void* scratch = NULL;
+static __thread size_t scratch_size = 0;
+static __thread int pinned_cpu = -1;
+static __thread int pool_thread = 0; //set in the pool's own workers
+
+//both called with the lock held
+static void unlink_batch(poolBatch* b){
+	poolBatch* prev = NULL;
+	poolBatch* cur = pool->head;
+	while(cur != b){
+		prev = cur;
+		cur = cur->link;
+	}
+	if (prev == NULL){
+		pool->head = b->link;
+	}else{
+		prev->link = b->link;
+	}
+	if (pool->tail == b){
+		pool->tail = prev;
+	}
+}
+static void run_one(poolBatch* b){
+	int i = b->claimed;
+	b->claimed++;
+	if (b->claimed == b->n){
+		unlink_batch(b);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	b->fn(b->args + (size_t)i*b->arg_size);
+	pthread_mutex_lock(&pool->lock);
+	b->pending--;
+	if (b->pending == 0){
+		pthread_cond_broadcast(&pool->finished);
+	}
+}
+static void* pool_worker(void* ptr){
+	pinned_cpu = *(int *)ptr;
+	pool_thread = 1;
+	threadpool_pin();
+	pthread_mutex_lock(&pool->lock);
+	while(1){
+		while(pool->head == NULL && pool->stop == 0){
+			pthread_cond_wait(&pool->work,&pool->lock);
+		}
+		if (pool->head == NULL){
+			break;
+		}
+		run_one(pool->head);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	free(scratch);
+	return NULL;
+}
+void threadpool_start(int threads){
+	int k, cpu;
+	if (pool != NULL || threads < 2){
+		return;
+	}
+	pool = (threadPool *)malloc(sizeof(threadPool));
+	if (pool == NULL){
+		fprintf(stderr,"Could not allocate thread pool\n");
+		exit(1);
+	}
+	pthread_mutex_init(&pool->lock,NULL);
+	pthread_cond_init(&pool->work,NULL);
+	pthread_cond_init(&pool->finished,NULL);
+	pool->head = NULL;
+	pool->tail = NULL;
+	pool->stop = 0;
+	pool->workers = threads;
+	pool->threads = (pthread_t *)malloc(pool->workers*sizeof(pthread_t));
+	pool->cpus = (int *)malloc(pool->workers*sizeof(int));
+	if (pool->threads == NULL || pool->cpus == NULL){
+		fprintf(stderr,"Could not allocate thread pool\n");
+		exit(1);
+	}
+	for(k=0; k<pool->workers; k++){
+		pool->cpus[k] = -1;
+	}
+#ifdef __linux__
+	//workers take the first cores of the mask, but only if every worker gets its own
+	if (sched_getaffinity(0,sizeof(cpu_set_t),&pool->mask) == 0 && CPU_COUNT(&pool->mask) >= threads){
+		k = 0;
+		for(cpu=0; cpu<CPU_SETSIZE && k<pool->workers; cpu++){
+			if (CPU_ISSET(cpu,&pool->mask)){
+				pool->cpus[k] = cpu;
+				k++;
+			}
+		}
+	}
+#endif
+	size_t default_stack_size;
+	pthread_attr_t stack_size_custom_attr;
+	pthread_attr_init(&stack_size_custom_attr);
+	pthread_attr_getstacksize(&stack_size_custom_attr,&default_stack_size);
+	if (default_stack_size < MIN_REQ_SSIZE){
+		pthread_attr_setstacksize(&stack_size_custom_attr,(size_t)MIN_REQ_SSIZE);
+	}
+	for(k=0; k<pool->workers; k++){
+		pthread_create(&pool->threads[k], &stack_size_custom_attr, pool_worker, &pool->cpus[k]);
+	}
+	pthread_attr_destroy(&stack_size_custom_attr);
+}
+void threadpool_stop(void){
+	int k;
+	if (pool != NULL){
+		pthread_mutex_lock(&pool->lock);
+		pool->stop = 1;
+		pthread_cond_broadcast(&pool->work);
+		pthread_mutex_unlock(&pool->lock);
+		for(k=0; k<pool->workers; k++){
+			pthread_join(pool->threads[k], NULL);
+		}
+		pthread_mutex_destroy(&pool->lock);
+		pthread_cond_destroy(&pool->work);
+		pthread_cond_destroy(&pool->finished);
+		free(pool->threads);
+		free(pool->cpus);
+		free(pool);
+		pool = NULL;
+	}
+	free(scratch);
+	scratch = NULL;
+	scratch_size = 0;
+}
+void threadpool_run(void* (*fn)(void *), void* args, size_t arg_size, int n){
+	int i;
+	if (pool == NULL || n < 2){
+		for(i=0; i<n; i++){
+			fn((char *)args + (size_t)i*arg_size);
+		}
+		return;
+	}
+	poolBatch b;
+	b.fn = fn;
+	b.args = (char *)args;
+	b.arg_size = arg_size;
+	b.n = n;
+	b.claimed = 0;
+	b.pending = n;
+	b.link = NULL;
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail == NULL){
+		pool->head = &b;
+	}else{
+		pool->tail->link = &b;
+	}
+	pool->tail = &b;
+	pthread_cond_broadcast(&pool->work);
+	//a worker that submits a batch runs that batch's tasks while it waits, so nested batches
+	//always make progress; it takes no other batch's tasks, so it is never held up by unrelated work
+	while(pool_thread && b.claimed < b.n){
+		run_one(&b);
+	}
+	while(b.pending > 0){
+		pthread_cond_wait(&pool->finished,&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+void* threadpool_scratch(size_t size){
+	if (size > scratch_size){
+		free(scratch);
+		scratch = malloc(size);
+		if (scratch == NULL){
+			fprintf(stderr,"Could not allocate scratch buffer\n");
+			exit(1);
+		}
+		scratch_size = size;
+	}
+	return scratch;
+}
+void threadpool_unpin(void){
+#ifdef __linux__
+	if (pool != NULL && pinned_cpu >= 0){
+		pthread_setaffinity_np(pthread_self(),sizeof(cpu_set_t),&pool->mask);
+	}
+#endif
+}
+void threadpool_pin(void){
+#ifdef __linux__
+	cpu_set_t one;
+	if (pinned_cpu >= 0){
+		CPU_ZERO(&one);
+		CPU_SET(pinned_cpu,&one);
+		pthread_setaffinity_np(pthread_self(),sizeof(cpu_set_t),&one);
+	}
+#endif
+}
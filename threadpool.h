@@ -0,0 +1,36 @@
+#ifndef _THREADPOOL_H
+#define _THREADPOOL_H
+
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * One pool of worker threads for the whole run, started once from main.
+ * Work is handed over as a batch of n tasks, fn(args + i*arg_size), which
+ * are the same per-thread structs the phases used to pass to
+ * pthread_create.  Batches of two or more tasks only run on the workers,
+ * whose stacks are at least MIN_REQ_SSIZE: the main thread submits a batch
+ * and sleeps until it is done.  A task that submits a batch of its own runs tasks of that
+ * batch itself while it waits, so nested phases never starve the pool and
+ * never run more threads than the pool has.  Batches of one task, and
+ * every batch when the pool was started with fewer than two threads, run
+ * on the calling thread; on the main thread that is the process stack,
+ * which is no smaller than the default thread stack.
+ * Each worker is pinned to a core of the process's affinity mask when
+ * there is one per worker; the main thread keeps the whole mask.
+ * threadpool_unpin lets a worker that starts an OpenMP team spread it over
+ * the whole mask.  Every thread, main included, has a scratch arena that
+ * grows to the largest request made on it.
+ */
+
+//starts threads workers, or none when threads < 2
+void threadpool_start(int threads);
+void threadpool_stop(void);
+//runs fn on each of the n argument structs and returns once all have finished
+void threadpool_run(void* (*fn)(void *), void* args, size_t arg_size, int n);
+//per-thread buffer of at least size bytes, valid until the next call on the same thread
+void* threadpool_scratch(size_t size);
+void threadpool_unpin(void);
+void threadpool_pin(void);
+
+#endif /* _THREADPOOL_H */
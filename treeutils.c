@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "treeutils.h"
+
+/*
+ * Longest tip to tip path, using distanceFromRoot (which must be up to
+ * date).  The first pass finds the deepest leaf below every node, the
+ * second pass joins the deepest leaves of the two children at every
+ * internal node, which is where that pair's path turns.  Ties go to the
+ * lowest pair of leaf numbers.  Returns the length of the path.
+ */
+double treeutils_diameter(node** tree, int whichTree, int root, int number_of_nodes, int* tipA, int* tipB, int* lca){
+	int i, top, node, child0, child1, a, b, lo, hi;
+	double length, best=-1;
+	int* deepest = (int *)malloc(number_of_nodes*sizeof(int));
+	int* order = (int *)malloc(number_of_nodes*sizeof(int));
+	int* stack = (int *)malloc(number_of_nodes*sizeof(int));
+	int count=0;
+	top=0;
+	stack[0]=root;
+	while(top >= 0){
+		node = stack[top];
+		top--;
+		order[count] = node;
+		count++;
+		if (tree[whichTree][node].up[0] != -1){
+			stack[++top] = tree[whichTree][node].up[0];
+			stack[++top] = tree[whichTree][node].up[1];
+		}
+	}
+	tipA[0]=-1;
+	tipB[0]=-1;
+	lca[0]=-1;
+	//children always come after their parent in order[], so walk it backwards
+	for(i=count-1; i>=0; i--){
+		node = order[i];
+		child0 = tree[whichTree][node].up[0];
+		child1 = tree[whichTree][node].up[1];
+		if (child0 == -1){
+			deepest[node] = node;
+			continue;
+		}
+		a = deepest[child0];
+		b = deepest[child1];
+		if (tree[whichTree][b].distanceFromRoot > tree[whichTree][a].distanceFromRoot || (tree[whichTree][b].distanceFromRoot == tree[whichTree][a].distanceFromRoot && b < a)){
+			deepest[node] = b;
+		}else{
+			deepest[node] = a;
+		}
+		length = tree[whichTree][a].distanceFromRoot + tree[whichTree][b].distanceFromRoot - 2.0*tree[whichTree][node].distanceFromRoot;
+		lo = a < b ? a : b;
+		hi = a < b ? b : a;
+		if (length > best || (length == best && (lo < tipA[0] || (lo == tipA[0] && hi < tipB[0])))){
+			best = length;
+			tipA[0] = lo;
+			tipB[0] = hi;
+			lca[0] = node;
+		}
+	}
+	free(deepest);
+	free(order);
+	free(stack);
+	return best;
+}
+//fills path with tipA, its ancestors up to lca, then down to tipB; returns the number of nodes
+int treeutils_path(node** tree, int whichTree, int tipA, int tipB, int lca, int* path){
+	int node, length=0, tail=0;
+	for(node=tipA; node != lca; node=tree[whichTree][node].down){
+		path[length] = node;
+		length++;
+	}
+	path[length] = lca;
+	length++;
+	for(node=tipB; node != lca; node=tree[whichTree][node].down){
+		tail++;
+	}
+	length = length + tail;
+	int i = length-1;
+	for(node=tipB; node != lca; node=tree[whichTree][node].down){
+		path[i] = node;
+		i--;
+	}
+	return length;
+}
@@ -0,0 +1,16 @@
+#ifndef _TREEUTILS_H
+#define _TREEUTILS_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "global.h"
+
+/*
+ * Linear-time walks over a cluster tree for midpoint rooting: the longest
+ * tip to tip path, which also gives the lowest common ancestor of its two
+ * tips, and the nodes along that path.
+ */
+double treeutils_diameter(node** tree, int whichTree, int root, int number_of_nodes, int* tipA, int* tipB, int* lca);
+int treeutils_path(node** tree, int whichTree, int tipA, int tipB, int lca, int* path);
+
+#endif /* _TREEUTILS_H */